@@ -0,0 +1,58 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <errno.h>
+#include <unistd.h>
+
+// Preloaded by fspec-bench, counts the allocations of the benchmarked process.
+// The count is written to FSPEC_BENCH_ALLOC_FD when the process exits.
+
+void *__libc_malloc(size_t size);
+void *__libc_calloc(size_t nmemb, size_t size);
+void *__libc_realloc(void *ptr, size_t size);
+void *__libc_memalign(size_t alignment, size_t size);
+
+static uint64_t allocs;
+
+void*
+malloc(size_t size)
+{
+   __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+   return __libc_malloc(size);
+}
+
+void*
+calloc(size_t nmemb, size_t size)
+{
+   __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+   return __libc_calloc(nmemb, size);
+}
+
+void*
+realloc(void *ptr, size_t size)
+{
+   __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+   return __libc_realloc(ptr, size);
+}
+
+int
+posix_memalign(void **out, size_t alignment, size_t size)
+{
+   __atomic_fetch_add(&allocs, 1, __ATOMIC_RELAXED);
+   return ((*out = __libc_memalign(alignment, size)) ? 0 : ENOMEM);
+}
+
+__attribute__((destructor))
+static void
+alloc_report(void)
+{
+   const char *fd;
+   if (!(fd = getenv("FSPEC_BENCH_ALLOC_FD")))
+      return;
+
+   char buf[32];
+   const int len = snprintf(buf, sizeof(buf), "%lu\n", (unsigned long)__atomic_load_n(&allocs, __ATOMIC_RELAXED));
+   if (write(atoi(fd), buf, len) != len)
+      return;
+}
@@ -0,0 +1,855 @@
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <time.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <ftw.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <sys/resource.h>
+
+#include <fspec/lexer.h>
+
+#include "compile.h"
+#include "bin/fw/eaf.h"
+#include "util/xxh64.h"
+#include "util/rng.h"
+#include "util/misc.h"
+
+// Throughput of the tools on reproducible synthetic inputs.
+// Every workload runs in its own process, so wall time, peak RSS and allocations
+// are measured the same way for the tools and for the in-process compiler stages.
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+static void
+write_text(FILE *f, uint64_t size, struct rng *rng)
+{
+   assert(f && rng);
+
+   static uint8_t buf[1 << 16];
+   for (size_t n; size; size -= n) {
+      n = (size < sizeof(buf) ? size : sizeof(buf));
+      rng_text(rng, buf, n);
+      if (fwrite(buf, 1, n, f) != n)
+         err(EXIT_FAILURE, "fwrite");
+   }
+}
+
+/** generators return the number of records of input of size, and write the input if f is not NULL */
+struct generator {
+   const char *name;
+   uint64_t (*generate)(FILE *f, const uint64_t size, const uint64_t record, struct rng *rng);
+   uint64_t record; // size of single record
+};
+
+static uint64_t
+gen_text(FILE *f, const uint64_t size, const uint64_t record, struct rng *rng)
+{
+   assert(record && rng);
+   const uint64_t records = (size / record ? size / record : 1);
+
+   if (f)
+      write_text(f, records * record, rng);
+
+   return records;
+}
+
+static uint64_t
+gen_eaf(FILE *f, const uint64_t size, const uint64_t record, struct rng *rng)
+{
+   assert(record && rng);
+   const uint64_t entry = sizeof(struct eaf_file) + record;
+   const uint64_t records = (size / entry ? size / entry : 1);
+
+   if (records > UINT32_MAX)
+      errx(EXIT_FAILURE, "too many #EAF entries: %" PRIu64, records);
+
+   if (!f)
+      return records;
+
+   const uint64_t data = sizeof(struct eaf_header) + records * sizeof(struct eaf_file);
+   const struct eaf_header header = {
+      .magic = "#EAF",
+      .major = 1,
+      .size = data + records * record,
+      .count = records,
+   };
+
+   if (fwrite(&header, sizeof(header), 1, f) != 1)
+      err(EXIT_FAILURE, "fwrite");
+
+   for (uint64_t i = 0; i < records; ++i) {
+      struct eaf_file file = { .offset = data + i * record, .size = record };
+      snprintf(file.path, sizeof(file.path), "bench/%02" PRIx64 "/%08" PRIu64 ".dat", i & 0xff, i);
+      if (fwrite(&file, sizeof(file), 1, f) != 1)
+         err(EXIT_FAILURE, "fwrite");
+   }
+
+   write_text(f, records * record, rng);
+   return records;
+}
+
+// Specs in spec/ without a generator get their input from fspec-gen, or are skipped without it.
+static const struct generator dump_inputs[] = {
+   { "ability", gen_text, 1024 },
+   { "spell", gen_text, 1024 },
+   { "name", gen_text, 32 },
+   { "ftable", gen_text, 2 },
+   { "vtable", gen_text, 1 },
+   { "eaf", gen_eaf, 4096 },
+};
+
+static const struct generator xidec_inputs[] = {
+   { "ability", gen_text, 1024 },
+   { "text", gen_text, 255 },
+};
+
+static const struct generator uneaf_input = { "eaf", gen_eaf, 1 << 16 };
+
+// fspec-gen doesn't report the records it generates
+static const struct generator spec_input = { "spec", NULL, 0 };
+
+enum kind {
+   KIND_DUMP,
+   KIND_XIDEC,
+   KIND_UNEAF,
+   KIND_LEX,
+   KIND_VALIDATE,
+};
+
+struct workload {
+   char name[64];
+   char arg[PATH_MAX]; // spec or xidec type
+   const struct generator *input; // NULL if the workload reads no input
+   enum kind kind;
+   unsigned structs; // structs of a generated spec, 0 otherwise
+};
+
+struct workloads {
+   struct workload *workload;
+   size_t count;
+};
+
+static struct workload*
+workloads_add(struct workloads *workloads, const enum kind kind, const char *name, const char *arg, const struct generator *input)
+{
+   assert(workloads && name && arg);
+
+   if (!(workloads->workload = realloc(workloads->workload, sizeof(*workloads->workload) * (workloads->count + 1))))
+      err(EXIT_FAILURE, "realloc(%zu)", sizeof(*workloads->workload) * (workloads->count + 1));
+
+   struct workload *w = &workloads->workload[workloads->count++];
+   *w = (struct workload){ .kind = kind, .input = input };
+   snprintf(w->name, sizeof(w->name), "%s", name);
+   snprintf(w->arg, sizeof(w->arg), "%s", arg);
+   return w;
+}
+
+struct options {
+   const char *bindir, *specdir, *datadir, *baseline;
+   const char *sizes;
+   char self[PATH_MAX], alloc[PATH_MAX], gen[PATH_MAX], outdir[PATH_MAX], log[PATH_MAX]; // log has stderr of the last run
+   double threshold; // percent of throughput that may be lost against the baseline
+   unsigned runs;
+};
+
+// Specs of increasing size for the compiler stages, their cost per byte of spec should stay flat.
+static const unsigned spec_scales[] = { 16, 128, 1024, 4096 };
+
+/** every struct has members, string literals and references to a member and to an earlier struct */
+static void
+write_scale_spec(FILE *f, const unsigned structs)
+{
+   assert(f && structs);
+
+   for (unsigned i = 0; i < structs; ++i) {
+      fprintf(f, "struct record%u {\n", i);
+      fprintf(f, "   len: u8;\n");
+      fprintf(f, "   tag: u8[8] | matches('r%07u') str;\n", i);
+      fprintf(f, "   name: u8[len] | encoding('ascii') str;\n");
+      fprintf(f, "   kind: u16 hex;\n");
+
+      if (i)
+         fprintf(f, "   parent: struct record%u;\n", i / 2);
+
+      fprintf(f, "   values: u32[len][2] dec;\n");
+      fprintf(f, "};\n\n");
+   }
+
+   fprintf(f, "struct scale {\n   records: struct record%u[$];\n};\n", structs - 1);
+}
+
+static void
+scale_spec_prepare(const struct options *options, const unsigned structs, char *out_path, const size_t out_sz)
+{
+   assert(options && structs && out_path);
+
+   const int ret = snprintf(out_path, out_sz, "%s/scale-%u.fspec", options->datadir, structs);
+   if (ret < 0 || (size_t)ret >= out_sz)
+      errx(EXIT_FAILURE, "%s: path is too long", options->datadir);
+
+   if (!access(out_path, R_OK))
+      return;
+
+   char tmp[PATH_MAX + 32];
+   snprintf(tmp, sizeof(tmp), "%s.%ld", out_path, (long)getpid());
+
+   FILE *f;
+   if (!(f = fopen(tmp, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", tmp);
+
+   write_scale_spec(f, structs);
+
+   if (fclose(f) || rename(tmp, out_path) == -1)
+      err(EXIT_FAILURE, "%s", out_path);
+}
+
+static void
+workloads_init(struct workloads *workloads, const struct options *options)
+{
+   assert(workloads && options);
+
+   struct dirent **entries;
+   int n;
+   if ((n = scandir(options->specdir, &entries, is_spec, alphasort)) == -1)
+      err(EXIT_FAILURE, "scandir(%s)", options->specdir);
+
+   char name[64], path[PATH_MAX];
+   for (int i = 0; i < n; ++i) {
+      const int len = (int)strlen(entries[i]->d_name) - 6;
+      snprintf(path, sizeof(path), "%s/%s", options->specdir, entries[i]->d_name);
+
+      snprintf(name, sizeof(name), "lex/%.*s", len, entries[i]->d_name);
+      workloads_add(workloads, KIND_LEX, name, path, NULL);
+      snprintf(name, sizeof(name), "validate/%.*s", len, entries[i]->d_name);
+      workloads_add(workloads, KIND_VALIDATE, name, path, NULL);
+
+      const struct generator *input = NULL;
+      for (size_t g = 0; g < ARRAY_SIZE(dump_inputs) && !input; ++g) {
+         if ((int)strlen(dump_inputs[g].name) == len && !strncmp(dump_inputs[g].name, entries[i]->d_name, len))
+            input = &dump_inputs[g];
+      }
+
+      snprintf(name, sizeof(name), "dump/%.*s", len, entries[i]->d_name);
+      if (input) {
+         workloads_add(workloads, KIND_DUMP, name, path, input);
+      } else if (!access(options->gen, X_OK)) {
+         workloads_add(workloads, KIND_DUMP, name, path, &spec_input);
+      } else {
+         warnx("%s: no input generator and no fspec-gen, skipped", name);
+      }
+
+      free(entries[i]);
+   }
+
+   free(entries);
+
+   for (size_t i = 0; i < ARRAY_SIZE(spec_scales); ++i) {
+      scale_spec_prepare(options, spec_scales[i], path, sizeof(path));
+      snprintf(name, sizeof(name), "lex/scale-%u", spec_scales[i]);
+      workloads_add(workloads, KIND_LEX, name, path, NULL)->structs = spec_scales[i];
+      snprintf(name, sizeof(name), "validate/scale-%u", spec_scales[i]);
+      workloads_add(workloads, KIND_VALIDATE, name, path, NULL)->structs = spec_scales[i];
+   }
+
+   for (size_t i = 0; i < ARRAY_SIZE(xidec_inputs); ++i) {
+      snprintf(name, sizeof(name), "xidec/%s", xidec_inputs[i].name);
+      workloads_add(workloads, KIND_XIDEC, name, xidec_inputs[i].name, &xidec_inputs[i]);
+   }
+
+   workloads_add(workloads, KIND_UNEAF, "uneaf", "", &uneaf_input);
+}
+
+/** returns false if fspec-gen can't generate input for the spec */
+static bool
+spec_generate(const struct options *options, const char *spec, const uint64_t size, const uint64_t seed, const char *path)
+{
+   assert(options && spec && path);
+
+   char size_arg[32], seed_arg[32];
+   snprintf(size_arg, sizeof(size_arg), "%" PRIu64, size);
+   snprintf(seed_arg, sizeof(seed_arg), "%" PRIu64, seed);
+
+   pid_t pid;
+   if ((pid = fork()) == -1)
+      err(EXIT_FAILURE, "fork");
+
+   if (!pid) {
+      int fd;
+      if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+         err(EXIT_FAILURE, "open(%s)", path);
+
+      dup2(fd, STDOUT_FILENO);
+      execv(options->gen, (char*[]){ (char*)options->gen, "-s", size_arg, "-S", seed_arg, (char*)spec, NULL });
+      warn("execv(%s)", options->gen);
+      _exit(EXIT_FAILURE);
+   }
+
+   int status;
+   while (waitpid(pid, &status, 0) == -1) {
+      if (errno != EINTR)
+         err(EXIT_FAILURE, "waitpid");
+   }
+
+   return (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+/** generates the input once for every workload and size, returns false if it can't be generated */
+static bool
+input_prepare(const struct options *options, const struct workload *w, const char *size_name, const uint64_t size, char *out_path, const size_t out_sz, uint64_t *out_records)
+{
+   assert(options && w && w->input && size_name && out_path && out_records);
+
+   int ret;
+   if (w->input->generate) {
+      ret = snprintf(out_path, out_sz, "%s/%s-%" PRIu64 "-%s.bin", options->datadir, w->input->name, w->input->record, size_name);
+   } else {
+      const char *spec = (strrchr(w->arg, '/') ? strrchr(w->arg, '/') + 1 : w->arg);
+      ret = snprintf(out_path, out_sz, "%s/%.*s-%s-%s.bin", options->datadir, (int)strlen(spec) - 6, spec, w->input->name, size_name);
+   }
+
+   if (ret < 0 || (size_t)ret >= out_sz)
+      errx(EXIT_FAILURE, "%s: path is too long", options->datadir);
+
+   // the seed only depends on the input, so the same input is generated everywhere
+   struct rng rng = { .state = xxh64(out_path + strlen(options->datadir), strlen(out_path + strlen(options->datadir)), 0) };
+
+   if (!access(out_path, R_OK)) {
+      *out_records = (w->input->generate ? w->input->generate(NULL, size, w->input->record, &rng) : 0);
+      return true;
+   }
+
+   char tmp[PATH_MAX + 32];
+   snprintf(tmp, sizeof(tmp), "%s.%ld", out_path, (long)getpid());
+
+   *out_records = 0;
+   if (w->input->generate) {
+      FILE *f;
+      if (!(f = fopen(tmp, "wb")))
+         err(EXIT_FAILURE, "fopen(%s, wb)", tmp);
+
+      *out_records = w->input->generate(f, size, w->input->record, &rng);
+
+      if (fclose(f))
+         err(EXIT_FAILURE, "%s", tmp);
+   } else if (!spec_generate(options, w->arg, size, rng.state, tmp)) {
+      unlink(tmp);
+      return false;
+   }
+
+   if (rename(tmp, out_path) == -1)
+      err(EXIT_FAILURE, "%s", out_path);
+
+   return true;
+}
+
+struct result {
+   double seconds;
+   long maxrss; // KiB
+   uint64_t allocs;
+   bool has_allocs;
+};
+
+static int
+remove_entry(const char *path, const struct stat *st, int flag, struct FTW *ftw)
+{
+   (void)st, (void)flag, (void)ftw;
+   return remove(path);
+}
+
+static bool
+run(const struct options *options, char *const argv[], const char *input, struct result *out)
+{
+   assert(options && argv && out);
+
+   int pipefd[2];
+   if (pipe2(pipefd, O_CLOEXEC) == -1)
+      err(EXIT_FAILURE, "pipe2");
+
+   struct timespec start, end;
+   clock_gettime(CLOCK_MONOTONIC, &start);
+
+   pid_t pid;
+   if ((pid = fork()) == -1)
+      err(EXIT_FAILURE, "fork");
+
+   if (!pid) {
+      int in, null, log;
+      if ((in = open((input ? input : "/dev/null"), O_RDONLY)) == -1 || (null = open("/dev/null", O_WRONLY)) == -1)
+         err(EXIT_FAILURE, "open(%s)", (input ? input : "/dev/null"));
+
+      if ((log = open(options->log, O_WRONLY | O_CREAT | O_TRUNC, 0644)) == -1)
+         err(EXIT_FAILURE, "open(%s)", options->log);
+
+      dup2(in, STDIN_FILENO);
+      dup2(null, STDOUT_FILENO);
+      dup2(log, STDERR_FILENO);
+
+      // the write end stays open across exec for the allocation counter
+      char fd[16];
+      snprintf(fd, sizeof(fd), "%d", pipefd[1]);
+      fcntl(pipefd[1], F_SETFD, 0);
+      setenv("FSPEC_BENCH_ALLOC_FD", fd, 1);
+
+      if (!access(options->alloc, R_OK))
+         setenv("LD_PRELOAD", options->alloc, 1);
+
+      execv(argv[0], argv);
+      warn("execv(%s)", argv[0]);
+      _exit(EXIT_FAILURE);
+   }
+
+   close(pipefd[1]);
+
+   int status;
+   struct rusage ru;
+   while (wait4(pid, &status, 0, &ru) == -1) {
+      if (errno != EINTR)
+         err(EXIT_FAILURE, "wait4");
+   }
+
+   clock_gettime(CLOCK_MONOTONIC, &end);
+
+   char buf[32] = {0};
+   ssize_t r;
+   while ((r = read(pipefd[0], buf, sizeof(buf) - 1)) == -1 && errno == EINTR);
+   close(pipefd[0]);
+
+   *out = (struct result){
+      .seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9,
+      .maxrss = ru.ru_maxrss,
+      .allocs = strtoull(buf, NULL, 10),
+      .has_allocs = (r > 0),
+   };
+
+   return (WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS);
+}
+
+static bool
+run_workload(const struct options *options, const struct workload *w, const char *input, const uint64_t size, uint64_t *out_bytes, uint64_t *out_records, struct result *out)
+{
+   assert(options && w && (input || !w->input) && out_bytes && out_records && out);
+
+   char path[PATH_MAX], iterations[32]; // path of the tool or of the bytecode
+   char *argv[5] = {0};
+
+   if (w->input) {
+      struct stat st;
+      if (stat(input, &st) == -1)
+         err(EXIT_FAILURE, "stat(%s)", input);
+
+      *out_bytes = st.st_size;
+   }
+
+   switch (w->kind) {
+      case KIND_DUMP:
+         snprintf(path, sizeof(path), "%s/fspec-dump", options->bindir);
+         argv[0] = path, argv[1] = (char*)w->arg;
+         break;
+
+      case KIND_XIDEC:
+         snprintf(path, sizeof(path), "%s/xidec", options->bindir);
+         argv[0] = path, argv[1] = (char*)w->arg;
+         break;
+
+      case KIND_UNEAF:
+         snprintf(path, sizeof(path), "%s/uneaf", options->bindir);
+         argv[0] = path, argv[1] = (char*)options->outdir, argv[2] = (char*)input;
+         break;
+
+      case KIND_LEX:
+      case KIND_VALIDATE:
+         {
+            // Specs are tiny, the stage is repeated until at least size bytes of spec have been processed.
+            struct stat st;
+            if (stat(w->arg, &st) == -1)
+               err(EXIT_FAILURE, "stat(%s)", w->arg);
+
+            *out_records = (st.st_size ? (size + st.st_size - 1) / st.st_size : 1);
+            *out_bytes = *out_records * st.st_size;
+            snprintf(iterations, sizeof(iterations), "%" PRIu64, *out_records);
+            argv[0] = (char*)options->self, argv[1] = "--lex";
+            argv[2] = (char*)w->arg, argv[3] = iterations;
+
+            if (w->kind == KIND_LEX)
+               break;
+
+            // The validator runs on bytecode lexed beforehand, so the lexer doesn't count against it.
+            const char *spec = (strrchr(w->arg, '/') ? strrchr(w->arg, '/') + 1 : w->arg);
+            snprintf(path, sizeof(path), "%s/%.*s.bc", options->datadir, (int)strlen(spec) - 6, spec);
+
+            struct result result;
+            if (!run(options, (char*[]){ argv[0], argv[1], argv[2], "1", path, NULL }, NULL, &result))
+               return false;
+
+            argv[1] = "--validate", argv[2] = path;
+         }
+         break;
+   }
+
+   // the fastest run is the least disturbed one
+   bool ok = true;
+   for (unsigned i = 0; ok && i < options->runs; ++i) {
+      // uneaf would skip the entries it extracted on the previous run
+      if (w->kind == KIND_UNEAF)
+         nftw(options->outdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+      struct result result;
+      if ((ok = run(options, argv, (w->kind == KIND_UNEAF || !w->input ? NULL : input), &result)) && (!i || result.seconds < out->seconds))
+         *out = result;
+   }
+
+   if (w->kind == KIND_UNEAF)
+      nftw(options->outdir, remove_entry, 16, FTW_DEPTH | FTW_PHYS);
+
+   return ok;
+}
+
+struct baseline {
+   char *data;
+   size_t size;
+};
+
+/** returns throughput of the workload in the baseline, or 0 if it isn't there */
+static double
+baseline_get(const struct baseline *baseline, const char *name, const char *size_name)
+{
+   assert(baseline && name && size_name);
+
+   if (!baseline->data)
+      return 0;
+
+   char key[128];
+   const int len = snprintf(key, sizeof(key), "%s\t%s\t", name, size_name);
+   for (const char *line = baseline->data; line && *line; line = strchr(line, '\n'), line = (line ? line + 1 : NULL)) {
+      if (strncmp(line, key, len))
+         continue;
+
+      // bytes, records and seconds come before MB/s
+      const char *field = line + len;
+      for (uint8_t i = 0; i < 3 && field; ++i)
+         field = ((field = strchr(field, '\t')) ? field + 1 : NULL);
+
+      return (field ? strtod(field, NULL) : 0);
+   }
+
+   return 0;
+}
+
+static void
+baseline_load(struct baseline *baseline, const char *path)
+{
+   assert(baseline && path);
+
+   FILE *f;
+   if (!(f = fopen(path, "rb")))
+      err(EXIT_FAILURE, "fopen(%s, rb)", path);
+
+   size_t len = 0;
+   for (size_t r; (baseline->data = realloc(baseline->data, len + 4096 + 1)) && (r = fread(baseline->data + len, 1, 4096, f)) > 0; len += r);
+
+   if (!baseline->data)
+      err(EXIT_FAILURE, "realloc(%zu)", len + 4096 + 1);
+
+   baseline->data[len] = 0;
+   baseline->size = len;
+   fclose(f);
+}
+
+/** compares cost per byte of the stage on the generated specs to the smallest one */
+static void
+report_growth(FILE *out, const struct workloads *workloads, const double *cost, const enum kind kind, const char *stage, const char *size_name)
+{
+   assert(out && workloads && cost && stage && size_name);
+
+   double worst = 0;
+   const struct workload *first = NULL, *worst_w = NULL;
+   for (size_t i = 0; i < workloads->count; ++i) {
+      const struct workload *w = &workloads->workload[i];
+      if (w->kind != kind || !w->structs || cost[i] <= 0)
+         continue;
+
+      if (!first) {
+         first = w;
+         fprintf(out, "# %s %s cost per byte against %u structs:", stage, size_name, w->structs);
+         continue;
+      }
+
+      // a stage that is linear in the spec stays near 1
+      const double growth = cost[i] / cost[first - workloads->workload];
+      fprintf(out, " %u %.2f", w->structs, growth);
+
+      if (growth > worst)
+         worst = growth, worst_w = w;
+   }
+
+   if (first)
+      fprintf(out, "\n");
+
+   fflush(out);
+
+   if (worst >= 2)
+      warnx("%s %s: cost per byte of %u structs is %.2fx of %u structs", stage, size_name, worst_w->structs, worst, first->structs);
+}
+
+static int
+bench(const struct options *options, FILE *out)
+{
+   assert(options && out);
+
+   if (mkdir(options->datadir, 0755) == -1 && errno != EEXIST)
+      err(EXIT_FAILURE, "mkdir(%s)", options->datadir);
+
+   struct workloads workloads = {0};
+   workloads_init(&workloads, options);
+
+   struct baseline baseline = {0};
+   if (options->baseline)
+      baseline_load(&baseline, options->baseline);
+
+   fprintf(out, "# workload\tsize\tbytes\trecords\tseconds\tmb_per_s\trecords_per_s\tmaxrss_kb\tallocs\n");
+   fflush(out);
+
+   double *cost; // seconds per byte of the workloads on the current size
+   if (!(cost = calloc(workloads.count, sizeof(*cost))))
+      err(EXIT_FAILURE, "calloc(%zu)", workloads.count * sizeof(*cost));
+
+   static char input[PATH_MAX];
+   size_t regressions = 0;
+   for (const char *s = options->sizes; s && *s; s = strchr(s, ','), s = (s ? s + 1 : NULL)) {
+      char size_name[32];
+      snprintf(size_name, sizeof(size_name), "%.*s", (int)(strchr(s, ',') ? strchr(s, ',') - s : (ptrdiff_t)strlen(s)), s);
+      const char *end;
+      const uint64_t size = parse_size(s, &end);
+      if (!size || (*end && *end != ','))
+         errx(EXIT_FAILURE, "invalid size: %s", s);
+
+      memset(cost, 0, workloads.count * sizeof(*cost));
+
+      for (size_t i = 0; i < workloads.count; ++i) {
+         const struct workload *w = &workloads.workload[i];
+
+         struct result result = {0};
+         uint64_t bytes = 0, records = 0;
+         if (w->input && !input_prepare(options, w, size_name, size, input, sizeof(input), &records)) {
+            warnx("%s %s: fspec-gen can't generate input, skipped", w->name, size_name);
+            continue;
+         }
+
+         if (!run_workload(options, w, (w->input ? input : NULL), size, &bytes, &records, &result)) {
+            warnx("%s %s: failed, see %s", w->name, size_name, options->log);
+            continue;
+         }
+
+         const double seconds = (result.seconds > 0 ? result.seconds : 1e-9);
+         const double mbs = bytes / seconds / (1 << 20);
+         cost[i] = (bytes ? seconds / bytes : 0);
+         char allocs[32] = "-";
+         if (result.has_allocs)
+            snprintf(allocs, sizeof(allocs), "%" PRIu64, result.allocs);
+
+         fprintf(out, "%s\t%s\t%" PRIu64 "\t%" PRIu64 "\t%.6f\t%.2f\t%.0f\t%ld\t%s\n",
+               w->name, size_name, bytes, records, seconds, mbs, records / seconds, result.maxrss, allocs);
+         fflush(out);
+
+         const double base = baseline_get(&baseline, w->name, size_name);
+         if (base > 0 && mbs < base * (1 - options->threshold / 100)) {
+            warnx("%s %s: %.2f MB/s, baseline %.2f MB/s (%+.1f%%)", w->name, size_name, mbs, base, (mbs / base - 1) * 100);
+            ++regressions;
+         }
+      }
+
+      report_growth(out, &workloads, cost, KIND_LEX, "lex", size_name);
+      report_growth(out, &workloads, cost, KIND_VALIDATE, "validate", size_name);
+   }
+
+   free(cost);
+   free(baseline.data);
+   free(workloads.workload);
+
+   if (regressions)
+      warnx("%zu throughput regressions against %s", regressions, options->baseline);
+
+   return (regressions ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+struct source {
+   struct fspec_lexer lexer;
+   const char *data;
+   size_t len, offset;
+};
+
+static size_t
+source_read(struct fspec_lexer *lexer, void *ptr, const size_t size, const size_t nmemb)
+{
+   assert(lexer && ptr && size);
+   struct source *s = (struct source*)lexer;
+   const size_t n = ((s->len - s->offset) / size < nmemb ? (s->len - s->offset) / size : nmemb);
+   memcpy(ptr, s->data + s->offset, n * size);
+   s->offset += n * size;
+   return n;
+}
+
+static struct fspec_mem
+read_file(const char *path)
+{
+   assert(path);
+
+   FILE *f;
+   if (!(f = fopen(path, "rb")))
+      err(EXIT_FAILURE, "fopen(%s, rb)", path);
+
+   struct stat st;
+   if (fstat(fileno(f), &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", path);
+
+   struct fspec_mem mem = { .len = st.st_size };
+   if (!(mem.data = malloc(mem.len + 1)))
+      err(EXIT_FAILURE, "malloc(%zu)", mem.len + 1);
+
+   if (fread(mem.data, 1, mem.len, f) != mem.len)
+      err(EXIT_FAILURE, "fread(%s)", path);
+
+   fclose(f);
+   return mem;
+}
+
+/** runs the lexer on the spec iterations times, and writes the bytecode to out if not NULL */
+static void
+stage_lex(const char *path, const uint64_t iterations, const char *out)
+{
+   assert(path);
+
+   const struct fspec_mem spec = read_file(path);
+   const size_t len = lexer_output_size(spec.len);
+
+   char input[4096];
+   struct source s = {
+      .lexer = {
+         .ops.read = source_read,
+         .mem.input = { .data = input, .len = sizeof(input) },
+      },
+      .data = spec.data,
+      .len = spec.len,
+   };
+
+   void *output;
+   if (!(output = malloc(len)))
+      err(EXIT_FAILURE, "malloc(%zu)", len);
+
+   for (uint64_t i = 0; i < iterations; ++i) {
+      s.offset = 0;
+      s.lexer.mem.output = (struct fspec_mem){ .data = output, .len = len };
+      const bool ok = fspec_lexer_parse(&s.lexer, path);
+      output = s.lexer.mem.output.data;
+
+      if (!ok)
+         exit(EXIT_FAILURE);
+   }
+
+   FILE *f;
+   if (out && (!(f = fopen(out, "wb")) || fwrite(output, 1, s.lexer.mem.output.len, f) != s.lexer.mem.output.len || fclose(f)))
+      err(EXIT_FAILURE, "%s", out);
+
+   free(output);
+   free(spec.data);
+}
+
+/** runs the validator on the bytecode iterations times */
+static void
+stage_validate(const char *path, const uint64_t iterations)
+{
+   assert(path);
+
+   struct fspec_mem bcode = read_file(path);
+   for (uint64_t i = 0; i < iterations; ++i) {
+      if (!validate(&bcode, path))
+         exit(EXIT_FAILURE);
+   }
+
+   free(bcode.data);
+}
+
+int
+main(int argc, char *argv[])
+{
+   if ((argc == 4 || argc == 5) && !strcmp(argv[1], "--lex")) {
+      stage_lex(argv[2], strtoull(argv[3], NULL, 10), (argc == 5 ? argv[4] : NULL));
+      return EXIT_SUCCESS;
+   }
+
+   if (argc == 4 && !strcmp(argv[1], "--validate")) {
+      stage_validate(argv[2], strtoull(argv[3], NULL, 10));
+      return EXIT_SUCCESS;
+   }
+
+   static struct options options = {
+      .bindir = ".",
+      .specdir = "spec",
+      .datadir = "bench-data",
+      .sizes = "1M",
+      .threshold = 10,
+      .runs = 3,
+   };
+
+   const char *output = NULL;
+   for (int i = 1; i < argc; ++i) {
+      if (i + 1 >= argc) {
+         errx(EXIT_FAILURE, "usage: %s [-p bindir] [-S specdir] [-d datadir] [-s size,...] [-r runs] [-o out.tsv] [-b baseline.tsv [-t percent]]", argv[0]);
+      } else if (!strcmp(argv[i], "-p")) {
+         options.bindir = argv[++i];
+      } else if (!strcmp(argv[i], "-S")) {
+         options.specdir = argv[++i];
+      } else if (!strcmp(argv[i], "-d")) {
+         options.datadir = argv[++i];
+      } else if (!strcmp(argv[i], "-s")) {
+         options.sizes = argv[++i];
+      } else if (!strcmp(argv[i], "-r")) {
+         options.runs = strtoul(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "-o")) {
+         output = argv[++i];
+      } else if (!strcmp(argv[i], "-b")) {
+         options.baseline = argv[++i];
+      } else if (!strcmp(argv[i], "-t")) {
+         options.threshold = strtod(argv[++i], NULL);
+      } else {
+         errx(EXIT_FAILURE, "unknown option: %s", argv[i]);
+      }
+   }
+
+   if (!options.runs)
+      errx(EXIT_FAILURE, "-r needs at least one run");
+
+   // workloads of the compiler stages run this binary again
+   const ssize_t len = readlink("/proc/self/exe", options.self, sizeof(options.self) - 1);
+   if (len == -1)
+      err(EXIT_FAILURE, "readlink(/proc/self/exe)");
+
+   options.self[len] = 0;
+   snprintf(options.alloc, sizeof(options.alloc), "%s/bench-alloc.so", options.bindir);
+   snprintf(options.gen, sizeof(options.gen), "%s/fspec-gen", options.bindir);
+   snprintf(options.outdir, sizeof(options.outdir), "%s/uneaf.out", options.datadir);
+   snprintf(options.log, sizeof(options.log), "%s/stderr.log", options.datadir);
+
+   FILE *out = stdout;
+   if (output && !(out = fopen(output, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", output);
+
+   const int ret = bench(&options, out);
+
+   if (out != stdout && fclose(out))
+      err(EXIT_FAILURE, "fclose(%s)", output);
+
+   return ret;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+
+// See spec/eaf.fspec and spec/emz.fspec
+
+struct eaf_header {
+   uint8_t magic[4];
+   uint16_t major, minor;
+   uint64_t size;
+   uint32_t count;
+   uint64_t unknown;
+   uint8_t padding[100];
+} __attribute__((packed));
+
+struct eaf_file {
+   char path[256];
+   uint64_t offset, size;
+   uint8_t padding[16];
+} __attribute__((packed));
+
+struct emz_header {
+   uint8_t magic[4];
+   uint32_t unknown;
+   uint32_t size;
+   uint32_t offset;
+} __attribute__((packed));
@@ -0,0 +1,347 @@
+#define _XOPEN_SOURCE 700
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <zlib.h>
+
+#include "eaf.h"
+
+// Meaning of these is unknown, they are not checked by uneaf either
+#define EAF_MAJOR 1
+#define EAF_MINOR 0
+
+// Size of the stdio buffer for the archive, payloads are written strictly sequentially
+#define WRITE_BUFFER_SIZE (8 * 1024 * 1024)
+
+struct entry {
+   char *path; // path on disk
+   const char *name; // path inside the archive, points inside path
+   const uint8_t *map; // mapped input, stored entries are written from here
+   uint8_t *payload; // #EMZ payload, NULL if the entry is stored
+   size_t size, payload_size;
+   bool ready;
+};
+
+static struct {
+   struct entry *entries;
+   size_t count, len, prefix;
+} list;
+
+static int
+list_append_ftw(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+   (void)st, (void)ftw;
+
+   if (type == FTW_DNR || type == FTW_NS)
+      errx(EXIT_FAILURE, "%s: cannot access", path);
+
+   if (type != FTW_F)
+      return 0;
+
+   if (list.count >= list.len) {
+      list.len = (list.len ? list.len * 2 : 1024);
+      if (!(list.entries = realloc(list.entries, list.len * sizeof(*list.entries))))
+         err(EXIT_FAILURE, "realloc(%zu)", list.len * sizeof(*list.entries));
+   }
+
+   char *copy;
+   if (!(copy = strdup(path)))
+      err(EXIT_FAILURE, "strdup");
+
+   struct entry *e = &list.entries[list.count++];
+   *e = (struct entry){ .path = copy, .name = copy + list.prefix };
+
+   if (strlen(e->name) >= sizeof(((struct eaf_file*)0)->path))
+      errx(EXIT_FAILURE, "%s: path is too long for #EAF", e->name);
+
+   return 0;
+}
+
+static int
+entry_cmp(const void *a, const void *b)
+{
+   return strcmp(((const struct entry*)a)->name, ((const struct entry*)b)->name);
+}
+
+static void
+entry_map(struct entry *e)
+{
+   assert(e);
+
+   int fd;
+   if ((fd = open(e->path, O_RDONLY | O_CLOEXEC)) == -1)
+      err(EXIT_FAILURE, "open(%s)", e->path);
+
+   struct stat st;
+   if (fstat(fd, &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", e->path);
+
+   e->size = st.st_size;
+
+   void *map;
+   if (e->size && (map = mmap(NULL, e->size, PROT_READ, MAP_SHARED, fd, 0)) != MAP_FAILED) {
+      e->map = map;
+   } else if (e->size) {
+      err(EXIT_FAILURE, "mmap(%s)", e->path);
+   }
+
+   close(fd);
+}
+
+static void
+entry_unmap(struct entry *e)
+{
+   assert(e);
+
+   if (e->map)
+      munmap((void*)e->map, e->size);
+
+   e->map = NULL;
+}
+
+static void
+entry_deflate(struct entry *e, const int level)
+{
+   assert(e);
+
+   // #EMZ stores the inflated size in 32 bits.
+   if (e->size > UINT32_MAX)
+      return;
+
+   // Meaning of unknown is not verified against real archives, crc32 of the content is a guess.
+   // Writing it keeps archives made here consistent with uneaf, which checks the same guess when verifying.
+   struct emz_header header = {
+      .magic = { '#', 'E', 'M', 'Z' },
+      .unknown = crc32(0, e->map, e->size),
+      .size = e->size,
+      .offset = sizeof(header),
+   };
+
+   // #EMZ payloads are raw deflate streams without zlib header
+   z_stream stream = {0};
+   if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      errx(EXIT_FAILURE, "deflateInit2(%s): %s", e->name, (stream.msg ? stream.msg : "failed"));
+
+   const size_t bound = sizeof(header) + deflateBound(&stream, e->size);
+   if (!(e->payload = malloc(bound)))
+      err(EXIT_FAILURE, "malloc(%zu)", bound);
+
+   memcpy(e->payload, &header, sizeof(header));
+   stream.next_in = (Bytef*)e->map;
+   stream.avail_in = e->size;
+   stream.next_out = e->payload + sizeof(header);
+   stream.avail_out = bound - sizeof(header);
+
+   if (deflate(&stream, Z_FINISH) != Z_STREAM_END)
+      errx(EXIT_FAILURE, "deflate(%s): %s", e->name, (stream.msg ? stream.msg : "failed"));
+
+   e->payload_size = sizeof(header) + stream.total_out;
+   deflateEnd(&stream);
+}
+
+static bool
+entry_needs_emz(const struct entry *e)
+{
+   // Stored content that starts with #EMZ would be taken as compressed by uneaf.
+   return e->size >= 4 && !memcmp(e->map, "#EMZ", 4);
+}
+
+struct job {
+   pthread_mutex_t mutex;
+   pthread_cond_t ready, space;
+   size_t next, written, window;
+   int level;
+   bool store; // only compress when uneaf would otherwise misread the entry
+};
+
+static void*
+worker(void *arg)
+{
+   assert(arg);
+   struct job *job = arg;
+
+   for (;;) {
+      // Don't run too far ahead of the writer, compressed payloads wait in memory.
+      pthread_mutex_lock(&job->mutex);
+      while (job->next < list.count && job->next >= job->written + job->window)
+         pthread_cond_wait(&job->space, &job->mutex);
+
+      if (job->next >= list.count) {
+         pthread_mutex_unlock(&job->mutex);
+         break;
+      }
+
+      struct entry *e = &list.entries[job->next++];
+      pthread_mutex_unlock(&job->mutex);
+
+      entry_map(e);
+
+      if (!job->store || entry_needs_emz(e)) {
+         entry_deflate(e, job->level);
+
+         // Not worth it, store instead.
+         if (e->payload && e->payload_size >= e->size && !entry_needs_emz(e)) {
+            free(e->payload);
+            e->payload = NULL;
+         }
+      }
+
+      if (e->payload)
+         entry_unmap(e);
+
+      pthread_mutex_lock(&job->mutex);
+      e->ready = true;
+      pthread_cond_broadcast(&job->ready);
+      pthread_mutex_unlock(&job->mutex);
+   }
+
+   return NULL;
+}
+
+static void
+fwrite_or_die(const void *data, const size_t size, FILE *f, const char *path)
+{
+   if (size && fwrite(data, 1, size, f) != size)
+      err(EXIT_FAILURE, "fwrite(%s)", path);
+}
+
+static void
+pack(const char *out, const char *dir, size_t threads, const int level, const bool store)
+{
+   assert(out && dir);
+
+   list.prefix = strlen(dir) + (dir[strlen(dir) - 1] != '/');
+   if (nftw(dir, list_append_ftw, 64, FTW_PHYS) == -1)
+      err(EXIT_FAILURE, "nftw(%s)", dir);
+
+   if (list.count > UINT32_MAX)
+      errx(EXIT_FAILURE, "too many files: %zu", list.count);
+
+   qsort(list.entries, list.count, sizeof(*list.entries), entry_cmp);
+
+   struct eaf_file *table;
+   if (!(table = calloc(list.count ? list.count : 1, sizeof(*table))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", list.count, sizeof(*table));
+
+   FILE *f;
+   if (!(f = fopen(out, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", out);
+
+   setvbuf(f, NULL, _IOFBF, WRITE_BUFFER_SIZE);
+
+   // Header and the file table are written last, once every offset is known.
+   uint64_t offset = sizeof(struct eaf_header) + list.count * sizeof(*table);
+   if (fseeko(f, offset, SEEK_SET) == -1)
+      err(EXIT_FAILURE, "fseeko(%s)", out);
+
+   threads = (threads ? threads : 1);
+   struct job job = {
+      .mutex = PTHREAD_MUTEX_INITIALIZER,
+      .ready = PTHREAD_COND_INITIALIZER,
+      .space = PTHREAD_COND_INITIALIZER,
+      .window = threads * 4,
+      .level = level,
+      .store = store,
+   };
+
+   pthread_t *tid;
+   if (!(tid = calloc(threads, sizeof(*tid))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", threads, sizeof(*tid));
+
+   for (size_t i = 0; i < threads; ++i) {
+      if ((errno = pthread_create(&tid[i], NULL, worker, &job)))
+         err(EXIT_FAILURE, "pthread_create");
+   }
+
+   // Write payloads in table order as they become ready.
+   for (size_t i = 0; i < list.count; ++i) {
+      struct entry *e = &list.entries[i];
+
+      pthread_mutex_lock(&job.mutex);
+      while (!e->ready)
+         pthread_cond_wait(&job.ready, &job.mutex);
+      pthread_mutex_unlock(&job.mutex);
+
+      const uint8_t *data = (e->payload ? e->payload : e->map);
+      const size_t size = (e->payload ? e->payload_size : e->size);
+      fwrite_or_die(data, size, f, out);
+
+      memcpy(table[i].path, e->name, strlen(e->name));
+      table[i].offset = offset;
+      table[i].size = size;
+      offset += size;
+
+      warnx("%s%s", e->name, (e->payload ? " (#EMZ)" : ""));
+      free(e->payload);
+      entry_unmap(e);
+      free(e->path);
+
+      pthread_mutex_lock(&job.mutex);
+      job.written = i + 1;
+      pthread_cond_broadcast(&job.space);
+      pthread_mutex_unlock(&job.mutex);
+   }
+
+   for (size_t i = 0; i < threads; ++i)
+      pthread_join(tid[i], NULL);
+
+   const struct eaf_header header = {
+      .magic = { '#', 'E', 'A', 'F' },
+      .major = EAF_MAJOR,
+      .minor = EAF_MINOR,
+      .size = offset,
+      .count = list.count,
+   };
+
+   if (fseeko(f, 0, SEEK_SET) == -1)
+      err(EXIT_FAILURE, "fseeko(%s)", out);
+
+   fwrite_or_die(&header, sizeof(header), f, out);
+   fwrite_or_die(table, list.count * sizeof(*table), f, out);
+
+   if (fclose(f))
+      err(EXIT_FAILURE, "fclose(%s)", out);
+
+   free(tid);
+   free(table);
+   free(list.entries);
+}
+
+int
+main(int argc, char *argv[])
+{
+   bool store = false;
+   int level = Z_DEFAULT_COMPRESSION;
+   long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   int i;
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-s")) {
+         store = true;
+      } else if (!strcmp(argv[i], "-z") && i + 1 < argc) {
+         level = strtol(argv[++i], NULL, 10);
+         level = (level < 0 ? 0 : (level > 9 ? 9 : level));
+      } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+         threads = strtol(argv[++i], NULL, 10);
+      } else {
+         break;
+      }
+   }
+
+   if (argc - i != 2)
+      errx(EXIT_FAILURE, "usage: %s [-s | -z level] [-j threads] archive dir", argv[0]);
+
+   pack(argv[i], argv[i + 1], (threads > 0 ? threads : 1), level, store);
+   return EXIT_SUCCESS;
+}
@@ -1,208 +1,927 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/ioctl.h>
+#include <linux/fs.h>
+#include <fnmatch.h>
 #include <zlib.h>
 
+#include "eaf.h"
+#include "util/xxh64.h"
+#include "util/crc32.h"
+#include "util/hashidx.h"
+#include "util/workers.h"
+
 static const char *stdin_name = "/dev/stdin";
 
-int ZEXPORT uncompress2 (dest, destLen, source, sourceLen)
-    Bytef *dest;
-    uLongf *destLen;
-    const Bytef *source;
-    uLong *sourceLen;
-{
-    z_stream stream;
-    int err;
-    const uInt max = (uInt)-1;
-    uLong len, left;
-    Byte buf[1];    /* for detection of incomplete stream when *destLen == 0 */
-
-    len = *sourceLen;
-    if (*destLen) {
-        left = *destLen;
-        *destLen = 0;
-    }
-    else {
-        left = 1;
-        dest = buf;
-    }
-
-    stream.next_in = (z_const Bytef *)source;
-    stream.avail_in = 0;
-    stream.zalloc = (alloc_func)0;
-    stream.zfree = (free_func)0;
-    stream.opaque = (voidpf)0;
-
-    err = inflateInit2(&stream, -15);
-    if (err != Z_OK) return err;
-
-    stream.next_out = dest;
-    stream.avail_out = 0;
-
-    do {
-        if (stream.avail_out == 0) {
-            stream.avail_out = left > (uLong)max ? max : (uInt)left;
-            left -= stream.avail_out;
-        }
-        if (stream.avail_in == 0) {
-            stream.avail_in = len > (uLong)max ? max : (uInt)len;
-            len -= stream.avail_in;
-        }
-        err = inflate(&stream, Z_NO_FLUSH);
-    } while (err == Z_OK);
-
-    *sourceLen -= len + stream.avail_in;
-    if (dest != buf)
-        *destLen = stream.total_out;
-    else if (stream.total_out && err == Z_BUF_ERROR)
-        left = 1;
-
-    inflateEnd(&stream);
-    return err == Z_STREAM_END ? Z_OK :
-           err == Z_NEED_DICT ? Z_DATA_ERROR  :
-           err == Z_BUF_ERROR && left + stream.avail_out ? Z_DATA_ERROR :
-           err;
-}
-
-static void
-zdeflate(const uint8_t *buf, const size_t buf_sz, uint8_t **out_dec, size_t *inout_dec_sz)
-{
-   uLongf dsize = (*inout_dec_sz ? *inout_dec_sz : buf_sz * 2), bsize;
-   int ret = Z_OK;
+// Size of the inflate output window, each worker owns one
+#define CHUNK_SIZE (256 * 1024)
 
-   do {
-      if (!(*out_dec = realloc(*out_dec, (bsize = dsize))))
-         err(EXIT_FAILURE, "realloc(%zu)", dsize);
-      dsize *= 2;
-   } while ((ret = uncompress(*out_dec, &bsize, buf, buf_sz)) == Z_BUF_ERROR && !*inout_dec_sz);
+static void
+mkdirp(const char *path)
+{
+   assert(path);
+   for (const char *s = path; *s; ++s) {
+      if (*s != '/')
+         continue;
+
+      *(char*)s = 0;
+      mkdir(path, 0755);
+      *(char*)s = '/';
+   }
+}
 
-   if (ret != Z_OK)
-      errx(EXIT_FAILURE, "uncompress(%zu, %zu) == %d", (size_t)(dsize / 2), buf_sz, ret);
+static void
+write_all(const int fd, const void *data, const size_t size, const char *path)
+{
+   assert(data || !size);
+   for (size_t w = 0; w < size;) {
+      const ssize_t r = write(fd, (const char*)data + w, size - w);
+      if (r == -1 && errno == EINTR)
+         continue;
+
+      if (r <= 0)
+         err(EXIT_FAILURE, "write(%s)", path);
 
-   *inout_dec_sz = bsize;
+      w += r;
+   }
 }
 
-static FILE*
-fopen_or_die(const char *path, const char *mode)
+static size_t
+inflate_to(const uint8_t *data, const size_t size, const size_t expected, const int fd, const char *path, uint8_t *chunk, struct xxh64_state *content, const uint32_t *crc)
 {
-   assert(path && mode);
+   assert(data && path && chunk);
 
-   FILE *f;
-   if (!(f = fopen(path, mode)))
-      err(EXIT_FAILURE, "fopen(%s, %s)", path, mode);
+   // #EMZ payloads are raw deflate streams without zlib header
+   z_stream stream = { .next_in = (Bytef*)data };
+   if (inflateInit2(&stream, -15) != Z_OK)
+      errx(EXIT_FAILURE, "inflateInit2(%s): %s", path, (stream.msg ? stream.msg : "failed"));
+
+   int ret;
+   uint32_t sum = 0;
+   size_t left = size;
+   do {
+      if (!stream.avail_in && left) {
+         stream.avail_in = (left > (uInt)~0 ? (uInt)~0 : left);
+         left -= stream.avail_in;
+      }
 
-   return f;
+      stream.next_out = chunk;
+      stream.avail_out = CHUNK_SIZE;
+      if ((ret = inflate(&stream, Z_NO_FLUSH)) != Z_OK && ret != Z_STREAM_END)
+         errx(EXIT_FAILURE, "inflate(%s) == %d: %s", path, ret, (stream.msg ? stream.msg : "truncated stream"));
+
+      write_all(fd, chunk, CHUNK_SIZE - stream.avail_out, path);
+
+      if (content)
+         xxh64_update(content, chunk, CHUNK_SIZE - stream.avail_out);
+
+      // checksummed while the chunk is still in cache
+      if (crc)
+         sum = crc32_update(CRC32_IEEE, sum, chunk, CHUNK_SIZE - stream.avail_out);
+   } while (ret != Z_STREAM_END);
+
+   if (crc && sum != *crc)
+      warnx("%s: crc32 of inflated data is 0x%08" PRIx32 ", but #EMZ header says 0x%08" PRIx32, path, sum, *crc);
+
+   if (stream.total_out != expected)
+      warnx("%s: inflated to %zu bytes, but #EMZ header says %zu bytes", path, (size_t)stream.total_out, expected);
+
+   const size_t total = stream.total_out;
+   inflateEnd(&stream);
+   return total;
 }
 
+struct archive {
+   const char *name;
+   const uint8_t *data;
+   const struct eaf_file *files; // file table, points inside data
+   size_t size;
+   uint32_t count; // entries in the file table
+   int fd; // -1 if the archive is not backed by a regular file
+   bool mapped;
+};
+
 static void
-mkdirp(const char *path)
+copy_stored(const struct archive *archive, const struct eaf_file *file, const int fd, const char *path)
 {
-   assert(path);
-   for (const char *s = path; *s; ++s) {
-      if (*s != '/')
+   assert(archive && file && path);
+
+   // Let the kernel move the bytes, no need to bounce them through userspace.
+   loff_t off = file->offset;
+   size_t left = file->size;
+   while (archive->fd != -1 && left > 0) {
+      const ssize_t r = copy_file_range(archive->fd, &off, fd, NULL, left, 0);
+      if (r == -1 && errno == EINTR)
          continue;
 
-      *(char*)s = 0;
-      mkdir(path, 0755);
-      *(char*)s = '/';
+      if (r <= 0) {
+         if (r == -1 && errno != EXDEV && errno != ENOSYS && errno != EINVAL && errno != EOPNOTSUPP)
+            err(EXIT_FAILURE, "copy_file_range(%s)", path);
+         break;
+      }
+
+      left -= r;
    }
+
+   write_all(fd, archive->data + file->offset + (file->size - left), left, path);
 }
 
-static void
-write_data_to(const uint8_t *data, const size_t size, const char *path)
+static bool
+entry_is_emz(const struct archive *archive, const struct eaf_file *file, struct emz_header *out_header)
 {
-   assert(data && path);
+   assert(archive && file && out_header);
+   *out_header = (struct emz_header){0};
+   memcpy(out_header, archive->data + file->offset, (file->size < sizeof(*out_header) ? file->size : sizeof(*out_header)));
+   return !memcmp(out_header->magic, "#EMZ", sizeof(out_header->magic));
+}
+
+static uint64_t
+write_data_to(const struct archive *archive, const struct eaf_file *file, const char *path, uint8_t *chunk, struct xxh64_state *content, const bool verify)
+{
+   assert(archive && file && path && chunk);
    mkdirp(path);
-   FILE *f = fopen_or_die(path, "wb");
 
-   struct header {
-      uint8_t magic[4];
-      uint32_t unknown;
-      uint32_t size;
-      uint32_t offset;
-   } __attribute__((packed)) header;
+   // The old file may be hardlinked by a previous deduplicating run, never write through it.
+   unlink(path);
+
+   int fd;
+   if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644)) == -1)
+      err(EXIT_FAILURE, "open(%s)", path);
 
-   memcpy(&header, data, sizeof(header));
+   struct emz_header header;
+   const uint8_t *data = archive->data + file->offset;
    warnx("%s", path);
 
-   if (!memcmp(header.magic, "#EMZ", sizeof(header.magic))) {
-      uint8_t *buf = NULL;
-      size_t dec_size = header.size;
-      zdeflate(data + header.offset, size - header.offset, &buf, &dec_size);
-      fwrite(buf, 1, dec_size, f);
-      free(buf);
+   uint64_t written = file->size;
+   if (entry_is_emz(archive, file, &header)) {
+      if (header.offset > file->size)
+         errx(EXIT_FAILURE, "%s: #EMZ data offset is out of bounds", path);
+
+      // only checked on request, the field being crc32 of the inflated data is unverified
+      const uint32_t crc = header.unknown;
+      written = inflate_to(data + header.offset, file->size - header.offset, header.size, fd, path, chunk, content, (verify ? &crc : NULL));
    } else {
-      fwrite(data, 1, size, f);
+      copy_stored(archive, file, fd, path);
+   }
+
+   close(fd);
+   return written;
+}
+
+static size_t
+file_path_len(const struct eaf_file *file)
+{
+   assert(file);
+   return strnlen(file->path, sizeof(file->path));
+}
+
+static uint64_t
+path_hash(const char *path, const size_t len)
+{
+   // FNV-1a
+   uint64_t h = 0xcbf29ce484222325;
+   for (size_t i = 0; i < len; ++i)
+      h = (h ^ (uint8_t)path[i]) * 0x100000001b3;
+   return h;
+}
+
+// Records what was extracted to outdir by previous runs, so unchanged entries can be skipped.
+// Entries are keyed by path, hash is XXH64 of the entry as stored in the archive.
+#define MANIFEST_NAME ".uneaf-manifest"
+#define MANIFEST_VERSION 1
+
+struct manifest_entry {
+   char *path;
+   uint64_t hash, size, out_size;
+};
+
+struct manifest {
+   struct manifest_entry *entries;
+   struct hashidx index;
+   size_t count, len;
+};
+
+static struct manifest_entry*
+manifest_get(const struct manifest *manifest, const char *path, const size_t len)
+{
+   assert(manifest && path);
+
+   size_t i;
+   for (struct hashidx_iter it = hashidx_find(&manifest->index, path_hash(path, len)); hashidx_next(&manifest->index, &it, &i);) {
+      struct manifest_entry *e = &manifest->entries[i];
+      if (!strncmp(e->path, path, len) && !e->path[len])
+         return e;
    }
 
+   return NULL;
+}
+
+static void
+manifest_set(struct manifest *manifest, const char *path, const size_t len, const uint64_t hash, const uint64_t size, const uint64_t out_size)
+{
+   assert(manifest && path);
+
+   struct manifest_entry *e;
+   if ((e = manifest_get(manifest, path, len))) {
+      *e = (struct manifest_entry){ .path = e->path, .hash = hash, .size = size, .out_size = out_size };
+      return;
+   }
+
+   if (manifest->count >= manifest->len) {
+      manifest->len = (manifest->len ? manifest->len * 2 : 1024);
+      if (!(manifest->entries = realloc(manifest->entries, manifest->len * sizeof(*manifest->entries))))
+         err(EXIT_FAILURE, "realloc(%zu)", manifest->len * sizeof(*manifest->entries));
+   }
+
+   char *copy;
+   if (!(copy = strndup(path, len)))
+      err(EXIT_FAILURE, "strndup");
+
+   hashidx_insert(&manifest->index, path_hash(copy, len), manifest->count);
+   manifest->entries[manifest->count++] = (struct manifest_entry){ .path = copy, .hash = hash, .size = size, .out_size = out_size };
+}
+
+static void
+manifest_load(struct manifest *manifest, const char *outdir)
+{
+   assert(manifest && outdir);
+   *manifest = (struct manifest){0};
+
+   char path[4096];
+   snprintf(path, sizeof(path), "%s/%s", outdir, MANIFEST_NAME);
+
+   FILE *f;
+   if (!(f = fopen(path, "rb")))
+      return;
+
+   char *line = NULL;
+   size_t line_sz = 0;
+   unsigned int version = 0;
+   if (getline(&line, &line_sz, f) == -1 || sscanf(line, "uneaf-manifest %u", &version) != 1 || version != MANIFEST_VERSION) {
+      warnx("%s: unknown manifest version, extracting everything", path);
+   } else {
+      for (ssize_t len; (len = getline(&line, &line_sz, f)) != -1;) {
+         int off;
+         uint64_t hash, size, out_size;
+         len -= (len > 0 && line[len - 1] == '\n');
+         if (sscanf(line, "%16" SCNx64 " %" SCNu64 " %" SCNu64 " %n", &hash, &size, &out_size, &off) != 3 || len <= off) {
+            warnx("%s: ignoring malformed line", path);
+            continue;
+         }
+
+         manifest_set(manifest, line + off, len - off, hash, size, out_size);
+      }
+   }
+
+   free(line);
    fclose(f);
 }
 
 static void
-unpack(const char *path, const char *outdir)
+manifest_save(const struct manifest *manifest, const char *outdir)
 {
-   assert(path);
-   const char *name = (!strcmp(path, "-") ? stdin_name : path);
-   FILE *f = (name == stdin_name ? stdin : fopen_or_die(name, "rb"));
+   assert(manifest && outdir);
 
-   struct header {
-      uint8_t magic[4];
-      uint16_t major, minor;
-      uint64_t size;
-      uint32_t count;
-      uint64_t unknown;
-      uint8_t padding[100];
-   } __attribute__((packed)) header;
+   char path[4096], tmp[4096];
+   snprintf(path, sizeof(path), "%s/%s", outdir, MANIFEST_NAME);
+   snprintf(tmp, sizeof(tmp), "%s/%s.tmp", outdir, MANIFEST_NAME);
+   mkdirp(tmp);
 
-   if (fread(&header, 1, sizeof(header), f) != sizeof(header))
-      err(EXIT_FAILURE, "fread(%zu)", sizeof(header));
+   FILE *f;
+   if (!(f = fopen(tmp, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", tmp);
 
-   if (memcmp(header.magic, "#EAF", sizeof(header.magic)))
-      errx(EXIT_FAILURE, "'%s' is not a #EAF file", name);
+   fprintf(f, "uneaf-manifest %u\n", MANIFEST_VERSION);
+   for (size_t i = 0; i < manifest->count; ++i) {
+      const struct manifest_entry *e = &manifest->entries[i];
+      fprintf(f, "%016" PRIx64 " %" PRIu64 " %" PRIu64 " %s\n", e->hash, e->size, e->out_size, e->path);
+   }
 
-   for (size_t i = 0; i < header.count; ++i) {
-      struct file {
-         char path[256];
-         uint64_t offset, size;
-         uint8_t padding[16];
-      } __attribute__((packed)) file;
+   if (fclose(f))
+      err(EXIT_FAILURE, "fclose(%s)", tmp);
 
-      if (fread(&file, 1, sizeof(file), f) != sizeof(file))
-         err(EXIT_FAILURE, "fread(%zu)", sizeof(file));
+   if (rename(tmp, path) == -1)
+      err(EXIT_FAILURE, "rename(%s, %s)", tmp, path);
+}
 
-      fpos_t pos;
-      fgetpos(f, &pos);
+static void
+manifest_release(struct manifest *manifest)
+{
+   assert(manifest);
 
-      uint8_t *data;
-      if (!(data = malloc(file.size)))
-         err(EXIT_FAILURE, "malloc(%zu)", file.size);
+   for (size_t i = 0; i < manifest->count; ++i)
+      free(manifest->entries[i].path);
 
-      fseek(f, file.offset, SEEK_SET);
-      if (fread(data, 1, file.size, f) != file.size)
-         err(EXIT_FAILURE, "fread(%zu)", file.size);
+   free(manifest->entries);
+   hashidx_release(&manifest->index);
+   *manifest = (struct manifest){0};
+}
+
+// Content addressed deduplication of extracted files.
+// Entries are keyed by XXH64 and size of their extracted content. #EMZ entries are additionally keyed
+// by their compressed bytes, identical compressed data means identical content, so repeated #EMZ
+// entries can be linked without inflating them at all. 64bit hash + size makes collisions
+// unrealistic for archive sets of any practical size, so contents are not compared byte by byte.
+// A later entry or archive may extract different content to a canonical path, its entries are dropped
+// before the path is written again.
+enum dedup_mode {
+   DEDUP_NONE,
+   DEDUP_HARDLINK,
+   DEDUP_REFLINK,
+};
+
+enum dedup_kind {
+   DEDUP_CONTENT, // hash of the extracted content
+   DEDUP_RAW, // hash of the #EMZ entry as stored in the archive
+};
+
+struct dedup_key {
+   uint64_t hash, size;
+   enum dedup_kind kind;
+};
+
+struct dedup_entry {
+   struct dedup_key key;
+   char *path; // canonical copy of the content, NULL if dropped
+   uint64_t out_size;
+};
+
+struct dedup {
+   pthread_mutex_t mutex;
+   struct dedup_entry *entries;
+   struct hashidx index, paths; // by key and by path
+   size_t count, len;
+   enum dedup_mode mode;
+};
+
+static const struct dedup_entry*
+dedup_get_locked(const struct dedup *dedup, const struct dedup_key *key)
+{
+   assert(dedup && key);
+
+   size_t i;
+   for (struct hashidx_iter it = hashidx_find(&dedup->index, key->hash ^ key->kind); hashidx_next(&dedup->index, &it, &i);) {
+      const struct dedup_key *k = &dedup->entries[i].key;
+      if (dedup->entries[i].path && k->hash == key->hash && k->size == key->size && k->kind == key->kind)
+         return &dedup->entries[i];
+   }
+
+   return NULL;
+}
+
+static void
+dedup_insert_locked(struct dedup *dedup, const struct dedup_key *key, const char *path, const uint64_t out_size)
+{
+   assert(dedup && key && path);
+
+   if (dedup_get_locked(dedup, key))
+      return;
+
+   if (dedup->count >= dedup->len) {
+      dedup->len = (dedup->len ? dedup->len * 2 : 1024);
+      if (!(dedup->entries = realloc(dedup->entries, dedup->len * sizeof(*dedup->entries))))
+         err(EXIT_FAILURE, "realloc(%zu)", dedup->len * sizeof(*dedup->entries));
+   }
+
+   char *copy;
+   if (!(copy = strdup(path)))
+      err(EXIT_FAILURE, "strdup");
+
+   hashidx_insert(&dedup->index, key->hash ^ key->kind, dedup->count);
+   hashidx_insert(&dedup->paths, path_hash(copy, strlen(copy)), dedup->count);
+   dedup->entries[dedup->count++] = (struct dedup_entry){ .key = *key, .path = copy, .out_size = out_size };
+}
+
+static void
+dedup_insert(struct dedup *dedup, const struct dedup_key *key, const char *path, const uint64_t out_size)
+{
+   assert(dedup);
+   pthread_mutex_lock(&dedup->mutex);
+   dedup_insert_locked(dedup, key, path, out_size);
+   pthread_mutex_unlock(&dedup->mutex);
+}
+
+/** drops the entries whose canonical copy is at path, call before writing to path */
+static void
+dedup_forget(struct dedup *dedup, const char *path)
+{
+   assert(dedup && path);
+
+   size_t i;
+   pthread_mutex_lock(&dedup->mutex);
+   for (struct hashidx_iter it = hashidx_find(&dedup->paths, path_hash(path, strlen(path))); hashidx_next(&dedup->paths, &it, &i);) {
+      struct dedup_entry *e = &dedup->entries[i];
+      if (e->path && !strcmp(e->path, path)) {
+         free(e->path);
+         e->path = NULL;
+      }
+   }
+   pthread_mutex_unlock(&dedup->mutex);
+}
+
+static bool
+dedup_find(struct dedup *dedup, const struct dedup_key *key, char canonical[4096], uint64_t *out_size)
+{
+   assert(dedup && key && canonical && out_size);
+
+   pthread_mutex_lock(&dedup->mutex);
+   const struct dedup_entry *e;
+   if ((e = dedup_get_locked(dedup, key))) {
+      snprintf(canonical, 4096, "%s", e->path);
+      *out_size = e->out_size;
+   }
+   pthread_mutex_unlock(&dedup->mutex);
+   return (e != NULL);
+}
+
+static bool
+link_file(const enum dedup_mode mode, const char *src, const char *dst)
+{
+   assert(src && dst);
+
+   if (mode == DEDUP_HARDLINK)
+      return !link(src, dst);
+
+   int sfd, dfd;
+   if ((sfd = open(src, O_RDONLY | O_CLOEXEC)) == -1)
+      return false;
+
+   if ((dfd = open(dst, O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644)) == -1) {
+      close(sfd);
+      return false;
+   }
+
+   const bool ok = !ioctl(dfd, FICLONE, sfd);
+   close(dfd);
+   close(sfd);
+
+   if (!ok)
+      unlink(dst);
+
+   return ok;
+}
+
+static bool
+dedup_materialize(struct dedup *dedup, const struct dedup_key *key, const char *path, uint64_t *out_size)
+{
+   assert(dedup && key && path && out_size);
+
+   char canonical[4096];
+   if (!dedup_find(dedup, key, canonical, out_size) || !strcmp(canonical, path))
+      return false;
+
+   // Link next to the target and rename over it, so the target is never left missing.
+   char tmp[4096 + 8];
+   snprintf(tmp, sizeof(tmp), "%s.dedup", path);
+   unlink(tmp);
+   mkdirp(tmp);
+
+   if (!link_file(dedup->mode, canonical, tmp))
+      return false;
+
+   if (rename(tmp, path) == -1) {
+      unlink(tmp);
+      return false;
+   }
+
+   warnx("%s -> %s", path, canonical);
+   return true;
+}
+
+static void
+dedup_release(struct dedup *dedup)
+{
+   assert(dedup);
+
+   for (size_t i = 0; i < dedup->count; ++i)
+      free(dedup->entries[i].path);
+
+   free(dedup->entries);
+   hashidx_release(&dedup->index);
+   hashidx_release(&dedup->paths);
+   pthread_mutex_destroy(&dedup->mutex);
+   *dedup = (struct dedup){0};
+}
+
+struct result {
+   uint64_t hash, out_size;
+   bool written, linked;
+};
+
+struct job {
+   const struct archive *archive;
+   const struct manifest *manifest; // NULL to extract every entry
+   struct dedup *dedup; // NULL to not deduplicate
+   const uint32_t *selected; // indices to the file table, NULL for every entry
+   struct result *results;
+   const char *outdir;
+   size_t count;
+   atomic_size_t next;
+   bool verify; // check the unknown field of #EMZ entries as crc32, which is a guess
+};
+
+static void*
+worker(void *arg)
+{
+   assert(arg);
+   struct job *job = arg;
+
+   uint8_t *chunk;
+   if (!(chunk = malloc(CHUNK_SIZE)))
+      err(EXIT_FAILURE, "malloc(%zu)", (size_t)CHUNK_SIZE);
+
+   for (size_t n; (n = atomic_fetch_add(&job->next, 1)) < job->count;) {
+      struct eaf_file file;
+      const size_t i = (job->selected ? job->selected[n] : n);
+      memcpy(&file, &job->archive->files[i], sizeof(file));
+
+      if (file.offset > job->archive->size || file.size > job->archive->size - file.offset)
+         errx(EXIT_FAILURE, "%s: entry %zu is out of bounds", job->archive->name, i);
 
       char path[4096];
-      snprintf(path, sizeof(path), "%s/%s", outdir, file.path);
-      write_data_to(data, file.size, path);
-      free(data);
-      fsetpos(f, &pos);
+      const size_t len = file_path_len(&file);
+      snprintf(path, sizeof(path), "%s/%.*s", job->outdir, (int)len, file.path);
+
+      struct result *result = &job->results[n];
+      result->hash = xxh64(job->archive->data + file.offset, file.size, 0);
+
+      struct emz_header header;
+      const bool emz = entry_is_emz(job->archive, &file, &header);
+
+      // Stored entries are their own content, #EMZ entries are known by content only after inflating.
+      const struct dedup_key key = { .hash = result->hash, .size = file.size, .kind = (emz ? DEDUP_RAW : DEDUP_CONTENT) };
+
+      struct stat st;
+      const struct manifest_entry *e;
+      if (job->manifest && (e = manifest_get(job->manifest, file.path, len)) &&
+          e->hash == result->hash && e->size == file.size &&
+          !stat(path, &st) && (uint64_t)st.st_size == e->out_size) {
+         result->out_size = e->out_size;
+
+         if (job->dedup)
+            dedup_insert(job->dedup, &key, path, e->out_size);
+
+         continue;
+      }
+
+      if (job->dedup) {
+         dedup_forget(job->dedup, path);
+
+         if ((result->linked = dedup_materialize(job->dedup, &key, path, &result->out_size)))
+            continue;
+      }
+
+      struct xxh64_state content;
+      xxh64_init(&content, 0);
+      result->out_size = write_data_to(job->archive, &file, path, chunk, (job->dedup && emz ? &content : NULL), job->verify);
+      result->written = true;
+
+      if (job->dedup) {
+         if (emz) {
+            const struct dedup_key ckey = { .hash = xxh64_digest(&content), .size = result->out_size, .kind = DEDUP_CONTENT };
+            if (!(result->linked = dedup_materialize(job->dedup, &ckey, path, &result->out_size)))
+               dedup_insert(job->dedup, &ckey, path, result->out_size);
+         }
+
+         dedup_insert(job->dedup, &key, path, result->out_size);
+      }
    }
 
-   fclose(f);
+   free(chunk);
+   return NULL;
+}
+
+static void
+archive_slurp(struct archive *archive, const int fd)
+{
+   assert(archive);
+
+   // Pipes can't be mapped, slurp them instead.
+   uint8_t *data = NULL;
+   size_t len = 0;
+   for (ssize_t r;; archive->size += r) {
+      if (archive->size >= len) {
+         len = (len ? len * 2 : 1024 * 1024);
+         if (!(data = realloc(data, len)))
+            err(EXIT_FAILURE, "realloc(%zu)", len);
+      }
+
+      if ((r = read(fd, data + archive->size, len - archive->size)) == -1 && errno == EINTR) {
+         r = 0;
+      } else if (r == -1) {
+         err(EXIT_FAILURE, "read(%s)", archive->name);
+      } else if (r == 0) {
+         break;
+      }
+   }
+
+   archive->data = data;
+
+   if (fd != STDIN_FILENO)
+      close(fd);
+}
+
+static void
+archive_open(struct archive *archive, const char *path)
+{
+   assert(archive && path);
+   *archive = (struct archive){ .name = (!strcmp(path, "-") ? stdin_name : path), .fd = -1 };
+
+   int fd;
+   if (archive->name == stdin_name) {
+      fd = STDIN_FILENO;
+   } else if ((fd = open(archive->name, O_RDONLY | O_CLOEXEC)) == -1) {
+      err(EXIT_FAILURE, "open(%s)", archive->name);
+   }
+
+   struct stat st;
+   if (fstat(fd, &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", archive->name);
+
+   if (S_ISREG(st.st_mode) && st.st_size > 0) {
+      void *map;
+      if ((map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0)) == MAP_FAILED)
+         err(EXIT_FAILURE, "mmap(%s)", archive->name);
+
+      archive->data = map;
+      archive->size = st.st_size;
+      archive->fd = fd;
+      archive->mapped = true;
+   } else {
+      archive_slurp(archive, fd);
+   }
+
+   struct eaf_header header;
+   if (archive->size < sizeof(header))
+      errx(EXIT_FAILURE, "'%s' is too small to be a #EAF file", archive->name);
+
+   memcpy(&header, archive->data, sizeof(header));
+   if (memcmp(header.magic, "#EAF", sizeof(header.magic)))
+      errx(EXIT_FAILURE, "'%s' is not a #EAF file", archive->name);
+
+   if ((archive->size - sizeof(header)) / sizeof(struct eaf_file) < header.count)
+      errx(EXIT_FAILURE, "'%s' file table is truncated", archive->name);
+
+   archive->files = (const void*)(archive->data + sizeof(header));
+   archive->count = header.count;
+}
+
+static void
+archive_close(struct archive *archive)
+{
+   assert(archive);
+
+   if (archive->mapped) {
+      munmap((void*)archive->data, archive->size);
+   } else {
+      free((void*)archive->data);
+   }
+
+   if (archive->fd != -1 && archive->fd != STDIN_FILENO)
+      close(archive->fd);
+
+   *archive = (struct archive){0};
+}
+
+static void
+path_index_build(struct hashidx *index, const struct archive *archive)
+{
+   assert(index && archive);
+
+   *index = (struct hashidx){0};
+   hashidx_reserve(index, archive->count);
+   for (uint32_t i = 0; i < archive->count; ++i)
+      hashidx_insert(index, path_hash(archive->files[i].path, file_path_len(&archive->files[i])), i);
+}
+
+static bool
+path_index_lookup(const struct hashidx *index, const struct archive *archive, const char *path, uint32_t *out_entry)
+{
+   assert(index && archive && path && out_entry);
+
+   size_t i;
+   const size_t len = strlen(path);
+   for (struct hashidx_iter it = hashidx_find(index, path_hash(path, len)); hashidx_next(index, &it, &i);) {
+      const struct eaf_file *file = &archive->files[i];
+      if (file_path_len(file) == len && !memcmp(file->path, path, len)) {
+         *out_entry = i;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+struct selection {
+   uint32_t *entries;
+   size_t count;
+};
+
+static void
+selection_append(struct selection *selection, const uint32_t entry)
+{
+   assert(selection);
+
+   // count never exceeds the number of entries in archive, see select_entries
+   selection->entries[selection->count++] = entry;
+}
+
+static bool
+select_entries(const struct archive *archive, const char **patterns, const size_t npatterns, struct selection *out_selection)
+{
+   assert(archive && (patterns || !npatterns) && out_selection);
+
+   struct selection selection = {0};
+   bool *selected;
+   if (!(selected = calloc(archive->count ? archive->count : 1, sizeof(*selected))) ||
+       !(selection.entries = calloc(archive->count ? archive->count : 1, sizeof(*selection.entries))))
+      err(EXIT_FAILURE, "calloc(%u)", archive->count);
+
+   struct hashidx index = {0};
+   bool ok = true;
+   for (size_t p = 0; p < npatterns; ++p) {
+      bool matched = false;
+      if (strpbrk(patterns[p], "*?[")) {
+         for (uint32_t i = 0; i < archive->count; ++i) {
+            char path[sizeof(archive->files[i].path) + 1];
+            const size_t len = file_path_len(&archive->files[i]);
+            memcpy(path, archive->files[i].path, len);
+            path[len] = 0;
+
+            if (fnmatch(patterns[p], path, 0))
+               continue;
+
+            if (!selected[i])
+               selection_append(&selection, i);
+            selected[i] = matched = true;
+         }
+      } else {
+         if (!index.slots)
+            path_index_build(&index, archive);
+
+         uint32_t i;
+         if ((matched = path_index_lookup(&index, archive, patterns[p], &i)) && !selected[i]) {
+            selection_append(&selection, i);
+            selected[i] = true;
+         }
+      }
+
+      if (!matched) {
+         warnx("%s: no entry matches '%s'", archive->name, patterns[p]);
+         ok = false;
+      }
+   }
+
+   hashidx_release(&index);
+   free(selected);
+   *out_selection = selection;
+   return ok;
+}
+
+static void
+list(const char *path)
+{
+   assert(path);
+
+   // Only the header and the file table are touched, the mapping doesn't fault in any entry data.
+   struct archive archive;
+   archive_open(&archive, path);
+
+   for (uint32_t i = 0; i < archive.count; ++i) {
+      struct eaf_file file;
+      memcpy(&file, &archive.files[i], sizeof(file));
+      printf("%" PRIu64 "\t%" PRIu64 "\t%.*s\n", file.offset, file.size, (int)file_path_len(&file), file.path);
+   }
+
+   archive_close(&archive);
+}
+
+static bool
+unpack(const char *path, const char *outdir, const char **patterns, const size_t npatterns, struct manifest *manifest, const bool force, const bool verify, struct dedup *dedup, size_t threads)
+{
+   assert(path && outdir);
+
+   struct archive archive;
+   archive_open(&archive, path);
+
+   bool ok = true;
+   struct selection selection = {0};
+   if (npatterns) {
+      ok = select_entries(&archive, patterns, npatterns, &selection);
+   } else if (archive.mapped) {
+      // Everything is going to be read, start the readahead early.
+      madvise((void*)archive.data, archive.size, MADV_WILLNEED);
+   }
+
+   struct job job = {
+      .archive = &archive,
+      .manifest = (force ? NULL : manifest),
+      .dedup = (dedup->mode != DEDUP_NONE ? dedup : NULL),
+      .selected = selection.entries,
+      .outdir = outdir,
+      .count = (npatterns ? selection.count : archive.count),
+      .verify = verify,
+   };
+
+   if (!(job.results = calloc(job.count ? job.count : 1, sizeof(*job.results))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", job.count, sizeof(*job.results));
+
+   threads = (threads > job.count ? job.count : threads);
+   threads = (threads ? threads : 1);
+
+   workers_run(worker, &job, threads);
+
+   size_t written = 0, linked = 0;
+   for (size_t n = 0; n < job.count; ++n) {
+      const struct eaf_file *file = &archive.files[(job.selected ? job.selected[n] : n)];
+      manifest_set(manifest, file->path, file_path_len(file), job.results[n].hash, file->size, job.results[n].out_size);
+      written += (job.results[n].written && !job.results[n].linked);
+      linked += job.results[n].linked;
+   }
+
+   warnx("%s: %zu entries written, %zu linked, %zu unchanged", archive.name, written, linked, job.count - written - linked);
+
+   free(job.results);
+   free(selection.entries);
+   archive_close(&archive);
+   return ok;
 }
 
 int
 main(int argc, char *argv[])
 {
-   if (argc < 3)
-      errx(EXIT_FAILURE, "usage: %s outdir file ...", argv[0]);
+   bool list_only = false, force = false, verify = false;
+   struct dedup dedup = { .mutex = PTHREAD_MUTEX_INITIALIZER };
+   long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   const char **patterns;
+   size_t npatterns = 0;
+   if (!(patterns = calloc(argc, sizeof(*patterns))))
+      err(EXIT_FAILURE, "calloc(%d, %zu)", argc, sizeof(*patterns));
+
+   int i;
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-l")) {
+         list_only = true;
+      } else if (!strcmp(argv[i], "-f")) {
+         force = true;
+      } else if (!strcmp(argv[i], "-c")) {
+         verify = true;
+      } else if (!strcmp(argv[i], "-d") && i + 1 < argc) {
+         if (!strcmp(argv[++i], "hardlink")) {
+            dedup.mode = DEDUP_HARDLINK;
+         } else if (!strcmp(argv[i], "reflink")) {
+            dedup.mode = DEDUP_REFLINK;
+         } else {
+            errx(EXIT_FAILURE, "unknown dedup mode '%s', expected hardlink or reflink", argv[i]);
+         }
+      } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+         threads = strtol(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "-p") && i + 1 < argc) {
+         patterns[npatterns++] = argv[++i];
+      } else {
+         break;
+      }
+   }
+
+   if (list_only && i < argc) {
+      for (; i < argc; ++i)
+         list(argv[i]);
+
+      free(patterns);
+      return EXIT_SUCCESS;
+   }
+
+   if (argc - i < 2)
+      errx(EXIT_FAILURE, "usage: %s [-f] [-c] [-d hardlink|reflink] [-j threads] [-p path-or-glob ...] outdir file ... | -l file ...", argv[0]);
+
+   bool ok = true;
+   const char *outdir = argv[i];
+
+   struct manifest manifest;
+   manifest_load(&manifest, outdir);
+
+   for (++i; i < argc; ++i)
+      ok = unpack(argv[i], outdir, patterns, npatterns, &manifest, force, verify, &dedup, (threads > 0 ? threads : 1)) && ok;
 
-   for (int i = 2; i < argc; ++i)
-      unpack(argv[i], argv[1]);
+   manifest_save(&manifest, outdir);
+   manifest_release(&manifest);
+   dedup_release(&dedup);
 
-   return EXIT_SUCCESS;
+   free(patterns);
+   return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
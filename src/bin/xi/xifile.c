@@ -1,170 +1,311 @@
+#define _XOPEN_SOURCE 700
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stdatomic.h>
 #include <string.h>
 #include <ctype.h>
 #include <assert.h>
 #include <err.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <ftw.h>
+#include <pthread.h>
+
+#include "util/sigtrie.h"
+#include "util/workers.h"
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
 static const char *stdin_name = "/dev/stdin";
 
-static FILE*
-fopen_or_die(const char *path, const char *mode)
-{
-   assert(path && mode);
+static const struct info {
+   const char *name;
+   const uint8_t *header;
+   size_t chunk;
+} map[] = {
+#define HDR(...) .header = (const uint8_t[]){__VA_ARGS__}, .chunk = sizeof((const uint8_t[]){__VA_ARGS__})
+   {
+      .name = "BGMStream",
+      HDR('B', 'G', 'M', 'S', 't', 'r', 'e', 'a', 'm')
+   }, {
+      .name = "SeWave",
+      HDR('S', 'e', 'W', 'a', 'v', 'e')
+   }, {
+      .name = "PMUS",
+      HDR('P', 'M', 'U', 'S')
+   }, {
+      .name = "RIFF/WAVE",
+      HDR('R', 'I', 'F', 'F', 0x24, 0xB3, 0xCF, 0x04, 'W', 'A', 'V', 'E', 'f', 'm', 't')
+   }, {
+      .name = "RIFF/ACON",
+      HDR('R', 'I', 'F', 'F', 0x58, 0x23, 0, 0, 'A', 'C', 'O', 'N', 'a', 'n', 'i', 'h')
+   }, {
+      .name = "name",
+      HDR('n', 'o', 'n', 'e', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
+   }, {
+      .name = "syst",
+      HDR('s', 'y', 's', 't')
+   }, {
+      .name = "menu",
+      HDR('m', 'e', 'n', 'u')
+   }, {
+      .name = "lobb",
+      HDR('l', 'o', 'b', 'b')
+   }, {
+      .name = "wave",
+      HDR('w', 'a', 'v', 'e')
+   }, {
+      .name = "ability",
+      HDR(0, 0, 0, 0x17, 0, 0, 0, 0, 0x80)
+   }, {
+      .name = "spell",
+      HDR(0, 0, 0, 0, 0x03, 0, 0x9F, 0, 0x10)
+   }, {
+      .name = "mgc_",
+      HDR('m', 'g', 'c', '_')
+   }, {
+      .name = "win0",
+      HDR('w', 'i', 'n', '0')
+   }, {
+      .name = "titl",
+      HDR('t', 'i', 't', 'l')
+   }, {
+      .name = "sel_",
+      HDR('s', 'e', 'l', '_')
+   }, {
+      .name = "damv",
+      HDR('d', 'a', 'm', 'v')
+   }, {
+      .name = "XISTRING",
+      HDR('X', 'I', 'S', 'T', 'R', 'I', 'N', 'G')
+   }, {
+      .name = "prvd",
+      HDR('p', 'r', 'v', 'd')
+   }, {
+      .name = "selp",
+      HDR('s', 'e', 'l', 'p')
+   }, {
+      .name = "dun",
+      HDR('d', 'u', 'n')
+   }, {
+      .name = "town",
+      HDR('t', 'o', 'w', 'n')
+   }, {
+      .name = "dese",
+      HDR('d', 'e', 's', 'e')
+   }, {
+      .name = "fore",
+      HDR('f', 'o', 'r', 'e')
+   }, {
+      .name = "tree",
+      HDR('t', 'r', 'e', 'e')
+   }, {
+      .name = "unka",
+      HDR('u', 'n', 'k', 'a')
+   }, {
+      .name = "moun",
+      HDR('m', 'o', 'u', 'n')
+   }, {
+      .name = "cast",
+      HDR('c', 'a', 's', 't')
+   }, {
+      .name = "fuji",
+      HDR('f', 'u', 'j', 'i')
+   }, {
+      .name = "view",
+      HDR('v', 'i', 'e', 'w')
+   }
+#undef HDR
+};
 
-   FILE *f;
-   if (!(f = fopen(path, mode)))
-      err(EXIT_FAILURE, "fopen(%s, %s)", path, mode);
+static struct sigtrie trie;
 
-   return f;
+static void
+compile_map(void)
+{
+   for (size_t i = 0; i < ARRAY_SIZE(map); ++i)
+      sigtrie_add(&trie, map[i].header, map[i].chunk, i);
 }
 
+struct result {
+   uint8_t buf[32];
+   uint8_t read;
+   uint16_t match;
+   int error;
+};
+
+struct job {
+   const char **paths;
+   struct result *results;
+   size_t count;
+   atomic_size_t next;
+};
+
 static void
-detect(const char *path)
+detect(const char *path, struct result *result)
 {
-   assert(path);
+   assert(path && result);
+   static_assert(sizeof(result->buf) <= (uint8_t)~0, "result buffer does not fit read counter");
 
-   uint8_t buf[32] = {0};
-   const char *name = (!strcmp(path, "-") ? stdin_name : path);
-   FILE *f = (name == stdin_name ? stdin : fopen_or_die(name, "rb"));
-   fread(buf, 1, sizeof(buf), f);
-
-   const struct info {
-      const char *name;
-      const uint8_t *header;
-      size_t chunk;
-   } map[] = {
-#define HDR(...) .header = (const uint8_t[]){__VA_ARGS__}, .chunk = sizeof((const uint8_t[]){__VA_ARGS__})
-      {
-         .name = "BGMStream",
-         HDR('B', 'G', 'M', 'S', 't', 'r', 'e', 'a', 'm')
-      }, {
-         .name = "SeWave",
-         HDR('S', 'e', 'W', 'a', 'v', 'e')
-      }, {
-         .name = "PMUS",
-         HDR('P', 'M', 'U', 'S')
-      }, {
-         .name = "RIFF/WAVE",
-         HDR('R', 'I', 'F', 'F', 0x24, 0xB3, 0xCF, 0x04, 'W', 'A', 'V', 'E', 'f', 'm', 't')
-      }, {
-         .name = "RIFF/ACON",
-         HDR('R', 'I', 'F', 'F', 0x58, 0x23, 0, 0, 'A', 'C', 'O', 'N', 'a', 'n', 'i', 'h')
-      }, {
-         .name = "name",
-         HDR('n', 'o', 'n', 'e', 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0)
-      }, {
-         .name = "syst",
-         HDR('s', 'y', 's', 't')
-      }, {
-         .name = "menu",
-         HDR('m', 'e', 'n', 'u')
-      }, {
-         .name = "lobb",
-         HDR('l', 'o', 'b', 'b')
-      }, {
-         .name = "wave",
-         HDR('w', 'a', 'v', 'e')
-      }, {
-         .name = "ability",
-         HDR(0, 0, 0, 0x17, 0, 0, 0, 0, 0x80)
-      }, {
-         .name = "spell",
-         HDR(0, 0, 0, 0, 0x03, 0, 0x9F, 0, 0x10)
-      }, {
-         .name = "mgc_",
-         HDR('m', 'g', 'c', '_')
-      }, {
-         .name = "win0",
-         HDR('w', 'i', 'n', '0')
-      }, {
-         .name = "titl",
-         HDR('t', 'i', 't', 'l')
-      }, {
-         .name = "sel_",
-         HDR('s', 'e', 'l', '_')
-      }, {
-         .name = "damv",
-         HDR('d', 'a', 'm', 'v')
-      }, {
-         .name = "XISTRING",
-         HDR('X', 'I', 'S', 'T', 'R', 'I', 'N', 'G')
-      }, {
-         .name = "prvd",
-         HDR('p', 'r', 'v', 'd')
-      }, {
-         .name = "selp",
-         HDR('s', 'e', 'l', 'p')
-      }, {
-         .name = "dun",
-         HDR('d', 'u', 'n')
-      }, {
-         .name = "town",
-         HDR('t', 'o', 'w', 'n')
-      }, {
-         .name = "dese",
-         HDR('d', 'e', 's', 'e')
-      }, {
-         .name = "fore",
-         HDR('f', 'o', 'r', 'e')
-      }, {
-         .name = "tree",
-         HDR('t', 'r', 'e', 'e')
-      }, {
-         .name = "unka",
-         HDR('u', 'n', 'k', 'a')
-      }, {
-         .name = "moun",
-         HDR('m', 'o', 'u', 'n')
-      }, {
-         .name = "cast",
-         HDR('c', 'a', 's', 't')
-      }, {
-         .name = "fuji",
-         HDR('f', 'u', 'j', 'i')
-      }, {
-         .name = "view",
-         HDR('v', 'i', 'e', 'w')
-      }
-#undef HDR
-   };
+   *result = (struct result){ .match = SIGTRIE_NONE };
+   const bool is_stdin = !strcmp(path, "-");
 
-#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+   int fd;
+   if (is_stdin) {
+      fd = STDIN_FILENO;
+   } else if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1) {
+      result->error = errno;
+      return;
+   }
 
-   const struct info *info = NULL;
-   for (size_t i = 0; i < ARRAY_SIZE(map); ++i) {
-      assert(map[i].chunk <= sizeof(buf));
-      if (memcmp(buf, map[i].header, map[i].chunk))
-         continue;
+   // Only the leading bytes matter, so don't bother with stdio buffering.
+   // pread avoids the lseek in the common case and is safe to use from many threads.
+   ssize_t r;
+   assert(trie.longest <= sizeof(result->buf));
+   do {
+      r = (is_stdin ? read(fd, result->buf, sizeof(result->buf)) : pread(fd, result->buf, sizeof(result->buf), 0));
+   } while (r == -1 && errno == EINTR);
 
-      info = &map[i];
-      break;
+   if (r == -1) {
+      result->error = errno;
+   } else {
+      result->read = r;
+      result->match = sigtrie_match(&trie, result->buf, result->read);
    }
 
-   if (info) {
-      printf("%s: %s\n", name, info->name);
+   if (!is_stdin)
+      close(fd);
+}
+
+static void
+print_result(const char *path, const struct result *result)
+{
+   assert(path && result);
+   const char *name = (!strcmp(path, "-") ? stdin_name : path);
+
+   if (result->error) {
+      warnx("%s: %s", name, strerror(result->error));
+   } else if (result->match != SIGTRIE_NONE) {
+      printf("%s: %s\n", name, map[result->match].name);
    } else {
       int i;
-      for (i = 0; i < 32 && isprint(buf[i]); ++i);
+      for (i = 0; i < result->read && isprint(result->buf[i]); ++i);
       if (i > 0) {
-         printf("%s: unknown (%.*s)\n", name, i, buf);
+         printf("%s: unknown (%.*s)\n", name, i, result->buf);
       } else {
          printf("%s: unknown\n", name);
       }
    }
+}
 
-   fclose(f);
+static void*
+worker(void *arg)
+{
+   assert(arg);
+   struct job *job = arg;
+   for (size_t i; (i = atomic_fetch_add(&job->next, 1)) < job->count;)
+      detect(job->paths[i], &job->results[i]);
+   return NULL;
+}
+
+static bool
+run(const char **paths, const size_t count, size_t threads)
+{
+   assert(paths || !count);
+
+   struct job job = { .paths = paths, .count = count };
+   if (!(job.results = calloc(count, sizeof(*job.results))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", count, sizeof(*job.results));
+
+   threads = (threads > count ? count : threads);
+   threads = (threads ? threads : 1);
+
+   workers_run(worker, &job, threads);
+
+   bool ok = true;
+   for (size_t i = 0; i < count; ++i) {
+      print_result(paths[i], &job.results[i]);
+      ok = ok && !job.results[i].error;
+   }
+
+   free(job.results);
+   return ok;
+}
+
+static struct {
+   const char **paths;
+   size_t count, len;
+} list;
+
+static void
+list_append(const char *path)
+{
+   assert(path);
+
+   if (list.count >= list.len) {
+      const size_t len = (list.len ? list.len * 2 : 1024);
+      if (!(list.paths = realloc(list.paths, len * sizeof(*list.paths))))
+         err(EXIT_FAILURE, "realloc(%zu)", len * sizeof(*list.paths));
+      list.len = len;
+   }
+
+   list.paths[list.count++] = path;
+}
+
+static int
+list_append_ftw(const char *path, const struct stat *st, int type, struct FTW *ftw)
+{
+   (void)st, (void)ftw;
+
+   if (type == FTW_F) {
+      char *copy;
+      if (!(copy = strdup(path)))
+         err(EXIT_FAILURE, "strdup");
+      list_append(copy);
+   } else if (type == FTW_DNR || type == FTW_NS) {
+      warnx("%s: cannot access", path);
+   }
+
+   return 0;
 }
 
 int
 main(int argc, char *argv[])
 {
-   if (argc < 2)
-      errx(EXIT_FAILURE, "usage: %s file ...", argv[0]);
+   bool recurse = false;
+   long threads = sysconf(_SC_NPROCESSORS_ONLN);
+
+   int i;
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-r")) {
+         recurse = true;
+      } else if (!strcmp(argv[i], "-j") && i + 1 < argc) {
+         threads = strtol(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "--")) {
+         ++i;
+         break;
+      } else {
+         break;
+      }
+   }
+
+   if (i >= argc)
+      errx(EXIT_FAILURE, "usage: %s [-r] [-j threads] file ...", argv[0]);
 
-   for (int i = 1; i < argc; ++i)
-      detect(argv[i]);
+   for (; i < argc; ++i) {
+      if (recurse && strcmp(argv[i], "-")) {
+         if (nftw(argv[i], list_append_ftw, 64, FTW_PHYS) == -1)
+            err(EXIT_FAILURE, "nftw(%s)", argv[i]);
+      } else {
+         list_append(argv[i]);
+      }
+   }
 
-   return EXIT_SUCCESS;
+   compile_map();
+   const bool ok = run(list.paths, list.count, (threads > 0 ? threads : 1));
+   sigtrie_release(&trie);
+   return (ok ? EXIT_SUCCESS : EXIT_FAILURE);
 }
@@ -0,0 +1,232 @@
+#define _DEFAULT_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <inttypes.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <errno.h>
+#include <pthread.h>
+
+#include "xi2path.h"
+#include "xiindex.h"
+
+#define ROM_MAX 9
+
+struct table {
+   void *data;
+   size_t size;
+};
+
+static bool
+table_read(struct table *table, const int dirfd, const char *name)
+{
+   assert(table && name);
+   *table = (struct table){0};
+
+   int fd;
+   if ((fd = openat(dirfd, name, O_RDONLY | O_CLOEXEC)) == -1)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", name);
+
+   if (st.st_size && !(table->data = malloc(st.st_size)))
+      err(EXIT_FAILURE, "malloc(%zu)", (size_t)st.st_size);
+
+   for (ssize_t r; table->size < (size_t)st.st_size; table->size += r) {
+      if ((r = read(fd, (char*)table->data + table->size, st.st_size - table->size)) <= 0) {
+         if (r == -1 && errno == EINTR) {
+            r = 0;
+            continue;
+         }
+         err(EXIT_FAILURE, "read(%s)", name);
+      }
+   }
+
+   close(fd);
+   return true;
+}
+
+struct rom {
+   const char *gamedir;
+   struct xiindex_entry *entries;
+   size_t count;
+   uint8_t rom;
+};
+
+static void*
+rom_build(void *arg)
+{
+   assert(arg);
+   struct rom *rom = arg;
+
+   // FTABLE.DAT contains list of IDs.
+   // VTABLE.DAT contains number of ROM for each entry or 0 if the entry is not used.
+   char dir[4096], names[2][16];
+   if (rom->rom > 1) {
+      snprintf(dir, sizeof(dir), "%s/ROM%u", rom->gamedir, rom->rom);
+      snprintf(names[0], sizeof(names[0]), "FTABLE%u.DAT", rom->rom);
+      snprintf(names[1], sizeof(names[1]), "VTABLE%u.DAT", rom->rom);
+   } else {
+      snprintf(dir, sizeof(dir), "%s", rom->gamedir);
+      snprintf(names[0], sizeof(names[0]), "FTABLE.DAT");
+      snprintf(names[1], sizeof(names[1]), "VTABLE.DAT");
+   }
+
+   int dirfd, gamefd;
+   if ((dirfd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1) {
+      warnx("skipping ROM%u: %s: %s", rom->rom, dir, strerror(errno));
+      return NULL;
+   }
+
+   if ((gamefd = open(rom->gamedir, O_RDONLY | O_DIRECTORY | O_CLOEXEC)) == -1)
+      err(EXIT_FAILURE, "open(%s)", rom->gamedir);
+
+   struct table ftable, vtable;
+   if (!table_read(&ftable, dirfd, names[0]) || !table_read(&vtable, dirfd, names[1])) {
+      warnx("skipping ROM%u: %s/%s: %s", rom->rom, dir, (ftable.data ? names[1] : names[0]), strerror(errno));
+      free(ftable.data);
+      close(gamefd);
+      close(dirfd);
+      return NULL;
+   }
+
+   rom->count = vtable.size;
+   rom->count = (ftable.size / sizeof(uint16_t) < rom->count ? ftable.size / sizeof(uint16_t) : rom->count);
+
+   if (rom->count && !(rom->entries = calloc(rom->count, sizeof(*rom->entries))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", rom->count, sizeof(*rom->entries));
+
+   const uint8_t *exist = vtable.data;
+   for (size_t i = 0; i < rom->count; ++i) {
+      struct xiindex_entry *e = &rom->entries[i];
+      memcpy(&e->id, (uint8_t*)ftable.data + i * sizeof(uint16_t), sizeof(e->id));
+
+      if (!exist[i])
+         continue;
+
+      e->rom = rom->rom;
+      static_assert(sizeof(e->path) >= 18, "xi2rompath needs 18 bytes");
+      xi2rompath(e->path, rom->rom, e->id);
+
+      struct stat st;
+      if (!fstatat(gamefd, e->path, &st, 0) && S_ISREG(st.st_mode)) {
+         e->flags |= XIINDEX_ON_DISK;
+         e->size = (st.st_size > UINT32_MAX ? UINT32_MAX : st.st_size);
+      }
+   }
+
+   free(vtable.data);
+   free(ftable.data);
+   close(gamefd);
+   close(dirfd);
+   return NULL;
+}
+
+static void
+write_index(const char *path, const struct xiindex_entry *entries, const uint32_t count)
+{
+   assert(path && (entries || !count));
+
+   char tmp[4096];
+   snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+   FILE *f;
+   if (!(f = fopen(tmp, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", tmp);
+
+   const struct xiindex_header header = {
+      .magic = XIINDEX_MAGIC,
+      .version = XIINDEX_VERSION,
+      .count = count,
+      .entry_size = sizeof(*entries),
+   };
+
+   if (fwrite(&header, sizeof(header), 1, f) != 1 || fwrite(entries, sizeof(*entries), count, f) != count || fclose(f))
+      err(EXIT_FAILURE, "fwrite(%s)", tmp);
+
+   // Readers may have the old index mapped, replace it atomically.
+   if (rename(tmp, path) == -1)
+      err(EXIT_FAILURE, "rename(%s, %s)", tmp, path);
+}
+
+static void
+build(const char *gamedir, const char *out)
+{
+   assert(gamedir && out);
+
+   // Every ROM is independent, build them all at once.
+   pthread_t tid[ROM_MAX];
+   struct rom roms[ROM_MAX];
+   for (uint8_t i = 0; i < ROM_MAX; ++i) {
+      roms[i] = (struct rom){ .gamedir = gamedir, .rom = i + 1 };
+      if ((errno = pthread_create(&tid[i], NULL, rom_build, &roms[i])))
+         err(EXIT_FAILURE, "pthread_create");
+   }
+
+   size_t count = 0;
+   for (uint8_t i = 0; i < ROM_MAX; ++i) {
+      pthread_join(tid[i], NULL);
+      count = (roms[i].count > count ? roms[i].count : count);
+   }
+
+   if (count > UINT32_MAX)
+      errx(EXIT_FAILURE, "too many entries: %zu", count);
+
+   struct xiindex_entry *entries = NULL;
+   if (count && !(entries = calloc(count, sizeof(*entries))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", count, sizeof(*entries));
+
+   // The first ROM that uses the file id owns the entry.
+   for (uint8_t i = 0; i < ROM_MAX; ++i) {
+      for (size_t e = 0; e < roms[i].count; ++e) {
+         if (!entries[e].rom)
+            entries[e] = roms[i].entries[e];
+      }
+      free(roms[i].entries);
+   }
+
+   write_index(out, entries, count);
+   free(entries);
+}
+
+static void
+lookup(const char *path, char *ids[], const int count)
+{
+   assert(path && ids);
+
+   struct xiindex index;
+   xiindex_open_or_die(&index, path);
+
+   for (int i = 0; i < count; ++i) {
+      const struct xiindex_entry *e;
+      const uint32_t id = strtoul(ids[i], NULL, 10);
+      if (!(e = xiindex_lookup(&index, id)) || !e->rom) {
+         printf("%" PRIu32 ": unused\n", id);
+      } else if (!(e->flags & XIINDEX_ON_DISK)) {
+         printf("%" PRIu32 ": %s (missing)\n", id, e->path);
+      } else {
+         printf("%" PRIu32 ": %s (%" PRIu32 " bytes)\n", id, e->path, e->size);
+      }
+   }
+
+   xiindex_close(&index);
+}
+
+int
+main(int argc, char *argv[])
+{
+   if (argc >= 3 && !strcmp(argv[1], "-l")) {
+      lookup(argv[2], argv + 3, argc - 3);
+   } else if (argc == 3) {
+      build(argv[1], argv[2]);
+   } else {
+      errx(EXIT_FAILURE, "usage: %s gamedir index | -l index id ...", argv[0]);
+   }
+
+   return EXIT_SUCCESS;
+}
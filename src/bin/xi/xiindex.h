@@ -0,0 +1,109 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// On-disk index of every file id in FTABLE*.DAT/VTABLE*.DAT.
+// The file is a header followed by fixed size entries indexed by file id,
+// so it can be mapped and queried in O(1) without parsing anything.
+
+#define XIINDEX_MAGIC "XIIX"
+#define XIINDEX_VERSION 1
+
+enum xiindex_flags {
+   XIINDEX_ON_DISK = 1<<0, // rompath exists in gamedir, size is valid
+};
+
+struct xiindex_header {
+   char magic[4];
+   uint32_t version;
+   uint32_t count; // number of entries
+   uint32_t entry_size; // sizeof(struct xiindex_entry)
+};
+
+struct xiindex_entry {
+   uint32_t size; // file size in bytes
+   uint16_t id; // id from FTABLE, see xi2path
+   uint8_t rom; // ROM the entry lives in, 0 if the entry is not used
+   uint8_t flags; // enum xiindex_flags
+   char path[24]; // nul terminated xi2rompath
+};
+
+static_assert(sizeof(struct xiindex_header) == 16, "struct xiindex_header has unexpected padding");
+static_assert(sizeof(struct xiindex_entry) == 32, "struct xiindex_entry has unexpected padding");
+
+struct xiindex {
+   const struct xiindex_header *header;
+   const struct xiindex_entry *entries;
+   size_t map_sz;
+};
+
+static inline bool
+xiindex_open(struct xiindex *index, const char *path)
+{
+   assert(index && path);
+   *index = (struct xiindex){0};
+
+   int fd;
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*index->header)) {
+      close(fd);
+      return false;
+   }
+
+   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return false;
+
+   const struct xiindex_header *header = map;
+   if (memcmp(header->magic, XIINDEX_MAGIC, sizeof(header->magic)) ||
+       header->version != XIINDEX_VERSION ||
+       header->entry_size != sizeof(struct xiindex_entry) ||
+       ((size_t)st.st_size - sizeof(*header)) / sizeof(struct xiindex_entry) < header->count) {
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   index->header = header;
+   index->entries = (const void*)(header + 1);
+   index->map_sz = st.st_size;
+   return true;
+}
+
+static inline void
+xiindex_open_or_die(struct xiindex *index, const char *path)
+{
+   if (!xiindex_open(index, path))
+      errx(EXIT_FAILURE, "'%s' is not a valid xi index", path);
+}
+
+static inline const struct xiindex_entry*
+xiindex_lookup(const struct xiindex *index, const uint32_t file_id)
+{
+   assert(index && index->header);
+   return (file_id < index->header->count ? &index->entries[file_id] : NULL);
+}
+
+static inline void
+xiindex_close(struct xiindex *index)
+{
+   assert(index);
+
+   if (index->header)
+      munmap((void*)index->header, index->map_sz);
+
+   *index = (struct xiindex){0};
+}
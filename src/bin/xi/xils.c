@@ -1,3 +1,4 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <stdbool.h>
 #include <string.h>
@@ -5,6 +6,7 @@
 #include <err.h>
 
 #include "xi2path.h"
+#include "xiindex.h"
 
 static FILE*
 fopen_or_die(const char *gamedir, const char *file, const char *mode)
@@ -60,14 +62,40 @@ dump_tables(const char *dir, const char *names[2], const uint8_t rom, const bool
    fclose(f);
 }
 
+static void
+dump_index(const char *path, const bool print_all, const bool verbose)
+{
+   assert(path);
+
+   struct xiindex index;
+   xiindex_open_or_die(&index, path);
+
+   for (uint32_t i = 0; i < index.header->count; ++i) {
+      const struct xiindex_entry *e = xiindex_lookup(&index, i);
+      if (!print_all && !e->rom)
+         continue;
+
+      if (verbose)
+         printf("%u: ", e->rom);
+
+      char path[18];
+      xi2rompath(path, (e->rom ? e->rom : 1), e->id);
+      printf("%s\n", (e->rom ? e->path : path));
+   }
+
+   xiindex_close(&index);
+}
+
 int
 main(int argc, char *argv[])
 {
    bool verbose = false;
    bool print_all = false;
-   const char *gamedir = NULL;
+   const char *gamedir = NULL, *index = NULL;
    for (int i = 1; i < argc; ++i) {
-      if (!strcmp(argv[i], "-a")) {
+      if (!strcmp(argv[i], "-i") && i + 1 < argc) {
+         index = argv[++i];
+      } else if (!strcmp(argv[i], "-a")) {
          print_all = true;
       } else if (!strcmp(argv[i], "-v")) {
          verbose = true;
@@ -77,8 +105,13 @@ main(int argc, char *argv[])
       }
    }
 
+   if (index) {
+      dump_index(index, print_all, verbose);
+      return EXIT_SUCCESS;
+   }
+
    if (!gamedir)
-      errx(EXIT_FAILURE, "usage: %s [-a|-v] gamedir", argv[0]);
+      errx(EXIT_FAILURE, "usage: %s [-a|-v] (gamedir | -i index)", argv[0]);
 
    dump_tables(gamedir, (const char*[]){ "FTABLE.DAT", "VTABLE.DAT" }, 1, print_all, verbose);
 
@@ -0,0 +1,461 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include <fspec/bcode.h>
+#include <fspec/lexer.h>
+#include <fspec/validator.h>
+#include <fspec/linker.h>
+#include <fspec/optimizer.h>
+
+#include "compile.h"
+#include "util/xxh64.h"
+#include "util/misc.h"
+
+struct lexer {
+   struct fspec_lexer lexer;
+   struct units *units;
+   const char *path;
+   FILE *file;
+};
+
+struct linker {
+   struct fspec_linker linker;
+   struct units *units;
+};
+
+static size_t
+fspec_lexer_read(struct fspec_lexer *lexer, void *ptr, const size_t size, const size_t nmemb)
+{
+   assert(lexer && ptr);
+   struct lexer *l = container_of(lexer, struct lexer, lexer);
+   return fread(ptr, size, nmemb, l->file);
+}
+
+static size_t
+fspec_validator_read(struct fspec_validator *validator, void *ptr, const size_t size, const size_t nmemb)
+{
+   assert(validator && ptr);
+   assert(ptr == validator->mem.input.data);
+   const size_t read = validator->mem.input.len / size;
+   assert((validator->mem.input.len && read == nmemb) || (!validator->mem.input.len && !read));
+   validator->mem.input.len -= read * size;
+   assert(validator->mem.input.len == 0);
+   return read;
+}
+
+bool
+validate(const struct fspec_mem *bcode, const char *name)
+{
+   struct fspec_validator validator = {
+      .ops.read = fspec_validator_read,
+      .mem.input = *bcode,
+   };
+
+   return fspec_validator_parse(&validator, name);
+}
+
+size_t
+lexer_output_size(const size_t size)
+{
+   // No construct takes more than 16 bytes of bytecode per byte of spec, the rest is for the header.
+   // Imports grow the output for the externs they declare.
+   return 4096 + size * 16;
+}
+
+static void
+mkdirp(char *path)
+{
+   assert(path);
+   for (char *s = path; *s; ++s) {
+      if (*s != '/')
+         continue;
+
+      *s = 0;
+      mkdir(path, 0755);
+      *s = '/';
+   }
+}
+
+static bool
+resolve_module(const char *from, const char *module, char *out, const size_t out_sz)
+{
+   assert(from && module && out);
+
+   // modules are relative to the importing spec
+   const char *dir = strrchr(from, '/');
+   const int len = (*module == '/' || !dir ? 0 : (int)(dir - from) + 1);
+   const int ret = snprintf(out, out_sz, "%.*s%s", len, from, module);
+   return (ret >= 0 && (size_t)ret < out_sz);
+}
+
+#ifndef FSPEC_LEXER_ID
+#  error "FSPEC_LEXER_ID must be the checksum of the lexer sources, see Makefile"
+#endif
+
+// Units are cached by the path of the spec and invalidated when the spec or the lexer changes.
+// Only the units of the changed specs are recompiled, the linker resolves the rest.
+// The lexer output may change without a new bytecode version, so the checksum of the lexer sources is compared too.
+struct cache_header {
+   uint64_t lexer, version, mtime, mtime_nsec, size;
+};
+
+static bool
+cache_path(const char *path, char *out, const size_t out_sz)
+{
+   assert(path && out);
+
+   int ret;
+   const char *xdg = getenv("XDG_CACHE_HOME"), *home = getenv("HOME");
+   const uint64_t hash = xxh64(path, strlen(path), 0);
+   if (xdg && *xdg) {
+      ret = snprintf(out, out_sz, "%s/fspec/%016" PRIx64 ".bc", xdg, hash);
+   } else if (home && *home) {
+      ret = snprintf(out, out_sz, "%s/.cache/fspec/%016" PRIx64 ".bc", home, hash);
+   } else {
+      return false;
+   }
+
+   return (ret >= 0 && (size_t)ret < out_sz);
+}
+
+static bool
+cache_read(const char *path, const struct cache_header *expect, struct fspec_mem *out_bcode)
+{
+   assert(path && expect && out_bcode);
+
+   FILE *f;
+   if (!(f = fopen(path, "rb")))
+      return false;
+
+   struct stat st;
+   struct cache_header header;
+   if (fstat(fileno(f), &st) == -1 || (size_t)st.st_size <= sizeof(header) ||
+       fread(&header, 1, sizeof(header), f) != sizeof(header) || memcmp(&header, expect, sizeof(header))) {
+      fclose(f);
+      return false;
+   }
+
+   struct fspec_mem bcode = { .len = st.st_size - sizeof(header) };
+   if (!(bcode.data = malloc(bcode.len)))
+      err(EXIT_FAILURE, "malloc(%zu)", bcode.len);
+
+   const bool ok = (fread(bcode.data, 1, bcode.len, f) == bcode.len);
+   fclose(f);
+
+   if (!ok || !validate(&bcode, path)) {
+      free(bcode.data);
+      return false;
+   }
+
+   *out_bcode = bcode;
+   return true;
+}
+
+static void
+cache_write(const char *path, const struct cache_header *header, const struct fspec_mem *bcode)
+{
+   assert(path && header && bcode);
+
+   char tmp[PATH_MAX];
+   const int ret = snprintf(tmp, sizeof(tmp), "%s.%ld", path, (long)getpid());
+   if (ret < 0 || (size_t)ret >= sizeof(tmp))
+      return;
+
+   mkdirp(tmp);
+
+   FILE *f;
+   if (!(f = fopen(tmp, "wb")))
+      return;
+
+   const bool ok = (fwrite(header, 1, sizeof(*header), f) == sizeof(*header) && fwrite(bcode->data, 1, bcode->len, f) == bcode->len);
+
+   if (fclose(f) || !ok || rename(tmp, path) == -1)
+      unlink(tmp);
+}
+
+static bool
+units_load_imports(struct units *units, const size_t index)
+{
+   assert(units && index < units->count);
+
+   char path[PATH_MAX];
+   const struct fspec_mem bcode = units->unit[index].bcode;
+   const void *end = (char*)bcode.data + bcode.len;
+   for (const enum fspec_op *op = bcode.data; op; op = fspec_op_next(op, end, true)) {
+      if (*op != FSPEC_OP_DECLARATION || fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) != FSPEC_DECLARATION_EXTERN)
+         continue;
+
+      const char *module = fspec_arg_get_cstr(fspec_op_get_arg(op, end, 5, 1<<FSPEC_ARG_STR), bcode.data);
+      size_t unit;
+      if (!resolve_module(units->unit[index].path, module, path, sizeof(path))) {
+         warnx("%s: import path '%s' is too long", units->unit[index].path, module);
+         return false;
+      }
+
+      if (!units_load(units, path, &unit))
+         return false;
+   }
+
+   return true;
+}
+
+static bool
+fspec_lexer_import(struct fspec_lexer *lexer, const char *module, struct fspec_mem *out_unit)
+{
+   assert(lexer && module && out_unit);
+   struct lexer *l = container_of(lexer, struct lexer, lexer);
+
+   char path[PATH_MAX];
+   if (!resolve_module(l->path, module, path, sizeof(path)))
+      return false;
+
+   // units_load may move the units
+   size_t index;
+   if (!units_load(l->units, path, &index))
+      return false;
+
+   *out_unit = l->units->unit[index].bcode;
+   return true;
+}
+
+static bool
+compile_unit(struct units *units, const char *path, struct fspec_mem *out_bcode)
+{
+   assert(units && path && out_bcode);
+
+   FILE *f;
+   if (!(f = fopen(path, "rb"))) {
+      warn("fopen(%s, rb)", path);
+      return false;
+   }
+
+   struct stat st;
+   if (fstat(fileno(f), &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", path);
+
+   char input[4096];
+   const size_t len = lexer_output_size(st.st_size);
+   struct lexer l = {
+      .lexer = {
+         .ops.read = fspec_lexer_read,
+         .ops.import = fspec_lexer_import,
+         .mem.input = { .data = input, sizeof(input) },
+         .mem.output = { .data = malloc(len), len },
+      },
+      .units = units,
+      .path = path,
+      .file = f,
+   };
+
+   if (!l.lexer.mem.output.data)
+      err(EXIT_FAILURE, "malloc(%zu)", len);
+
+   const bool ok = fspec_lexer_parse(&l.lexer, path);
+   fclose(l.file);
+
+   if (!ok || !validate(&l.lexer.mem.output, path)) {
+      free(l.lexer.mem.output.data);
+      return false;
+   }
+
+   // the storage is sized for the worst case, the units are kept around until linked
+   void *data;
+   if ((data = realloc(l.lexer.mem.output.data, l.lexer.mem.output.len)))
+      l.lexer.mem.output.data = data;
+
+   *out_bcode = l.lexer.mem.output;
+   return true;
+}
+
+static void
+units_truncate(struct units *units, const size_t count)
+{
+   assert(units && count <= units->count);
+
+   for (size_t i = count; i < units->count; ++i) {
+      free(units->unit[i].bcode.data);
+      free(units->unit[i].path);
+   }
+
+   units->count = count;
+}
+
+bool
+units_load(struct units *units, const char *path, size_t *out_index)
+{
+   assert(units && path && out_index);
+
+   char *real;
+   if (!(real = realpath(path, NULL))) {
+      warn("realpath(%s)", path);
+      return false;
+   }
+
+   for (size_t i = 0; i < units->count; ++i) {
+      if (strcmp(units->unit[i].path, real))
+         continue;
+
+      const bool cycle = units->unit[i].compiling;
+      if (cycle)
+         warnx("%s: import cycle", real);
+
+      free(real);
+      *out_index = i;
+      return !cycle;
+   }
+
+   if (!(units->unit = realloc(units->unit, sizeof(*units->unit) * (units->count + 1))))
+      err(EXIT_FAILURE, "realloc(%zu)", sizeof(*units->unit) * (units->count + 1));
+
+   const size_t index = units->count++;
+   units->unit[index] = (struct unit){ .path = real, .compiling = true };
+
+   struct stat st;
+   if (stat(real, &st) == -1) {
+      warn("stat(%s)", real);
+      units_truncate(units, index);
+      return false;
+   }
+
+   char cache[PATH_MAX];
+   const bool cacheable = cache_path(real, cache, sizeof(cache));
+   const struct cache_header header = {
+      .lexer = FSPEC_LEXER_ID,
+      .version = FSPEC_BCODE_VERSION,
+      .mtime = st.st_mtim.tv_sec, .mtime_nsec = st.st_mtim.tv_nsec, .size = st.st_size
+   };
+
+   // a failed unit is dropped with the units it loaded, they are loaded again if needed
+   struct fspec_mem bcode;
+   if (cacheable && cache_read(cache, &header, &bcode)) {
+      units->unit[index].bcode = bcode;
+
+      if (!units_load_imports(units, index)) {
+         units_truncate(units, index);
+         return false;
+      }
+   } else {
+      if (!compile_unit(units, real, &bcode)) {
+         units_truncate(units, index);
+         return false;
+      }
+
+      units->unit[index].bcode = bcode;
+
+      if (cacheable)
+         cache_write(cache, &header, &bcode);
+   }
+
+   units->unit[index].compiling = false;
+   *out_index = index;
+   return true;
+}
+
+static bool
+fspec_linker_import(struct fspec_linker *linker, const struct fspec_mem *unit, const char *module, struct fspec_mem *out_unit)
+{
+   assert(linker && unit && module && out_unit);
+   struct linker *l = container_of(linker, struct linker, linker);
+
+   for (size_t i = 0; i < l->units->count; ++i) {
+      if (l->units->unit[i].bcode.data != unit->data)
+         continue;
+
+      char path[PATH_MAX];
+      if (!resolve_module(l->units->unit[i].path, module, path, sizeof(path)))
+         return false;
+
+      size_t index;
+      if (!units_load(l->units, path, &index))
+         return false;
+
+      *out_unit = l->units->unit[index].bcode;
+      return true;
+   }
+
+   return false;
+}
+
+void
+units_release(struct units *units)
+{
+   assert(units);
+   units_truncate(units, 0);
+   free(units->unit);
+   *units = (struct units){0};
+}
+
+struct fspec_mem
+compile(const char *path)
+{
+   assert(path);
+
+   size_t root;
+   struct units units = {0};
+   if (!units_load(&units, path, &root))
+      exit(EXIT_FAILURE);
+
+   struct fspec_mem bcode = {0};
+
+   {
+      // Linking only drops externs and may widen the declaration numbers.
+      size_t len = 0;
+      for (size_t i = 0; i < units.count; ++i)
+         len += units.unit[i].bcode.len * 2;
+
+      struct linker l = {
+         .linker = {
+            .ops.import = fspec_linker_import,
+            .mem.input = units.unit[root].bcode,
+            .mem.output = { .data = malloc(len), .len = len },
+         },
+         .units = &units,
+      };
+
+      if (!l.linker.mem.output.data)
+         err(EXIT_FAILURE, "malloc(%zu)", len);
+
+      if (!fspec_linker_link(&l.linker, path))
+         exit(EXIT_FAILURE);
+
+      if (!validate(&l.linker.mem.output, path))
+         exit(EXIT_FAILURE);
+
+      bcode = l.linker.mem.output;
+   }
+
+   units_release(&units);
+
+   {
+      // Blocks add less than half of the size of the members they cover.
+      const size_t len = bcode.len * 2;
+      struct fspec_optimizer optimizer = {
+         .mem.input = bcode,
+         .mem.output = { .data = malloc(len), .len = len },
+      };
+
+      if (!optimizer.mem.output.data)
+         err(EXIT_FAILURE, "malloc(%zu)", len);
+
+      if (!fspec_optimizer_optimize(&optimizer, path))
+         exit(EXIT_FAILURE);
+
+      if (!validate(&optimizer.mem.output, path))
+         exit(EXIT_FAILURE);
+
+      free(bcode.data);
+      bcode = optimizer.mem.output;
+   }
+
+   return bcode;
+}
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <fspec/memory.h>
+
+#include <stddef.h>
+#include <stdbool.h>
+
+// Compiles specs from files, shared by the tools that execute specs.
+
+struct unit {
+   char *path;
+   struct fspec_mem bcode;
+   bool compiling;
+};
+
+struct units {
+   struct unit *unit;
+   size_t count;
+};
+
+/** loads unit of the spec and the units it imports, returns false and warns if the spec doesn't compile */
+bool
+units_load(struct units *units, const char *path, size_t *out_index);
+
+void
+units_release(struct units *units);
+
+bool
+validate(const struct fspec_mem *bcode, const char *name);
+
+/** storage the lexer needs for the bytecode of a spec of size bytes, without the externs of its imports */
+size_t
+lexer_output_size(const size_t size);
+
+/** returns linked, optimized and validated bytecode of the spec, exits on failure */
+struct fspec_mem
+compile(const char *path);
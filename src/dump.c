@@ -1,5 +1,7 @@
+#define _DEFAULT_SOURCE
 #include <stdlib.h>
 #include <stdio.h>
+#include <inttypes.h>
 #include <limits.h>
 #include <string.h>
 #include <assert.h>
@@ -9,11 +11,22 @@
 #include <errno.h>
 #include <locale.h>
 #include <langinfo.h>
+#include <time.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include <squash.h>
 
 #include <fspec/bcode.h>
-#include <fspec/lexer.h>
-#include <fspec/validator.h>
+#include <fspec/bits.h>
+
+#include "compile.h"
+#include "util/xxh64.h"
+#include "util/crc32.h"
+#include "util/sigtrie.h"
+#include "util/misc.h"
 
 #define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
 
@@ -154,6 +167,22 @@ dump_ops(const struct code *code)
             printf("visual\n");
             break;
 
+         case FSPEC_OP_BLOCK:
+            printf("block\n");
+            break;
+
+         case FSPEC_OP_SKIP:
+            printf("skip\n");
+            break;
+
+         case FSPEC_OP_SWITCH:
+            printf("switch\n");
+            break;
+
+         case FSPEC_OP_TABLE:
+            printf("table\n");
+            break;
+
          case FSPEC_OP_ARG:
             {
                const enum fspec_arg *arg = (void*)(op + 1);
@@ -168,6 +197,9 @@ dump_ops(const struct code *code)
                      break;
 
                   case FSPEC_ARG_NUM:
+                  case FSPEC_ARG_NUM8:
+                  case FSPEC_ARG_NUM16:
+                  case FSPEC_ARG_NUM32:
                      printf("num %" PRI_FSPEC_NUM "\n", fspec_arg_get_num(arg));
                      break;
 
@@ -284,6 +316,7 @@ display(const void *buf, const size_t size, const size_t nmemb, const bool is_si
          print_array(buf, size, nmemb, print_hex);
          break;
 
+      case FSPEC_VISUAL_ENUM:
       case FSPEC_VISUAL_DEC:
          print_array(buf, size, nmemb, (is_signed ? print_sdec : print_udec));
          break;
@@ -294,61 +327,295 @@ display(const void *buf, const size_t size, const size_t nmemb, const bool is_si
 }
 
 struct decl {
-   struct dynbuf buf;
    const char *name;
    const void *start, *end;
+   const enum fspec_op *table; // constants of an enum declaration
+   fspec_num members; // members of a struct declaration
+   enum fspec_declaration declaration;
+};
+
+// Value of a member, each struct on the stack owns values for its members.
+struct value {
+   struct dynbuf buf;
+   const struct decl *decl, *constants; // constants is the enum of FSPEC_VISUAL_ENUM
    size_t nmemb;
-   uint8_t size;
+   uint8_t size, bits; // bits is the width of elements, which are stored in size bytes
+   bool skip; // value is never used, so it isn't stored
    enum fspec_visual visual;
-   enum fspec_declaration declaration;
 };
 
 static void
-decl_display(const struct decl *decl)
+print_constants(const struct code *code, const struct value *value)
+{
+   assert(code && value && value->constants);
+
+   // the enum is outside of the struct being executed
+   const void *end = value->constants->end;
+   const enum fspec_op *table = value->constants->table;
+   const enum fspec_arg *arg = fspec_op_get_arg(table, end, 3, 1<<FSPEC_ARG_DAT);
+   const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(table, end, 1, 1<<FSPEC_ARG_NUM));
+
+   printf("%s", (value->nmemb > 1 ? "{ " : ""));
+
+   for (size_t n = 0; n < value->nmemb; ++n) {
+      fspec_num v = 0;
+      const uint8_t *p = (const uint8_t*)value->buf.data + n * value->size;
+      for (size_t i = 0; i < value->size && i < sizeof(v); ++i)
+         v |= (fspec_num)p[i] << (8 * i);
+
+      // values without a constant are shown as numbers
+      const fspec_num c = fspec_op_table_lookup(table, end, v);
+      if (c < cases) {
+         printf("%s", fspec_arg_get_cstr(fspec_arg_next(arg, end, 1 + c, 1<<FSPEC_ARG_STR), code->data));
+      } else {
+         print_udec(p, value->size);
+      }
+
+      printf("%s", (value->nmemb > 1 && n + 1 < value->nmemb ? ", " : ""));
+   }
+
+   printf("%s\n", (value->nmemb > 1 ? " }" : ""));
+}
+
+static void
+value_display(const struct code *code, const struct value *value)
 {
-   assert(decl);
-   assert(decl->size * decl->nmemb <= decl->buf.len);
-   printf("%s: ", decl->name);
-   display(decl->buf.data, decl->size, decl->nmemb, false, decl->visual);
+   assert(code && value);
+   assert(value->skip || value->size * value->nmemb <= value->buf.len);
+   printf("%s: ", value->decl->name);
+
+   if (value->visual == FSPEC_VISUAL_ENUM && value->constants && !value->skip) {
+      print_constants(code, value);
+   } else {
+      display(value->buf.data, value->size, value->nmemb, false, value->visual);
+   }
 }
 
 static fspec_num
-decl_get_num(const struct decl *decl)
+value_get_num(const struct value *value)
 {
-   assert(decl);
-   assert(decl->nmemb == 1);
-   assert(decl->size * decl->nmemb <= decl->buf.len);
+   assert(value);
+   assert(value->nmemb == 1);
+   assert(value->size * value->nmemb <= value->buf.len);
    char hex[2 * sizeof(fspec_num) + 1];
-   to_hex(decl->buf.data, decl->size, hex, sizeof(hex), true);
+   to_hex(value->buf.data, value->size, hex, sizeof(hex), true);
    static_assert(sizeof(fspec_num) <= sizeof(uint64_t), "fspec_num is larger than uint64_t");
    return (fspec_num)strtoull(hex, NULL, 16);
 }
 
 static const char*
-decl_get_cstr(const struct decl *decl)
+value_get_cstr(const struct value *value)
 {
-   assert(decl);
-   return decl->buf.data;
+   assert(value);
+   return value->buf.data;
 }
 
+struct block {
+   struct dynbuf buf;
+   size_t offset;
+   struct fspec_bits bits; // rest of the last byte read by a bit field
+};
+
 struct context {
    struct code code;
    struct decl *decl;
-   fspec_num decl_count;
+   struct block *block;
+   struct value *values; // values of the current struct
+   fspec_num decl_count, first; // first is the id of the first member of the current struct
+   int follow; // inotify watching the input for appends, -1 if the input ends at EOF
+   const char *checkpoint; // file to write checkpoints to, NULL to not write them
+   bool resume; // continue from the checkpoint, if there is one
 };
 
+static void
+follow_wait(const int fd, FILE *f)
+{
+   assert(f);
+
+   // everything decoded so far is complete, so it's the time to show it
+   fflush(stdout);
+   clearerr(f);
+
+   // events queue up while decoding, so appends between EOF and here are not missed
+   char buf[sizeof(struct inotify_event) + NAME_MAX + 1] __attribute__((aligned(__alignof__(struct inotify_event))));
+   while (read(fd, buf, sizeof(buf)) == -1) {
+      if (errno != EINTR)
+         err(EXIT_FAILURE, "read(inotify)");
+   }
+}
+
+static size_t
+input_read(const struct context *context, void *ptr, const size_t size, const size_t nmemb, FILE *f)
+{
+   assert(context && size && f);
+
+   if (context->follow == -1)
+      return fread(ptr, size, nmemb, f);
+
+   // When following, the input never ends, partial elements are waited for instead of dropped.
+   size_t read = 0;
+   while (read < size * nmemb && !ferror(f)) {
+      if ((read += fread((char*)ptr + read, 1, size * nmemb - read, f)) < size * nmemb)
+         follow_wait(context->follow, f);
+   }
+
+   return read / size;
+}
+
+static size_t
+read_elements(const struct context *context, void *ptr, const size_t size, const size_t nmemb, FILE *f)
+{
+   assert(context && ptr && f);
+   struct block *block = context->block;
+
+   if (block->offset >= block->buf.written)
+      return input_read(context, ptr, size, nmemb, f);
+
+   // Members of a block were read at once, slice them from the block.
+   const size_t left = (block->buf.written - block->offset) / size;
+   const size_t read = (nmemb < left ? nmemb : left);
+   memcpy(ptr, (char*)block->buf.data + block->offset, size * read);
+   block->offset += size * read;
+   return read;
+}
+
+static size_t
+skip_elements(const struct context *context, const size_t size, const size_t nmemb, FILE *f)
+{
+   assert(context && size && f);
+   struct block *block = context->block;
+
+   if (block->offset < block->buf.written) {
+      const size_t left = (block->buf.written - block->offset) / size;
+      const size_t read = (nmemb < left ? nmemb : left);
+      block->offset += size * read;
+      return read;
+   }
+
+   // Seekable input can be skipped without reading, short skip consumes the input like short fread.
+   off_t pos;
+   struct stat st;
+   if (!fstat(fileno(f), &st) && S_ISREG(st.st_mode) && (pos = ftello(f)) != -1) {
+      const size_t avail = (st.st_size > pos ? (size_t)(st.st_size - pos) : 0);
+      const size_t read = (nmemb < avail / size ? nmemb : avail / size);
+
+      // followed input has to wait for the rest to be appended
+      if ((context->follow == -1 || read == nmemb) && !fseeko(f, pos + (read < nmemb ? avail : read * size), SEEK_SET)) {
+         if (read < nmemb)
+            fgetc(f);
+
+         return read;
+      }
+   }
+
+   size_t read = 0;
+   char scratch[4096];
+   while (read < nmemb) {
+      const size_t want = (nmemb - read < sizeof(scratch) / size ? nmemb - read : sizeof(scratch) / size);
+      const size_t r = input_read(context, scratch, size, want, f);
+      read += r;
+
+      if (r < want)
+         break;
+   }
+
+   return read;
+}
+
+static bool
+read_bits(const struct context *context, const uint8_t bits, uint64_t *out_v, FILE *f)
+{
+   assert(context && bits <= 64 && out_v && f);
+   struct block *block = context->block;
+
+   uint64_t v = 0;
+   for (uint8_t got = 0; got < bits;) {
+      if (block->bits.len < bits - got) {
+         uint8_t byte[sizeof(block->bits.window)];
+         const size_t need = (bits - got - block->bits.len + 7) / 8, room = (64 - block->bits.len) / 8;
+         const size_t want = (need < room ? need : room);
+         const size_t read = read_elements(context, byte, 1, want, f);
+
+         for (size_t i = 0; i < read; ++i)
+            fspec_bits_push_byte(&block->bits, byte[i]);
+
+         if (read < want)
+            return false;
+      }
+
+      uint64_t part;
+      const uint8_t take = fspec_bits_take(&block->bits, bits - got, &part);
+      v |= part << got;
+      got += take;
+   }
+
+   *out_v = v;
+   return true;
+}
+
+static bool
+value_is_aligned(const struct context *context, const struct value *value)
+{
+   assert(context && value);
+   return !(value->bits % 8) && !context->block->bits.len;
+}
+
+static size_t
+value_read_bits(const struct context *context, struct value *value, const size_t nmemb, FILE *f)
+{
+   assert(context && value && f);
+
+   if (!value->skip)
+      dynbuf_grow_if_needed(&value->buf, value->size * nmemb);
+
+   size_t read = 0;
+   for (uint64_t v; read < nmemb && read_bits(context, value->bits, &v, f); ++read) {
+      if (value->skip)
+         continue;
+
+      fspec_bits_store((uint8_t*)value->buf.data + value->buf.written, v, value->size);
+      value->buf.written += value->size;
+   }
+
+   return read;
+}
+
+static size_t
+value_read(const struct context *context, struct value *value, const size_t nmemb, FILE *f)
+{
+   assert(context && value && f);
+
+   if (!value_is_aligned(context, value))
+      return value_read_bits(context, value, nmemb, f);
+
+   if (value->skip)
+      return skip_elements(context, value->size, nmemb, f);
+
+   dynbuf_grow_if_needed(&value->buf, value->size * nmemb);
+   const size_t read = read_elements(context, (char*)value->buf.data + value->buf.written, value->size, nmemb, f);
+   value->buf.written += value->size * read;
+   return read;
+}
+
+static const struct value*
+var_get_value(const struct context *context, const enum fspec_arg *arg)
+{
+   assert(context && arg);
+   const fspec_num id = fspec_arg_get_num(arg);
+   assert(id >= context->first && id - context->first < context->decl[context->first - 1].members);
+   return &context->values[id - context->first];
+}
+
 static fspec_num
 var_get_num(const struct context *context, const enum fspec_arg *arg)
 {
-   assert(context && arg);
-   return decl_get_num(&context->decl[fspec_arg_get_num(arg)]);
+   return value_get_num(var_get_value(context, arg));
 }
 
 static const char*
 var_get_cstr(const struct context *context, const enum fspec_arg *arg)
 {
-   assert(context && arg);
-   return decl_get_cstr(&context->decl[fspec_arg_get_num(arg)]);
+   return value_get_cstr(var_get_value(context, arg));
 }
 
 enum type {
@@ -359,12 +626,11 @@ enum type {
 static enum type
 var_get_type(const struct context *context, const enum fspec_arg *arg)
 {
-   assert(context && arg);
-   const struct decl *decl = &context->decl[fspec_arg_get_num(arg)];
-   switch (decl->visual) {
+   switch (var_get_value(context, arg)->visual) {
       case FSPEC_VISUAL_DEC:
       case FSPEC_VISUAL_HEX:
       case FSPEC_VISUAL_NUL:
+      case FSPEC_VISUAL_ENUM:
          return TYPE_NUM;
 
       case FSPEC_VISUAL_STR:
@@ -377,9 +643,9 @@ var_get_type(const struct context *context, const enum fspec_arg *arg)
 }
 
 static void
-filter_decompress(const struct context *context, struct decl *decl)
+filter_decompress(const struct context *context, struct value *value)
 {
-   assert(decl);
+   assert(value);
 
    const enum fspec_arg *arg;
    if (!(arg = fspec_op_get_arg(context->code.start, context->code.end, 2, 1<<FSPEC_ARG_STR)))
@@ -394,15 +660,15 @@ filter_decompress(const struct context *context, struct decl *decl)
    if (!(opts = squash_options_new(codec, NULL)))
       errx(EXIT_FAILURE, "squash_options_new");
 
-   size_t dsize = squash_codec_get_uncompressed_size(codec, decl->buf.len, decl->buf.data);
-   dsize = (dsize ? dsize : decl->buf.len * 2);
+   size_t dsize = squash_codec_get_uncompressed_size(codec, value->buf.len, value->buf.data);
+   dsize = (dsize ? dsize : value->buf.len * 2);
 
    {
       const enum fspec_arg *var = arg;
       if ((arg = fspec_arg_next(arg, context->code.end, 1, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR))) {
          var = arg;
 
-         switch (*var) {
+         switch (fspec_arg_get_type(var)) {
             case FSPEC_ARG_NUM:
                dsize = fspec_arg_get_num(arg);
                break;
@@ -421,7 +687,7 @@ filter_decompress(const struct context *context, struct decl *decl)
          if (!(var = fspec_arg_next(var, context->code.end, 1, ~0)))
             errx(EXIT_FAILURE, "expected argument for key '%s'", key);
 
-         switch (*var) {
+         switch (fspec_arg_get_type(var)) {
             case FSPEC_ARG_STR:
                squash_options_set_string(opts, key, fspec_arg_get_cstr(var, context->code.data));
                break;
@@ -450,24 +716,24 @@ filter_decompress(const struct context *context, struct decl *decl)
    SquashStatus r;
    struct dynbuf buf = {0};
    dynbuf_resize(&buf, dsize);
-   while ((r = squash_codec_decompress_with_options(codec, &buf.len, buf.data, decl->buf.len, decl->buf.data, opts)) == SQUASH_BUFFER_FULL)
+   while ((r = squash_codec_decompress_with_options(codec, &buf.len, buf.data, value->buf.len, value->buf.data, opts)) == SQUASH_BUFFER_FULL)
       dynbuf_resize(&buf, dsize *= 2);
 
    dynbuf_resize_if_needed(&buf, (buf.written = buf.len));
    squash_object_unref(opts);
 
    if (r != SQUASH_OK)
-      errx(EXIT_FAILURE, "squash_codec_decompress(%zu, %zu) = %d: %s", dsize, decl->buf.len, r, squash_status_to_string(r));
+      errx(EXIT_FAILURE, "squash_codec_decompress(%zu, %zu) = %d: %s", dsize, value->buf.len, r, squash_status_to_string(r));
 
-   dynbuf_release(&decl->buf);
-   decl->buf = buf;
-   decl->nmemb = buf.len / decl->size;
+   dynbuf_release(&value->buf);
+   value->buf = buf;
+   value->nmemb = buf.len / value->size;
 }
 
 static void
-filter_decode(const struct context *context, struct decl *decl)
+filter_decode(const struct context *context, struct value *value)
 {
-   assert(decl);
+   assert(value);
 
    const enum fspec_arg *arg;
    if (!(arg = fspec_op_get_arg(context->code.start, context->code.end, 2, 1<<FSPEC_ARG_STR)))
@@ -486,8 +752,8 @@ filter_decode(const struct context *context, struct decl *decl)
       err(EXIT_FAILURE, "iconv_open(%s, %s)", sys_encoding, encoding);
 
    struct dynbuf buf = {0};
-   const uint8_t *in = decl->buf.data;
-   size_t in_left = decl->buf.written;
+   const uint8_t *in = value->buf.data;
+   size_t in_left = value->buf.written;
    do {
       char enc[1024], *out = enc;
       size_t out_left = sizeof(enc);
@@ -501,143 +767,554 @@ filter_decode(const struct context *context, struct decl *decl)
 
    iconv_close(iv);
 
-   dynbuf_release(&decl->buf);
-   decl->buf = buf;
-   decl->nmemb = buf.len / decl->size;
+   dynbuf_release(&value->buf);
+   value->buf = buf;
+   value->nmemb = buf.len / value->size;
+}
+
+static void
+filter_matches(const struct context *context, struct value *value)
+{
+   assert(value);
+
+   const enum fspec_arg *arg;
+   if (!(arg = fspec_op_get_arg(context->code.start, context->code.end, 2, 1<<FSPEC_ARG_STR)))
+      errx(EXIT_FAILURE, "missing pattern");
+
+   struct fspec_mem pattern;
+   fspec_arg_get_mem(arg, context->code.data, &pattern);
+
+   // input is something else entirely, nothing after this would make sense
+   if (value->buf.written != pattern.len || memcmp(value->buf.data, pattern.data, pattern.len))
+      errx(EXIT_FAILURE, "%s: data does not match the spec", value->decl->name);
 }
 
 static void
-call(const struct context *context, FILE *f)
+filter_checksum(const struct context *context, struct value *value)
 {
-   assert(context && f);
+   assert(value);
+
+   const enum fspec_arg *arg;
+   if (!(arg = fspec_op_get_arg(context->code.start, context->code.end, 2, 1<<FSPEC_ARG_STR)))
+      errx(EXIT_FAILURE, "missing checksum");
+
+   const struct {
+      const char *name;
+      enum crc32_poly poly;
+   } map[] = {
+      { .name = "crc32", .poly = CRC32_IEEE },
+      { .name = "crc32c", .poly = CRC32_CASTAGNOLI },
+   };
+
+   const char *algo = fspec_arg_get_cstr(arg, context->code.data);
+
+   size_t i;
+   for (i = 0; i < ARRAY_SIZE(map) && strcmp(algo, map[i].name); ++i);
+
+   if (i == ARRAY_SIZE(map))
+      errx(EXIT_FAILURE, "unknown checksum '%s'", algo);
+
+   if (!(arg = fspec_arg_next(arg, context->code.end, 1, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR)))
+      errx(EXIT_FAILURE, "missing expected value for checksum '%s'", algo);
+
+   // the data was just read or filtered, so it's still in cache
+   const fspec_num expect = (fspec_arg_get_type(arg) == FSPEC_ARG_VAR ? var_get_num(context, arg) : fspec_arg_get_num(arg));
+   const uint32_t crc = crc32_update(map[i].poly, 0, value->buf.data, value->buf.written);
+
+   if (crc != expect)
+      warnx("%s: %s mismatch, expected 0x%08" PRIx64 ", got 0x%08" PRIx32, value->decl->name, algo, expect, crc);
+}
+
+// Structs are executed with explicit stack instead of recursion.
+// Each frame owns the values of its members from a pool that only grows with the nesting depth.
+struct frame {
+   const struct decl *decl;
+   const enum fspec_op *pc, *loop; // loop is the goto being repeated
+   const enum fspec_op *variant_end, *union_end; // chosen variant of an union, union_end is NULL at the end of the struct
+   size_t base, current; // values of the frame start at base, current is the member being read
+   fspec_num remaining;
+   bool until_eof;
+};
+
+struct stack {
+   struct frame *frame;
+   struct value *value;
+   size_t depth, frames, values;
+};
+
+#define NO_VALUE ((size_t)~0)
+
+static void
+context_enter(struct context *context, const struct stack *stack)
+{
+   assert(context && stack && stack->depth);
+   const struct frame *frame = &stack->frame[stack->depth - 1];
+   context->code.start = frame->decl->start;
+   context->code.end = frame->decl->end;
+   context->values = stack->value + frame->base;
+   context->first = (frame->decl - context->decl) + 1;
+}
+
+static void
+frame_push(struct context *context, struct stack *stack, const struct decl *decl)
+{
+   assert(context && stack && decl && decl->declaration == FSPEC_DECLARATION_STRUCT);
+
+   const struct frame *top = (stack->depth ? &stack->frame[stack->depth - 1] : NULL);
+   const size_t base = (top ? top->base + top->decl->members : 0);
+
+   if (stack->depth >= stack->frames) {
+      stack->frames = (stack->frames ? stack->frames * 2 : 16);
+      if (!(stack->frame = realloc(stack->frame, sizeof(*stack->frame) * stack->frames)))
+         err(EXIT_FAILURE, "realloc(%zu)", sizeof(*stack->frame) * stack->frames);
+   }
+
+   if (base + decl->members > stack->values) {
+      const size_t old = stack->values;
+      stack->values = (base + decl->members) * 2;
+      if (!(stack->value = realloc(stack->value, sizeof(*stack->value) * stack->values)))
+         err(EXIT_FAILURE, "realloc(%zu)", sizeof(*stack->value) * stack->values);
+
+      memset(stack->value + old, 0, sizeof(*stack->value) * (stack->values - old));
+   }
+
+   stack->frame[stack->depth++] = (struct frame){
+      .decl = decl,
+      .pc = decl->start,
+      .base = base,
+      .current = NO_VALUE,
+   };
+
+   context_enter(context, stack);
+}
+
+static void
+frame_pop(struct context *context, struct stack *stack)
+{
+   assert(context && stack && stack->depth);
+
+   if (--stack->depth)
+      context_enter(context, stack);
+}
+
+// Dimensions multiply like in the decoder library, [a][b] is a * b elements.
+// With [$] elements are read until the end of input, whatever the other dimensions are.
+static void
+get_count(const struct context *context, const enum fspec_arg *arg, fspec_num *out_nmemb, bool *out_until_eof)
+{
+   assert(context && arg && out_nmemb && out_until_eof);
+
+   *out_nmemb = 1;
+   *out_until_eof = false;
+   for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, context->code.end, 1, ~0));) {
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+         case FSPEC_ARG_VAR:
+            {
+               const fspec_num v = (*var != FSPEC_ARG_VAR ? fspec_arg_get_num(var) : var_get_num(context, var));
+               if (v && *out_nmemb > (fspec_num)~0 / v)
+                  errx(EXIT_FAILURE, "array size overflows");
+               *out_nmemb *= v;
+            }
+            break;
+
+         case FSPEC_ARG_EOF:
+            *out_until_eof = true;
+            break;
+
+         // XXX: How to handle STR with stdin?
+         // With fseek would be easy.
+         default:
+            break;
+      }
+   }
+}
+
+static bool
+loop_next(const struct context *context, struct frame *frame, FILE *f)
+{
+   assert(context && frame && frame->loop && f);
+
+   if (frame->until_eof)
+      return !feof(f);
+
+   if (!frame->remaining)
+      return false;
+
+   --frame->remaining;
+   return true;
+}
+
+// Checkpoints are taken between records of the root struct, where the root frame is the only frame.
+// They hold the input offset, the root frame and the root values later members refer to,
+// which is everything needed to continue with a single seek.
+struct checkpoint {
+   uint64_t bcode; // xxh64 of the bytecode, checkpoints are only valid for the spec and layout they were written with
+   uint64_t offset, records, remaining, window;
+   uint32_t pc, loop, variant_end, union_end; // offsets to the bytecode, CHECKPOINT_NULL for NULL
+   uint32_t values;
+   uint8_t bits;
+   bool until_eof;
+} __attribute__((packed));
+
+struct checkpoint_value {
+   uint64_t id, nmemb, len;
+   uint8_t size, bits, visual;
+} __attribute__((packed));
+
+#define CHECKPOINT_NULL ((uint32_t)~0)
+#define CHECKPOINT_VERSION 1 // seeds the bcode hash, so checkpoints of another layout are rejected too
+#define CHECKPOINT_INTERVAL 5 // seconds
+
+static uint32_t
+code_offset(const struct context *context, const void *ptr)
+{
+   assert(context);
+   return (ptr ? (uint32_t)((const char*)ptr - (const char*)context->code.data) : CHECKPOINT_NULL);
+}
+
+static const void*
+code_pointer(const struct context *context, const uint32_t off)
+{
+   assert(context);
+
+   if (off == CHECKPOINT_NULL)
+      return NULL;
+
+   if (off >= (size_t)((const char*)context->code.end - (const char*)context->code.data))
+      errx(EXIT_FAILURE, "%s: invalid checkpoint", context->checkpoint);
+
+   return (const char*)context->code.data + off;
+}
+
+static bool
+value_is_referenced(const struct context *context, const fspec_num id)
+{
+   assert(context);
 
-   struct decl *decl = NULL;
    for (const enum fspec_op *op = context->code.start; op; op = fspec_op_next(op, context->code.end, true)) {
-      if (decl && op == decl->end) {
-         decl_display(decl);
-         decl = NULL;
+      if (*op != FSPEC_OP_READ && *op != FSPEC_OP_GOTO && *op != FSPEC_OP_FILTER && *op != FSPEC_OP_SWITCH)
+         continue;
+
+      for (const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, ~0); arg; arg = fspec_arg_next(arg, context->code.end, 1, ~0)) {
+         if (*arg == FSPEC_ARG_VAR && fspec_arg_get_num(arg) == id)
+            return true;
+      }
+   }
+
+   return false;
+}
+
+static void
+checkpoint_save(const struct context *context, const struct frame *frame, const uint64_t records, FILE *f)
+{
+   assert(context && frame && f);
+
+   off_t offset;
+   if (context->block->offset < context->block->buf.written || (offset = ftello(f)) == -1)
+      return;
+
+   struct checkpoint cp = {
+      .bcode = xxh64(context->code.data, (char*)context->code.end - (char*)context->code.data, CHECKPOINT_VERSION),
+      .offset = offset,
+      .records = records,
+      .remaining = frame->remaining,
+      .window = context->block->bits.window,
+      .pc = code_offset(context, frame->pc),
+      .loop = code_offset(context, frame->loop),
+      .variant_end = code_offset(context, frame->variant_end),
+      .union_end = code_offset(context, frame->union_end),
+      .bits = context->block->bits.len,
+      .until_eof = frame->until_eof,
+   };
+
+   char tmp[PATH_MAX];
+   const int ret = snprintf(tmp, sizeof(tmp), "%s.%ld", context->checkpoint, (long)getpid());
+   if (ret < 0 || (size_t)ret >= sizeof(tmp))
+      errx(EXIT_FAILURE, "%s: path is too long", context->checkpoint);
+
+   FILE *out;
+   if (!(out = fopen(tmp, "wb")))
+      err(EXIT_FAILURE, "fopen(%s)", tmp);
+
+   // the output has to be at least as far as the checkpoint, so nothing is missing after resuming
+   fflush(stdout);
+
+   bool ok = (fwrite(&cp, 1, sizeof(cp), out) == sizeof(cp));
+   for (size_t i = 0; i < frame->decl->members; ++i) {
+      const struct value *value = &context->values[i];
+      const fspec_num id = context->first + i;
+
+      if (!value->decl || value->decl != &context->decl[id] || value->skip || !value_is_referenced(context, id))
+         continue;
+
+      const struct checkpoint_value v = {
+         .id = id,
+         .nmemb = value->nmemb,
+         .len = value->buf.written,
+         .size = value->size,
+         .bits = value->bits,
+         .visual = value->visual,
+      };
+
+      ok = ok && fwrite(&v, 1, sizeof(v), out) == sizeof(v) && fwrite(value->buf.data, 1, v.len, out) == v.len;
+      ++cp.values;
+   }
+
+   ok = ok && !fseek(out, 0, SEEK_SET) && fwrite(&cp, 1, sizeof(cp), out) == sizeof(cp);
+
+   if (fclose(out) || !ok || rename(tmp, context->checkpoint) == -1) {
+      unlink(tmp);
+      err(EXIT_FAILURE, "%s", context->checkpoint);
+   }
+}
+
+static uint64_t
+checkpoint_load(const struct context *context, struct frame *frame, FILE *f)
+{
+   assert(context && frame && f);
+
+   FILE *in;
+   if (!(in = fopen(context->checkpoint, "rb"))) {
+      if (errno != ENOENT)
+         err(EXIT_FAILURE, "fopen(%s)", context->checkpoint);
+
+      return 0;
+   }
+
+   struct checkpoint cp;
+   if (fread(&cp, 1, sizeof(cp), in) != sizeof(cp))
+      errx(EXIT_FAILURE, "%s: invalid checkpoint", context->checkpoint);
+
+   if (cp.bcode != xxh64(context->code.data, (char*)context->code.end - (char*)context->code.data, CHECKPOINT_VERSION))
+      errx(EXIT_FAILURE, "%s: checkpoint was written with another spec or version", context->checkpoint);
+
+   if (fseeko(f, cp.offset, SEEK_SET) == -1)
+      err(EXIT_FAILURE, "resuming needs seekable input");
+
+   frame->pc = code_pointer(context, cp.pc);
+   frame->loop = code_pointer(context, cp.loop);
+   frame->variant_end = code_pointer(context, cp.variant_end);
+   frame->union_end = code_pointer(context, cp.union_end);
+   frame->remaining = cp.remaining;
+   frame->until_eof = cp.until_eof;
+   context->block->bits.window = cp.window;
+   context->block->bits.len = cp.bits;
+
+   for (uint32_t i = 0; i < cp.values; ++i) {
+      struct checkpoint_value v;
+      if (fread(&v, 1, sizeof(v), in) != sizeof(v) || v.id < context->first || v.id - context->first >= frame->decl->members)
+         errx(EXIT_FAILURE, "%s: invalid checkpoint", context->checkpoint);
+
+      struct value *value = &context->values[v.id - context->first];
+      *value = (struct value){
+         .buf = value->buf,
+         .decl = &context->decl[v.id],
+         .nmemb = v.nmemb,
+         .size = v.size,
+         .bits = v.bits,
+         .visual = v.visual,
+      };
+
+      dynbuf_reset(&value->buf);
+      dynbuf_resize_if_needed(&value->buf, v.len);
+      if ((value->buf.written = fread(value->buf.data, 1, v.len, in)) != v.len)
+         errx(EXIT_FAILURE, "%s: invalid checkpoint", context->checkpoint);
+   }
+
+   fclose(in);
+   warnx("resuming from record %" PRIu64 " at offset %" PRIu64, cp.records, cp.offset);
+   return cp.records;
+}
+
+static bool
+checkpoint_due(struct timespec *last)
+{
+   assert(last);
+
+   struct timespec now;
+   clock_gettime(CLOCK_MONOTONIC, &now);
+
+   if (now.tv_sec - last->tv_sec < CHECKPOINT_INTERVAL)
+      return false;
+
+   *last = now;
+   return true;
+}
+
+static void
+call(struct context *context, const struct decl *root, FILE *f)
+{
+   assert(context && root && f);
+
+   struct stack stack = {0};
+   frame_push(context, &stack, root);
+
+   uint64_t records = 0;
+   struct timespec last;
+   clock_gettime(CLOCK_MONOTONIC, &last);
+
+   if (context->checkpoint && context->resume)
+      records = checkpoint_load(context, stack.frame, f);
+
+   while (stack.depth) {
+      struct frame *frame = &stack.frame[stack.depth - 1];
+
+      if (frame->loop) {
+         if (stack.depth == 1 && context->checkpoint && checkpoint_due(&last))
+            checkpoint_save(context, frame, records, f);
+
+         if (loop_next(context, frame, f)) {
+            const enum fspec_arg *arg = fspec_op_get_arg(frame->loop, context->code.end, 1, 1<<FSPEC_ARG_VAR);
+            records += (stack.depth == 1);
+            frame_push(context, &stack, &context->decl[fspec_arg_get_num(arg)]);
+         } else {
+            frame->loop = NULL;
+         }
+         continue;
+      }
+
+      const enum fspec_op *op = frame->pc;
+      struct value *value = (frame->current != NO_VALUE ? &context->values[frame->current] : NULL);
+
+      if (!op) {
+         if (value && context->code.end == value->decl->end)
+            value_display(&context->code, value);
+
+         frame_pop(context, &stack);
+         continue;
+      }
+
+      if (value && op == value->decl->end) {
+         value_display(&context->code, value);
+         frame->current = NO_VALUE;
+         value = NULL;
       }
 
+      // rest of the variants are not executed
+      if (op == frame->variant_end) {
+         frame->variant_end = NULL;
+
+         if (!(op = frame->union_end)) {
+            frame->pc = NULL;
+            continue;
+         }
+      }
+
+      frame->pc = fspec_op_next(op, context->code.end, true);
+
       switch (*op) {
          case FSPEC_OP_DECLARATION:
             {
                const enum fspec_arg *arg;
                arg = fspec_op_get_arg(op, context->code.end, 2, 1<<FSPEC_ARG_NUM);
-               decl = &context->decl[fspec_arg_get_num(arg)];
-               dynbuf_reset(&decl->buf);
+               const fspec_num id = fspec_arg_get_num(arg);
+
+               // the struct itself
+               if (id < context->first)
+                  break;
+
+               frame->current = id - context->first;
+               assert(frame->current < frame->decl->members);
+               value = &context->values[frame->current];
+               value->decl = &context->decl[id];
+               value->visual = FSPEC_VISUAL_DEC;
+               value->constants = NULL;
+               value->skip = false;
+               dynbuf_reset(&value->buf);
             }
             break;
 
+         case FSPEC_OP_SKIP:
+            assert(value);
+            value->skip = true;
+            break;
+
          case FSPEC_OP_READ:
             {
-               assert(decl);
+               assert(value);
                const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_NUM);
                static_assert(CHAR_BIT == 8, "doesn't work otherwere right now");
-               decl->size = fspec_arg_get_num(arg) / 8;
-               decl->nmemb = 0;
-
-               for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, context->code.end, 1, ~0));) {
-                  switch (*var) {
-                     case FSPEC_ARG_NUM:
-                     case FSPEC_ARG_VAR:
-                        {
-                           const fspec_num v = (*var == FSPEC_ARG_NUM ? fspec_arg_get_num(var) : var_get_num(context, var));
-                           if (v == 0) {
-                              goto noop;
-                           } else if (v > 1) {
-                              const size_t nmemb = (decl->nmemb ? decl->nmemb : 1) * v;
-                              dynbuf_grow_if_needed(&decl->buf, decl->size * nmemb);
-                              const size_t read = fread((char*)decl->buf.data + decl->buf.written, decl->size, nmemb, f);
-                              decl->buf.written += decl->size * read;
-                              decl->nmemb += read;
-                           }
-                        }
-                        break;
-
-                     case FSPEC_ARG_STR:
-                        break;
-
-                     case FSPEC_ARG_EOF:
-                        {
-                           const size_t nmemb = (decl->nmemb ? decl->nmemb : 1);
-                           size_t read = 0, r = nmemb;
-                           while (r == nmemb) {
-                              dynbuf_grow_if_needed(&decl->buf, decl->size * nmemb);
-                              read += (r = fread((char*)decl->buf.data + decl->buf.written, decl->size, nmemb, f));
-                              decl->buf.written += decl->size * r;
-                           };
-                           decl->nmemb += read;
-                        }
-                        break;
-
-                     default:
-                        break;
+               value->bits = fspec_arg_get_num(arg);
+               value->size = (value->bits + 7) / 8;
+               value->nmemb = 0;
+
+               fspec_num nmemb;
+               bool until_eof;
+               get_count(context, arg, &nmemb, &until_eof);
+
+               if (nmemb > SIZE_MAX / value->size)
+                  errx(EXIT_FAILURE, "%s: array size overflows", value->decl->name);
+
+               if (until_eof) {
+                  // read in steps of nmemb, how much there is to read doesn't depend on the step
+                  const size_t step = (nmemb ? nmemb : 1);
+                  size_t read = 0, r = step;
+
+                  // skipping everything at once ends at the same place as reading in steps
+                  if (value->skip && value_is_aligned(context, value)) {
+                     read = skip_elements(context, value->size, SIZE_MAX / value->size / step * step, f);
+                     r = 0;
                   }
-               }
-noop:
 
-               if (!fspec_arg_next(arg, context->code.end, 1, ~0)) {
-                  dynbuf_grow_if_needed(&decl->buf, decl->size * 1);
-                  const size_t read = fread((char*)decl->buf.data + decl->buf.written, decl->size, 1, f);
-                  decl->buf.written += decl->size * read;
-                  decl->nmemb = read;
+                  while (r == step)
+                     read += (r = value_read(context, value, step, f));
+
+                  value->nmemb = read;
+               } else if (nmemb) {
+                  value->nmemb = value_read(context, value, nmemb, f);
                }
 
-               assert(decl->nmemb != 0);
+               assert(value->nmemb != 0 || (!nmemb && !until_eof));
             }
             break;
 
          case FSPEC_OP_GOTO:
             {
-               decl = NULL;
-               const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_VAR);
-               const struct decl *d = &context->decl[fspec_arg_get_num(arg)];
-               struct context c = *context;
-               c.code.start = d->start;
-               c.code.end = d->end;
-
-               for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, context->code.end, 1, ~0));) {
-                  switch (*var) {
-                     case FSPEC_ARG_NUM:
-                     case FSPEC_ARG_VAR:
-                        {
-                           const fspec_num v = (*var == FSPEC_ARG_NUM ? fspec_arg_get_num(var) : var_get_num(context, var));
-                           for (fspec_num i = 0; i < v; ++i)
-                              call(&c, f);
-                        }
-                        break;
-
-                     // XXX: How to handle STR with stdin?
-                     // With fseek would be easy.
-                     case FSPEC_ARG_STR:
-                        break;
-
-                     case FSPEC_ARG_EOF:
-                        while (!feof(f))
-                           call(&c, f);
-                        break;
-
-                     default:
-                        break;
-                  }
-               }
+               // the struct member itself has no value to display
+               frame->current = NO_VALUE;
+               frame->loop = op;
+               get_count(context, fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_VAR), &frame->remaining, &frame->until_eof);
+            }
+            break;
 
-               if (!fspec_arg_next(arg, context->code.end, 1, ~0))
-                  call(&c, f);
+         case FSPEC_OP_SWITCH:
+            {
+               assert(value);
+               const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_VAR);
+               const fspec_num fallback = fspec_arg_get_num(fspec_arg_next(arg, context->code.end, 1, ~0));
+               const enum fspec_op *table = fspec_op_next(op, context->code.end, true);
+               const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(table, context->code.end, 1, 1<<FSPEC_ARG_NUM));
+               fspec_num c = fspec_op_table_lookup(table, context->code.end, var_get_num(context, arg));
+               c = (c < cases ? c : fallback);
+
+               // the union itself has no value to display, the variants are the declarations following it
+               const struct decl *decl = value->decl;
+               frame->current = NO_VALUE;
+               frame->union_end = ((void*)decl[cases].end < (void*)context->code.end ? decl[cases].end : NULL);
+               frame->variant_end = (c < cases ? decl[1 + c].end : NULL);
+               frame->pc = (c < cases ? decl[1 + c].start : frame->union_end);
             }
             break;
 
          case FSPEC_OP_FILTER:
             {
-               assert(decl);
+               assert(value);
+
+               // only pure filters are allowed on skipped members
+               if (value->skip)
+                  break;
+
                const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_STR);
 
                const struct {
                   const char *name;
-                  void (*fun)(const struct context*, struct decl*);
+                  void (*fun)(const struct context*, struct value*);
                } map[] = {
                   { .name = "encoding", .fun = filter_decode },
                   { .name = "compression", .fun = filter_decompress },
+                  { .name = "checksum", .fun = filter_checksum },
+                  { .name = "matches", .fun = filter_matches },
                };
 
                const char *filter = fspec_arg_get_cstr(arg, context->code.data);
@@ -645,7 +1322,7 @@ noop:
                   if (!strcmp(filter, map[i].name)) {
                      struct context c = *context;
                      c.code.start = op;
-                     map[i].fun(&c, decl);
+                     map[i].fun(&c, value);
                      break;
                   }
 
@@ -657,21 +1334,40 @@ noop:
 
          case FSPEC_OP_VISUAL:
             {
-               assert(decl);
+               assert(value);
                const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_NUM);
-               decl->visual = fspec_arg_get_num(arg);
+               value->visual = fspec_arg_get_num(arg);
+
+               if ((arg = fspec_arg_next(arg, context->code.end, 1, 1<<FSPEC_ARG_VAR)))
+                  value->constants = &context->decl[fspec_arg_get_num(arg)];
+            }
+            break;
+
+         case FSPEC_OP_BLOCK:
+            {
+               const enum fspec_arg *arg = fspec_op_get_arg(op, context->code.end, 1, 1<<FSPEC_ARG_NUM);
+               const fspec_num size = fspec_arg_get_num(arg);
+               struct block *block = context->block;
+               dynbuf_reset(&block->buf);
+               dynbuf_grow_if_needed(&block->buf, size);
+               block->buf.written = input_read(context, block->buf.data, 1, size, f);
+               block->offset = 0;
             }
             break;
 
          case FSPEC_OP_ARG:
          case FSPEC_OP_HEADER:
+         case FSPEC_OP_TABLE:
          case FSPEC_OP_LAST:
             break;
       }
    }
 
-   if (decl && context->code.end == decl->end)
-      decl_display(decl);
+   for (size_t i = 0; i < stack.values; ++i)
+      dynbuf_release(&stack.value[i].buf);
+
+   free(stack.value);
+   free(stack.frame);
 }
 
 static void
@@ -679,6 +1375,7 @@ setup(const struct context *context)
 {
    assert(context);
 
+   struct decl *parent = NULL;
    for (const enum fspec_op *op = context->code.start; op; op = fspec_op_next(op, context->code.end, true)) {
       switch (*op) {
          case FSPEC_OP_DECLARATION:
@@ -692,28 +1389,71 @@ setup(const struct context *context)
                struct decl *decl = &context->decl[id];
                decl->declaration = fspec_arg_get_num(arg[0]);
                decl->name = fspec_arg_get_cstr(arg[3], context->code.data);
-               decl->visual = FSPEC_VISUAL_DEC;
                decl->start = op;
                decl->end = (char*)op + fspec_arg_get_num(arg[2]);
-               assert(!decl->buf.data);
+
+               // members follow their struct, so a member's value is found by its distance from the struct
+               if (decl->declaration != FSPEC_DECLARATION_MEMBER) {
+                  parent = decl;
+               } else {
+                  assert(parent && id == (fspec_num)(parent - context->decl) + parent->members + 1);
+                  ++parent->members;
+               }
             }
             break;
 
+         case FSPEC_OP_TABLE:
+            if (parent && parent->declaration == FSPEC_DECLARATION_ENUM)
+               parent->table = op;
+            break;
+
          default:
             break;
       }
    }
 }
 
+static int
+follow_open(FILE *f)
+{
+   assert(f);
+
+   // pipes already block until the writer is done, only files need to be watched
+   struct stat st;
+   if (fstat(fileno(f), &st) == -1 || !S_ISREG(st.st_mode))
+      return -1;
+
+   int fd;
+   if ((fd = inotify_init1(IN_CLOEXEC)) == -1)
+      err(EXIT_FAILURE, "inotify_init1");
+
+   char path[32];
+   snprintf(path, sizeof(path), "/proc/self/fd/%d", fileno(f));
+   if (inotify_add_watch(fd, path, IN_MODIFY) == -1)
+      err(EXIT_FAILURE, "inotify_add_watch(%s)", path);
+
+   return fd;
+}
+
+struct options {
+   const char *checkpoint;
+   bool follow, resume;
+};
+
 static void
-execute(const struct fspec_mem *mem)
+execute(const struct fspec_mem *mem, const struct options *options)
 {
-   assert(mem);
+   assert(mem && options);
 
+   struct block block = {0};
    struct context context = {
       .code.start = mem->data,
       .code.end = (void*)((char*)mem->data + mem->len),
-      .code.data = mem->data
+      .code.data = mem->data,
+      .block = &block,
+      .follow = (options->follow ? follow_open(stdin) : -1),
+      .checkpoint = options->checkpoint,
+      .resume = options->resume,
    };
 
    printf("output: %zu bytes\n", mem->len);
@@ -728,92 +1468,174 @@ execute(const struct fspec_mem *mem)
    setup(&context);
 
    puts("\nexecution:");
-   context.code.start = get_last_struct(&context.code);
-   assert(context.code.start);
-   call(&context, stdin);
+   const enum fspec_op *root = get_last_struct(&context.code);
+   assert(root);
+   call(&context, &context.decl[fspec_arg_get_num(fspec_op_get_arg(root, context.code.end, 2, 1<<FSPEC_ARG_NUM))], stdin);
 
-   for (fspec_num i = 0; i < context.decl_count; ++i)
-      dynbuf_release(&context.decl[i].buf);
+   dynbuf_release(&block.buf);
+
+   // the input was decoded completely, there's nothing to resume
+   if (context.checkpoint)
+      unlink(context.checkpoint);
+
+   if (context.follow != -1)
+      close(context.follow);
 
    free(context.decl);
 }
 
-static FILE*
-fopen_or_die(const char *path, const char *mode)
+static bool
+get_signature(const struct fspec_mem *bcode, struct fspec_mem *out_sig)
 {
-   assert(path && mode);
+   assert(bcode && out_sig);
 
-   FILE *f;
-   if (!(f = fopen(path, mode)))
-      err(EXIT_FAILURE, "fopen(%s, %s)", path, mode);
+   const struct code code = { .start = bcode->data, .end = (void*)((char*)bcode->data + bcode->len), .data = bcode->data };
+   const enum fspec_op *decl;
+   if (!(decl = get_last_struct(&code)))
+      return false;
 
-   return f;
-}
+   // only the first member of the root struct is at known offset, and only if its bytes are matched as read
+   const void *end = (char*)decl + fspec_arg_get_num(fspec_op_get_arg(decl, code.end, 3, 1<<FSPEC_ARG_OFF));
+   const enum fspec_op *member = fspec_op_next(decl, end, true);
+   if (!member || *member != FSPEC_OP_DECLARATION)
+      return false;
+
+   end = (char*)member + fspec_arg_get_num(fspec_op_get_arg(member, end, 3, 1<<FSPEC_ARG_OFF));
+   for (const enum fspec_op *op = fspec_op_next(member, end, true); op; op = fspec_op_next(op, end, true)) {
+      if (*op == FSPEC_OP_READ && fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) == 8)
+         continue;
+
+      if (*op != FSPEC_OP_FILTER || strcmp(fspec_arg_get_cstr(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_STR), code.data), "matches"))
+         return false;
 
-#define container_of(ptr, type, member) ((type *)((char *)(1 ? (ptr) : &((type *)0)->member) - offsetof(type, member)))
+      const enum fspec_arg *arg;
+      if (!(arg = fspec_op_get_arg(op, end, 2, 1<<FSPEC_ARG_STR)))
+         return false;
+
+      fspec_arg_get_mem(arg, code.data, out_sig);
+      return (out_sig->len > 0);
+   }
+
+   return false;
+}
 
-struct lexer {
-   struct fspec_lexer lexer;
-   FILE *file;
+struct spec {
+   char path[PATH_MAX];
+   struct fspec_mem sig; // empty if the spec has no signature
 };
 
-static size_t
-fspec_lexer_read(struct fspec_lexer *lexer, void *ptr, const size_t size, const size_t nmemb)
+static int
+spec_cmp(const void *a, const void *b)
 {
-   assert(lexer && ptr);
-   struct lexer *l = container_of(lexer, struct lexer, lexer);
-   return fread(ptr, size, nmemb, l->file);
-}
+   // The automaton prefers lower ids, so longer and more specific signatures go first.
+   const struct spec *x = a, *y = b;
+   if (x->sig.len != y->sig.len)
+      return (x->sig.len < y->sig.len ? 1 : -1);
 
-static size_t
-fspec_validator_read(struct fspec_validator *validator, void *ptr, const size_t size, const size_t nmemb)
-{
-   assert(validator && ptr);
-   assert(ptr == validator->mem.input.data);
-   const size_t read = validator->mem.input.len / size;
-   assert((validator->mem.input.len && read == nmemb) || (!validator->mem.input.len && !read));
-   validator->mem.input.len -= read * size;
-   assert(validator->mem.input.len == 0);
-   return read;
+   return strcmp(x->path, y->path);
 }
 
-int
-main(int argc, const char *argv[])
+// Leading matches() of every spec in the directory are compiled into one automaton,
+// so each input is classified by reading at most the longest signature.
+static void
+detect(const char *dir, const char *inputs[], const size_t count)
 {
-   if (argc < 2)
-      errx(EXIT_FAILURE, "usage: %s file.spec < data", argv[0]);
+   assert(dir && (inputs || !count));
+
+   struct dirent **entries;
+   int n;
+   if ((n = scandir(dir, &entries, is_spec, alphasort)) == -1)
+      err(EXIT_FAILURE, "scandir(%s)", dir);
+
+   struct units units = {0};
+   struct sigtrie trie = {0};
+   struct spec *specs;
+   if (!(specs = calloc((n ? n : 1), sizeof(*specs))))
+      err(EXIT_FAILURE, "calloc(%d, %zu)", n, sizeof(*specs));
+
+   for (int i = 0; i < n; ++i) {
+      const int ret = snprintf(specs[i].path, sizeof(specs[i].path), "%s/%s", dir, entries[i]->d_name);
+      if (ret < 0 || (size_t)ret >= sizeof(specs[i].path))
+         errx(EXIT_FAILURE, "%s/%s: path is too long", dir, entries[i]->d_name);
+
+      // specs that don't compile are never matched, units_load already said why
+      size_t unit;
+      if (!units_load(&units, specs[i].path, &unit)) {
+         warnx("%s: skipped", specs[i].path);
+         specs[i].sig = (struct fspec_mem){0};
+      } else if (!get_signature(&units.unit[unit].bcode, &specs[i].sig)) {
+         specs[i].sig = (struct fspec_mem){0};
+      }
 
-   char output[4096];
-   struct fspec_mem bcode = {0};
+      free(entries[i]);
+   }
 
-   {
-      char input[4096];
-      struct lexer l = {
-         .lexer = {
-            .ops.read = fspec_lexer_read,
-            .mem.input = { .data = input, sizeof(input) },
-            .mem.output = { .data = output, sizeof(output) },
-         },
-         .file = fopen_or_die(argv[1], "rb"),
-      };
+   free(entries);
+   qsort(specs, n, sizeof(*specs), spec_cmp);
+
+   for (int i = 0; i < n && specs[i].sig.len; ++i)
+      sigtrie_add(&trie, specs[i].sig.data, specs[i].sig.len, i);
+
+   uint8_t *buf;
+   if (!(buf = malloc(trie.longest ? trie.longest : 1)))
+      err(EXIT_FAILURE, "malloc(%zu)", trie.longest);
+
+   for (size_t i = 0; i < count; ++i) {
+      int fd;
+      if ((fd = open(inputs[i], O_RDONLY | O_CLOEXEC)) == -1) {
+         warn("open(%s)", inputs[i]);
+         continue;
+      }
 
-      if (!fspec_lexer_parse(&l.lexer, argv[1]))
-         exit(EXIT_FAILURE);
+      ssize_t r;
+      do {
+         r = pread(fd, buf, trie.longest, 0);
+      } while (r == -1 && errno == EINTR);
 
-      fclose(l.file);
-      bcode = l.lexer.mem.output;
+      close(fd);
+
+      if (r == -1) {
+         warn("pread(%s)", inputs[i]);
+         continue;
+      }
+
+      const uint16_t match = sigtrie_match(&trie, buf, r);
+      printf("%s: %s\n", inputs[i], (match != SIGTRIE_NONE ? specs[match].path : "unknown"));
    }
 
-   {
-      struct fspec_validator validator = {
-         .ops.read = fspec_validator_read,
-         .mem.input = bcode,
-      };
+   units_release(&units);
+   sigtrie_release(&trie);
+   free(specs);
+   free(buf);
+}
 
-      if (!fspec_validator_parse(&validator, argv[1]))
-         exit(EXIT_FAILURE);
+int
+main(int argc, const char *argv[])
+{
+   if (argc > 2 && !strcmp(argv[1], "-d")) {
+      detect(argv[2], argv + 3, argc - 3);
+      return EXIT_SUCCESS;
    }
 
-   execute(&bcode);
+   int i;
+   struct options options = {0};
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "--follow")) {
+         options.follow = true;
+      } else if (!strcmp(argv[i], "--checkpoint") && i + 1 < argc) {
+         options.checkpoint = argv[++i];
+      } else if (!strcmp(argv[i], "--resume")) {
+         options.resume = true;
+      } else {
+         break;
+      }
+   }
+
+   if (i >= argc || (options.resume && !options.checkpoint))
+      errx(EXIT_FAILURE, "usage: %s [--follow] [--checkpoint file [--resume]] file.spec < data | -d specdir file ...", argv[0]);
+
+   struct fspec_mem bcode = compile(argv[i]);
+   execute(&bcode, &options);
+   free(bcode.data);
    return EXIT_SUCCESS;
 }
@@ -19,6 +19,15 @@ arg_data_len(const enum fspec_arg *arg)
       case FSPEC_ARG_NUM:
          return sizeof(fspec_num);
 
+      case FSPEC_ARG_NUM8:
+         return sizeof(uint8_t);
+
+      case FSPEC_ARG_NUM16:
+         return sizeof(uint16_t);
+
+      case FSPEC_ARG_NUM32:
+         return sizeof(uint32_t);
+
       case FSPEC_ARG_VAR:
          return sizeof(fspec_var);
 
@@ -79,6 +88,9 @@ fspec_arg_get_mem(const enum fspec_arg *arg, const void *data, struct fspec_mem
 
       case FSPEC_ARG_VAR:
       case FSPEC_ARG_NUM:
+      case FSPEC_ARG_NUM8:
+      case FSPEC_ARG_NUM16:
+      case FSPEC_ARG_NUM32:
       case FSPEC_ARG_OFF:
          out_mem->data = (char*)arg + sizeof(*arg);
          out_mem->len = arg_data_len(arg);
@@ -104,6 +116,30 @@ fspec_arg_get_num(const enum fspec_arg *arg)
          memcpy(&v, arg + sizeof(*arg), sizeof(v));
          break;
 
+      case FSPEC_ARG_NUM8:
+         {
+            uint8_t u8;
+            memcpy(&u8, arg + sizeof(*arg), sizeof(u8));
+            v = u8;
+         }
+         break;
+
+      case FSPEC_ARG_NUM16:
+         {
+            uint16_t u16;
+            memcpy(&u16, arg + sizeof(*arg), sizeof(u16));
+            v = u16;
+         }
+         break;
+
+      case FSPEC_ARG_NUM32:
+         {
+            uint32_t u32;
+            memcpy(&u32, arg + sizeof(*arg), sizeof(u32));
+            v = u32;
+         }
+         break;
+
       case FSPEC_ARG_VAR:
          {
             fspec_var var;
@@ -130,6 +166,25 @@ fspec_arg_get_num(const enum fspec_arg *arg)
    return v;
 }
 
+enum fspec_arg
+fspec_arg_num_type(const fspec_num v)
+{
+   if (v <= UINT8_MAX)
+      return FSPEC_ARG_NUM8;
+   else if (v <= UINT16_MAX)
+      return FSPEC_ARG_NUM16;
+   else if (v <= UINT32_MAX)
+      return FSPEC_ARG_NUM32;
+   return FSPEC_ARG_NUM;
+}
+
+enum fspec_arg
+fspec_arg_get_type(const enum fspec_arg *arg)
+{
+   assert(arg && *arg < FSPEC_ARG_LAST);
+   return ((1<<*arg) & FSPEC_ARG_NUM_COMPACT ? FSPEC_ARG_NUM : *arg);
+}
+
 const char*
 fspec_arg_get_cstr(const enum fspec_arg *arg, const void *data)
 {
@@ -153,7 +208,8 @@ fspec_op_get_arg(const enum fspec_op *start, const void *end, const uint8_t nth,
       ++i;
    }
 
-   if (arg && !(expect & (1<<*arg)))
+   const uint32_t accept = (expect & (1<<FSPEC_ARG_NUM) ? expect | FSPEC_ARG_NUM_COMPACT : expect);
+   if (arg && !(accept & (1<<*arg)))
       errx(EXIT_FAILURE, "got unexpected argument of type %u", *arg);
 
    return arg;
@@ -187,3 +243,31 @@ fspec_op_next(const enum fspec_op *start, const void *end, const bool skip_args)
 
    return NULL;
 }
+
+fspec_num
+fspec_op_table_lookup(const enum fspec_op *table, const void *end, const fspec_num v)
+{
+   assert(table && *table == FSPEC_OP_TABLE);
+
+   const enum fspec_arg *arg[3];
+   arg[0] = fspec_op_get_arg(table, end, 1, 1<<FSPEC_ARG_NUM);
+   arg[1] = fspec_arg_next(arg[0], end, 1, 1<<FSPEC_ARG_NUM);
+   arg[2] = fspec_arg_next(arg[1], end, 1, 1<<FSPEC_ARG_DAT);
+   const fspec_num cases = fspec_arg_get_num(arg[0]);
+
+   struct fspec_mem table_mem;
+   fspec_arg_get_mem(arg[2], NULL, &table_mem);
+   const size_t keys = cases * sizeof(fspec_num);
+   assert(table_mem.len > keys);
+
+   // numbers below base wrap around, the key check rejects them
+   const uint8_t *slot = (const uint8_t*)table_mem.data + keys;
+   const fspec_num c = slot[(v - fspec_arg_get_num(arg[1])) % (table_mem.len - keys)];
+
+   if (c >= cases)
+      return cases;
+
+   fspec_num key;
+   memcpy(&key, (const char*)table_mem.data + c * sizeof(key), sizeof(key));
+   return (key == v ? c : cases);
+}
@@ -10,6 +10,9 @@
 #define PRI_FSPEC_NUM PRIu64
 typedef uint64_t fspec_num;
 
+/** bytecode version, 1 adds the compact number arguments, 2 adds unions and enums, 3 adds bit fields, 4 adds block and skip hints */
+#define FSPEC_BCODE_VERSION 4
+
 enum fspec_arg {
    FSPEC_ARG_DAT,
    FSPEC_ARG_OFF,
@@ -17,9 +20,23 @@ enum fspec_arg {
    FSPEC_ARG_VAR,
    FSPEC_ARG_STR,
    FSPEC_ARG_EOF,
+   FSPEC_ARG_NUM8,
+   FSPEC_ARG_NUM16,
+   FSPEC_ARG_NUM32,
    FSPEC_ARG_LAST,
 } __attribute__((packed));
 
+/** compact numbers, accepted everywhere FSPEC_ARG_NUM is expected */
+#define FSPEC_ARG_NUM_COMPACT (1<<FSPEC_ARG_NUM8 | 1<<FSPEC_ARG_NUM16 | 1<<FSPEC_ARG_NUM32)
+
+/** smallest number argument type that can represent v */
+enum fspec_arg
+fspec_arg_num_type(const fspec_num v);
+
+/** type of argument, compact numbers are FSPEC_ARG_NUM */
+enum fspec_arg
+fspec_arg_get_type(const enum fspec_arg *arg);
+
 void
 fspec_arg_get_mem(const enum fspec_arg *arg, const void *data, struct fspec_mem *out_mem);
 
@@ -32,17 +49,29 @@ fspec_arg_get_cstr(const enum fspec_arg *arg, const void *data);
 const enum fspec_arg*
 fspec_arg_next(const enum fspec_arg *arg, const void *end, const uint8_t nth, const uint32_t expect);
 
+/**
+ * FSPEC_DECLARATION_EXTERN is a struct declared in another unit,
+ * it has additional STR argument for the module it was imported from.
+ * Units containing externs must be linked before they are executed.
+ *
+ * FSPEC_DECLARATION_ENUM contains FSPEC_OP_READ for the size of its values,
+ * and FSPEC_OP_TABLE with a name for each of its constants.
+ */
 enum fspec_declaration {
    FSPEC_DECLARATION_STRUCT,
    FSPEC_DECLARATION_MEMBER,
+   FSPEC_DECLARATION_EXTERN,
+   FSPEC_DECLARATION_ENUM,
    FSPEC_DECLARATION_LAST,
 } __attribute__((packed));
 
+/** FSPEC_VISUAL_ENUM has additional VAR argument for the enum declaration */
 enum fspec_visual {
    FSPEC_VISUAL_NUL,
    FSPEC_VISUAL_DEC,
    FSPEC_VISUAL_HEX,
    FSPEC_VISUAL_STR,
+   FSPEC_VISUAL_ENUM,
    FSPEC_VISUAL_LAST,
 } __attribute__((packed));
 
@@ -50,15 +79,34 @@ enum fspec_op {
    FSPEC_OP_ARG,
    FSPEC_OP_HEADER,
    FSPEC_OP_DECLARATION,
-   FSPEC_OP_READ,
+   FSPEC_OP_READ, // width in bits, widths that are not multiple of 8 are packed from the least significant bit
    FSPEC_OP_GOTO,
    FSPEC_OP_FILTER,
    FSPEC_OP_VISUAL,
+   FSPEC_OP_BLOCK,
+   FSPEC_OP_SKIP, // value of the following read is never used
+   FSPEC_OP_SWITCH,
+   FSPEC_OP_TABLE,
    FSPEC_OP_LAST,
 } __attribute__((packed));
 
+/**
+ * FSPEC_OP_SWITCH VAR selector, NUM fallback, followed by FSPEC_OP_TABLE,
+ * makes the member an union of the members following it, one for each case of the table.
+ * Only the member of the case matching the value of selector is read,
+ * or the fallback member if no case matches. Fallback of cases means nothing is read.
+ *
+ * FSPEC_OP_TABLE NUM cases, NUM base, DAT table, (STR name...)
+ * maps numbers to cases in constant time, the table is fspec_num key[cases] followed by uint8_t slot[n].
+ * Case of number v is slot[(v - base) % n], if key of the case is v.
+ */
+
 const enum fspec_op*
 fspec_op_next(const enum fspec_op *op, const void *end, const bool skip_args);
 
 const enum fspec_arg*
 fspec_op_get_arg(const enum fspec_op *op, const void *end, const uint8_t nth, const uint32_t expect);
+
+/** returns case of v in FSPEC_OP_TABLE, or the number of cases if there is none */
+fspec_num
+fspec_op_table_lookup(const enum fspec_op *table, const void *end, const fspec_num v);
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+
+/**
+ * FSPEC_OP_READ of width that is not multiple of 8 is a bit field.
+ * Bit fields are packed from the least significant bit, the window keeps the bits
+ * of the bytes that are not consumed yet when reading, or not complete yet when writing.
+ * Values of bit fields are stored as little endian, same as the byte aligned values.
+ */
+struct fspec_bits {
+   uint64_t window;
+   uint8_t len; // bits in window
+};
+
+/** appends byte to the window when reading, the window must have room for it */
+static inline void
+fspec_bits_push_byte(struct fspec_bits *bits, const uint8_t byte)
+{
+   assert(bits && bits->len <= 56);
+   bits->window |= (uint64_t)byte << bits->len;
+   bits->len += 8;
+}
+
+/** takes up to n of the oldest bits from the window, returns the number of bits taken */
+static inline uint8_t
+fspec_bits_take(struct fspec_bits *bits, const uint8_t n, uint64_t *out_v)
+{
+   assert(bits && n <= 64 && out_v);
+   const uint8_t take = (bits->len < n ? bits->len : n);
+   *out_v = (take < 64 ? bits->window & (((uint64_t)1 << take) - 1) : bits->window);
+   bits->window = (take < 64 ? bits->window >> take : 0);
+   bits->len -= take;
+   return take;
+}
+
+/** appends n least significant bits of v to the window when writing, complete bytes are popped after */
+static inline void
+fspec_bits_put(struct fspec_bits *bits, const uint64_t v, const uint8_t n)
+{
+   assert(bits && bits->len < 8 && n <= 56);
+   bits->window |= (v & (((uint64_t)1 << n) - 1)) << bits->len;
+   bits->len += n;
+}
+
+/** removes the oldest byte from the window, returns false if there isn't a complete one */
+static inline bool
+fspec_bits_pop_byte(struct fspec_bits *bits, uint8_t *out_byte)
+{
+   assert(bits && out_byte);
+
+   if (bits->len < 8)
+      return false;
+
+   *out_byte = bits->window & 0xff;
+   bits->window >>= 8;
+   bits->len -= 8;
+   return true;
+}
+
+/** stores value of a bit field as element of size bytes */
+static inline void
+fspec_bits_store(uint8_t *dst, const uint64_t v, const size_t size)
+{
+   assert((dst || !size) && size <= sizeof(v));
+   for (size_t i = 0; i < size; ++i)
+      dst[i] = v >> (8 * i);
+}
@@ -0,0 +1,606 @@
+#include <fspec/cursor.h>
+#include "bcode-internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#define VARIABLE SIZE_MAX
+
+struct info {
+   const enum fspec_op *op, *end, *code;
+   const char *name;
+   size_t fixed; // size in bytes, VARIABLE if it depends on the input
+   size_t offset; // offset inside the struct, VARIABLE if it depends on the input
+   fspec_var owner, members;
+   fspec_var in_union; // union the member is a variant of, 0 if none
+   fspec_num variant; // index of the variant in its union
+   enum fspec_visual visual;
+   enum fspec_declaration declaration;
+};
+
+struct extent {
+   size_t offset, size, elem, nmemb;
+   fspec_num variant; // chosen variant, unions only
+};
+
+struct fspec_cursor_state {
+   const void *data, *end;
+   const uint8_t *input;
+   size_t input_len;
+   struct info *info;
+   const struct info *record;
+   size_t ninfo, start;
+
+   // start offsets of records found so far, only used if records are not fixed size
+   size_t *records, nrecords, records_len;
+
+   size_t current, resolved, at; // current record, resolved members and where it starts
+   bool valid;
+
+   // extents of the current record, followed by extents of nested structs being measured
+   struct extent *extents;
+   size_t top, nextents;
+
+   char error[256];
+};
+
+__attribute__((format(printf, 2, 3)))
+static bool
+set_error(struct fspec_cursor_state *st, const char *fmt, ...)
+{
+   assert(st && fmt);
+   va_list args;
+   va_start(args, fmt);
+   vsnprintf(st->error, sizeof(st->error), fmt, args);
+   va_end(args);
+   return false;
+}
+
+static size_t
+mul_or_variable(const size_t a, const size_t b)
+{
+   return (a == VARIABLE || b == VARIABLE || (b && a > (VARIABLE - 1) / b) ? VARIABLE : a * b);
+}
+
+static size_t
+add_or_variable(const size_t a, const size_t b)
+{
+   return (a == VARIABLE || b == VARIABLE || a > (VARIABLE - 1) - b ? VARIABLE : a + b);
+}
+
+static void
+extents_reserve(struct fspec_cursor_state *st, const size_t count)
+{
+   assert(st);
+
+   if (st->nextents >= count)
+      return;
+
+   st->nextents = (count > st->nextents * 2 ? count : st->nextents * 2);
+   if (!(st->extents = realloc(st->extents, st->nextents * sizeof(*st->extents))))
+      err(EXIT_FAILURE, "realloc(%zu)", st->nextents * sizeof(*st->extents));
+}
+
+static fspec_num
+var_get_num(const struct fspec_cursor_state *st, const struct info *owner, const size_t base, const enum fspec_arg *var)
+{
+   assert(st && owner && var);
+   const fspec_num id = fspec_arg_get_num(var);
+   const fspec_var owner_id = owner - st->info;
+   assert(id > owner_id && id <= (fspec_num)owner_id + owner->members);
+
+   const struct extent *e = &st->extents[base + (id - owner_id - 1)];
+   const struct fspec_value value = { .data = st->input + e->offset, .size = e->elem, .nmemb = e->nmemb };
+   return (value.nmemb ? fspec_value_get_num(&value, 0) : 0);
+}
+
+struct count {
+   struct fspec_mem terminator;
+   size_t nmemb;
+   bool until_eof, until_str;
+};
+
+static bool
+get_count(struct fspec_cursor_state *st, const struct info *owner, const size_t base, const enum fspec_arg *arg, const void *end, struct count *out_count)
+{
+   assert(st && arg && out_count);
+   *out_count = (struct count){ .nmemb = 1 };
+
+   for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, end, 1, ~0));) {
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+         case FSPEC_ARG_VAR:
+            {
+               // owner is NULL while precomputing fixed sizes, which have no variables
+               assert(*var != FSPEC_ARG_VAR || owner);
+               const fspec_num v = (*var != FSPEC_ARG_VAR ? fspec_arg_get_num(var) : var_get_num(st, owner, base, var));
+               if ((out_count->nmemb = mul_or_variable(out_count->nmemb, (v > VARIABLE ? VARIABLE : v))) == VARIABLE)
+                  return set_error(st, "array size overflows");
+            }
+            break;
+
+         case FSPEC_ARG_STR:
+            fspec_arg_get_mem(var, st->data, &out_count->terminator);
+            out_count->until_str = true;
+            break;
+
+         case FSPEC_ARG_EOF:
+            out_count->until_eof = true;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return true;
+}
+
+static bool
+has_variable_count(const enum fspec_arg *arg, const void *end)
+{
+   for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, end, 1, ~0));) {
+      if (fspec_arg_get_type(var) != FSPEC_ARG_NUM)
+         return true;
+   }
+   return false;
+}
+
+static bool struct_size(struct fspec_cursor_state *st, const struct info *info, const size_t offset, size_t *out_size);
+
+static bool
+member_extent(struct fspec_cursor_state *st, const struct info *owner, const size_t base, const struct info *member, const size_t offset, struct extent *out_extent)
+{
+   assert(st && member && out_extent);
+   *out_extent = (struct extent){ .offset = offset };
+
+   // variants that were not chosen take no space
+   if (member->in_union && st->extents[base + (member->in_union - (owner - st->info) - 1)].variant != member->variant)
+      return true;
+
+   if (!member->code)
+      return true;
+
+   if (*member->code == FSPEC_OP_SWITCH) {
+      const enum fspec_arg *var = fspec_op_get_arg(member->code, member->end, 1, 1<<FSPEC_ARG_VAR);
+      const fspec_num fallback = fspec_arg_get_num(fspec_arg_next(var, member->end, 1, ~0));
+      const enum fspec_op *table = fspec_op_next(member->code, member->end, true);
+      const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(table, member->end, 1, 1<<FSPEC_ARG_NUM));
+      const fspec_num c = fspec_op_table_lookup(table, member->end, var_get_num(st, owner, base, var));
+      out_extent->variant = (c < cases ? c : fallback);
+      return true;
+   }
+
+   const size_t left = st->input_len - offset;
+   const enum fspec_arg *arg = fspec_op_get_arg(member->code, member->end, 1, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR);
+
+   struct count count;
+   if (!get_count(st, owner, base, arg, member->end, &count))
+      return false;
+
+   if (*member->code == FSPEC_OP_READ) {
+      if (fspec_arg_get_num(arg) % 8)
+         return set_error(st, "'%s': bit fields are not supported", member->name);
+
+      out_extent->elem = fspec_arg_get_num(arg) / 8;
+
+      if (count.until_eof) {
+         out_extent->nmemb = left / out_extent->elem;
+      } else if (count.until_str) {
+         const struct fspec_mem *t = &count.terminator;
+         const uint8_t *p = st->input + offset;
+         size_t n = 0;
+         for (size_t w = out_extent->elem; w <= left; w += out_extent->elem) {
+            n = w / out_extent->elem;
+            if (w >= t->len && !memcmp(p + w - t->len, t->data, t->len))
+               break;
+         }
+         out_extent->nmemb = n;
+      } else {
+         out_extent->nmemb = count.nmemb;
+      }
+
+      if ((out_extent->size = mul_or_variable(out_extent->elem, out_extent->nmemb)) > left)
+         return set_error(st, "'%s' at offset %zu exceeds the input", member->name, offset);
+
+      return true;
+   }
+
+   assert(*member->code == FSPEC_OP_GOTO);
+   const struct info *target = &st->info[fspec_arg_get_num(arg)];
+
+   if (count.until_str)
+      return set_error(st, "'%s': struct arrays terminated by a string are not supported", member->name);
+
+   if (target->fixed != VARIABLE && target->fixed) {
+      out_extent->nmemb = (count.until_eof ? left / target->fixed : count.nmemb);
+      if ((out_extent->size = mul_or_variable(target->fixed, out_extent->nmemb)) > left)
+         return set_error(st, "'%s' at offset %zu exceeds the input", member->name, offset);
+   } else {
+      size_t at = offset;
+      for (size_t i = 0; (count.until_eof ? at < st->input_len : i < count.nmemb); ++i) {
+         size_t size;
+         if (!struct_size(st, target, at, &size))
+            return false;
+
+         if (!size && count.until_eof)
+            break;
+
+         at += size;
+         out_extent->nmemb = i + 1;
+      }
+      out_extent->size = at - offset;
+   }
+
+   out_extent->elem = out_extent->size;
+   out_extent->nmemb = 1;
+   return true;
+}
+
+static bool
+struct_size(struct fspec_cursor_state *st, const struct info *info, const size_t offset, size_t *out_size)
+{
+   assert(st && info && out_size);
+
+   if (info->fixed != VARIABLE) {
+      if (info->fixed > st->input_len - offset)
+         return set_error(st, "'%s' at offset %zu exceeds the input", info->name, offset);
+
+      *out_size = info->fixed;
+      return true;
+   }
+
+   const size_t base = st->top;
+   extents_reserve(st, base + info->members);
+   st->top += info->members;
+
+   size_t at = offset;
+   for (fspec_var i = 0; i < info->members; ++i) {
+      struct extent e;
+      if (!member_extent(st, info, base, info + 1 + i, at, &e)) {
+         st->top = base;
+         return false;
+      }
+
+      st->extents[base + i] = e;
+      at = e.offset + e.size;
+   }
+
+   st->top = base;
+   *out_size = at - offset;
+   return true;
+}
+
+static void
+setup(struct fspec_cursor_state *st)
+{
+   assert(st);
+
+   fspec_var owner = 0, in_union = 0;
+   fspec_num variants = 0;
+   for (const enum fspec_op *op = st->data; op; op = fspec_op_next(op, st->end, true)) {
+      if (*op != FSPEC_OP_DECLARATION)
+         continue;
+
+      const enum fspec_arg *arg[4];
+      arg[0] = fspec_op_get_arg(op, st->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[1] = fspec_arg_next(arg[0], st->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[2] = fspec_arg_next(arg[1], st->end, 1, 1<<FSPEC_ARG_OFF);
+      arg[3] = fspec_arg_next(arg[2], st->end, 1, 1<<FSPEC_ARG_STR);
+      const fspec_num id = fspec_arg_get_num(arg[1]);
+
+      if (id >= st->ninfo)
+         errx(EXIT_FAILURE, "%s: declaration %" PRI_FSPEC_NUM " is out of range", __func__, id);
+
+      struct info *info = &st->info[id];
+      *info = (struct info){
+         .op = op,
+         .end = (const void*)((char*)op + fspec_arg_get_num(arg[2])),
+         .name = fspec_arg_get_cstr(arg[3], st->data),
+         .visual = FSPEC_VISUAL_DEC,
+         .declaration = fspec_arg_get_num(arg[0]),
+      };
+
+      if (info->declaration == FSPEC_DECLARATION_STRUCT) {
+         info->owner = owner = id;
+         variants = 0;
+         continue;
+      }
+
+      if (info->declaration != FSPEC_DECLARATION_MEMBER)
+         continue;
+
+      struct info *parent = &st->info[owner];
+      info->owner = owner;
+      info->offset = (parent->members ? add_or_variable(info[-1].offset, info[-1].fixed) : 0);
+      ++parent->members;
+
+      for (const enum fspec_op *c = fspec_op_next(op, info->end, true); c; c = fspec_op_next(c, info->end, true)) {
+         if (*c == FSPEC_OP_READ || *c == FSPEC_OP_GOTO || *c == FSPEC_OP_SWITCH) {
+            info->code = c;
+         } else if (*c == FSPEC_OP_VISUAL) {
+            info->visual = fspec_arg_get_num(fspec_op_get_arg(c, info->end, 1, 1<<FSPEC_ARG_NUM));
+         }
+      }
+
+      // Members following an union are its variants, only one of them is read.
+      if (variants) {
+         const struct info *u = &st->info[in_union];
+         const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(fspec_op_next(u->code, u->end, true), u->end, 1, 1<<FSPEC_ARG_NUM));
+         info->in_union = in_union;
+         info->variant = cases - variants--;
+      }
+
+      if (info->code && *info->code == FSPEC_OP_SWITCH) {
+         in_union = id;
+         variants = fspec_arg_get_num(fspec_op_get_arg(fspec_op_next(info->code, info->end, true), info->end, 1, 1<<FSPEC_ARG_NUM));
+         info->fixed = VARIABLE;
+         info->visual = FSPEC_VISUAL_NUL;
+         continue;
+      }
+
+      // Structs can only refer to structs declared before them, so their sizes are already known here.
+      const enum fspec_arg *a = (info->code ? fspec_op_get_arg(info->code, info->end, 1, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR) : NULL);
+      // bit fields are left for member_extent to reject
+      if (info->in_union || (a && *info->code == FSPEC_OP_READ && fspec_arg_get_num(a) % 8)) {
+         info->fixed = VARIABLE;
+      } else if (!a) {
+         info->fixed = 0;
+      } else if (has_variable_count(a, info->end)) {
+         info->fixed = VARIABLE;
+      } else {
+         struct count count;
+         const size_t elem = (*info->code == FSPEC_OP_READ ? fspec_arg_get_num(a) / 8 : st->info[fspec_arg_get_num(a)].fixed);
+         info->fixed = (get_count(st, NULL, 0, a, info->end, &count) ? mul_or_variable(elem, count.nmemb) : VARIABLE);
+         st->error[0] = 0;
+      }
+
+      if (info->code && *info->code == FSPEC_OP_GOTO)
+         info->visual = FSPEC_VISUAL_NUL;
+   }
+
+   // Struct sizes are sums of their members.
+   for (size_t i = 0; i < st->ninfo; ++i) {
+      struct info *info = &st->info[i];
+      if (info->declaration != FSPEC_DECLARATION_STRUCT)
+         continue;
+
+      info->fixed = 0;
+      for (fspec_var m = 0; m < info->members; ++m)
+         info->fixed = add_or_variable(info->fixed, info[1 + m].fixed);
+   }
+}
+
+bool
+fspec_cursor_init(struct fspec_cursor *cursor, const char *name, const size_t offset)
+{
+   assert(cursor && cursor->mem.bcode.data && (cursor->mem.input.data || !cursor->mem.input.len));
+
+   struct fspec_cursor_state *st;
+   if (!(st = calloc(1, sizeof(*st))))
+      err(EXIT_FAILURE, "calloc(1, %zu)", sizeof(*st));
+
+   cursor->state = st;
+   st->data = cursor->mem.bcode.data;
+   st->end = (char*)st->data + cursor->mem.bcode.len;
+   st->input = cursor->mem.input.data;
+   st->input_len = cursor->mem.input.len;
+   st->start = offset;
+   st->ninfo = fspec_arg_get_num(fspec_op_get_arg(st->data, st->end, 2, 1<<FSPEC_ARG_NUM));
+
+   if (st->ninfo > (fspec_var)~0)
+      errx(EXIT_FAILURE, "%s: too many declarations: %zu", __func__, st->ninfo);
+
+   if (!(st->info = calloc((st->ninfo ? st->ninfo : 1), sizeof(*st->info))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", st->ninfo, sizeof(*st->info));
+
+   setup(st);
+
+   for (size_t i = 0; i < st->ninfo; ++i) {
+      if (st->info[i].declaration == FSPEC_DECLARATION_STRUCT && (!name || !strcmp(name, st->info[i].name)))
+         st->record = &st->info[i];
+   }
+
+   if (!st->record)
+      return set_error(st, "no such struct '%s'", (name ? name : ""));
+
+   if (!st->record->fixed)
+      return set_error(st, "records of '%s' have no size", st->record->name);
+
+   extents_reserve(st, st->record->members);
+   st->top = st->record->members;
+   st->current = (size_t)~0;
+   fspec_cursor_seek_record(cursor, 0);
+   return !st->error[0];
+}
+
+bool
+fspec_cursor_lookup(const struct fspec_cursor *cursor, const char *name, fspec_num *out_id)
+{
+   assert(cursor && cursor->state && name && out_id);
+   const struct fspec_cursor_state *st = cursor->state;
+
+   for (fspec_var m = 0; st->record && m < st->record->members; ++m) {
+      if (!strcmp(st->record[1 + m].name, name)) {
+         *out_id = (st->record - st->info) + 1 + m;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static bool
+resolve(struct fspec_cursor_state *st, const size_t local)
+{
+   assert(st && local < st->record->members);
+
+   for (; st->resolved <= local; ++st->resolved) {
+      const size_t i = st->resolved;
+      const size_t at = (i ? st->extents[i - 1].offset + st->extents[i - 1].size : st->at);
+      // Measuring nested structs may grow the extents, don't write through a pointer to them.
+      struct extent e;
+      if (!member_extent(st, st->record, 0, st->record + 1 + i, at, &e))
+         return false;
+
+      st->extents[i] = e;
+   }
+
+   return true;
+}
+
+static bool
+record_start(struct fspec_cursor_state *st, const size_t n, size_t *out_start)
+{
+   assert(st && out_start);
+
+   if (st->record->fixed != VARIABLE) {
+      const size_t off = mul_or_variable(st->record->fixed, n);
+      *out_start = add_or_variable(st->start, off);
+      return true;
+   }
+
+   if (!st->nrecords) {
+      st->records_len = 1024;
+      if (!(st->records = malloc(st->records_len * sizeof(*st->records))))
+         err(EXIT_FAILURE, "malloc(%zu)", st->records_len * sizeof(*st->records));
+
+      st->records[st->nrecords++] = st->start;
+   }
+
+   // Records are only found by walking them, remember every start for seeking back.
+   while (st->nrecords <= n) {
+      const size_t last = st->records[st->nrecords - 1];
+      if (last >= st->input_len)
+         break;
+
+      size_t size;
+      if (st->current == st->nrecords - 1) {
+         if (!resolve(st, st->record->members - 1))
+            return false;
+
+         const struct extent *e = &st->extents[st->record->members - 1];
+         size = e->offset + e->size - last;
+      } else if (!struct_size(st, st->record, last, &size)) {
+         return false;
+      }
+
+      if (!size)
+         return set_error(st, "'%s' record at offset %zu has no size", st->record->name, last);
+
+      if (st->nrecords >= st->records_len) {
+         st->records_len *= 2;
+         if (!(st->records = realloc(st->records, st->records_len * sizeof(*st->records))))
+            err(EXIT_FAILURE, "realloc(%zu)", st->records_len * sizeof(*st->records));
+      }
+
+      st->records[st->nrecords++] = last + size;
+   }
+
+   *out_start = (n < st->nrecords ? st->records[n] : VARIABLE);
+   return true;
+}
+
+bool
+fspec_cursor_seek_record(struct fspec_cursor *cursor, const size_t n)
+{
+   assert(cursor && cursor->state);
+   struct fspec_cursor_state *st = cursor->state;
+
+   if (st->error[0])
+      return false;
+
+   size_t start;
+   if (!record_start(st, n, &start) || start >= st->input_len)
+      return false;
+
+   if (st->record->fixed != VARIABLE && st->record->fixed > st->input_len - start)
+      return set_error(st, "'%s' record at offset %zu exceeds the input", st->record->name, start);
+
+   st->current = n;
+   st->at = start;
+   st->resolved = 0;
+   st->valid = true;
+   return true;
+}
+
+bool
+fspec_cursor_next(struct fspec_cursor *cursor)
+{
+   assert(cursor && cursor->state);
+   return fspec_cursor_seek_record(cursor, cursor->state->current + 1);
+}
+
+size_t
+fspec_cursor_get_record(const struct fspec_cursor *cursor)
+{
+   assert(cursor && cursor->state);
+   return cursor->state->current;
+}
+
+bool
+fspec_cursor_get(struct fspec_cursor *cursor, const fspec_num id, struct fspec_value *out_value)
+{
+   assert(cursor && cursor->state && out_value);
+   struct fspec_cursor_state *st = cursor->state;
+   const fspec_var record = st->record - st->info;
+
+   if (st->error[0] || !st->valid)
+      return false;
+
+   if (id <= record || id > (fspec_num)record + st->record->members)
+      return set_error(st, "declaration %" PRI_FSPEC_NUM " is not a member of '%s'", id, st->record->name);
+
+   const size_t local = id - record - 1;
+   const struct info *member = &st->info[id];
+
+   struct extent e;
+   if (local < st->resolved) {
+      e = st->extents[local];
+   } else if (member->offset != VARIABLE && member->fixed != VARIABLE) {
+      // Constant layout up to this member, no need to look at the bytes before it.
+      if (!member_extent(st, st->record, 0, member, st->at + member->offset, &e))
+         return false;
+   } else if (resolve(st, local)) {
+      e = st->extents[local];
+   } else {
+      return false;
+   }
+
+   *out_value = (struct fspec_value){
+      .name = member->name,
+      .data = st->input + e.offset,
+      .size = e.elem,
+      .nmemb = e.nmemb,
+      .id = id,
+      .visual = member->visual,
+   };
+
+   return true;
+}
+
+const char*
+fspec_cursor_get_error(const struct fspec_cursor *cursor)
+{
+   assert(cursor && cursor->state);
+   return (cursor->state->error[0] ? cursor->state->error : NULL);
+}
+
+void
+fspec_cursor_release(struct fspec_cursor *cursor)
+{
+   assert(cursor);
+
+   if (!cursor->state)
+      return;
+
+   free(cursor->state->extents);
+   free(cursor->state->records);
+   free(cursor->state->info);
+   free(cursor->state);
+   cursor->state = NULL;
+}
@@ -0,0 +1,52 @@
+#pragma once
+
+#include <fspec/bcode.h>
+#include <fspec/memory.h>
+#include <fspec/decoder.h>
+
+#include <stddef.h>
+#include <stdbool.h>
+
+struct fspec_cursor_state;
+
+/**
+ * random access to records, which are consecutive instances of a struct.
+ * members are located lazily and point directly into the input, filters are not applied.
+ * struct members are returned as a single element spanning all of their bytes.
+ */
+struct fspec_cursor {
+   struct {
+      struct fspec_mem bcode; // validated bytecode, must stay valid until release
+      struct fspec_mem input; // usually mmapped file, must stay valid until release
+   } mem;
+
+   struct fspec_cursor_state *state;
+};
+
+/** records are instances of struct name, or the last struct if NULL, starting at offset */
+bool
+fspec_cursor_init(struct fspec_cursor *cursor, const char *name, const size_t offset);
+
+/** resolves member name of the record struct to declaration id */
+bool
+fspec_cursor_lookup(const struct fspec_cursor *cursor, const char *name, fspec_num *out_id);
+
+/** returns false past the last record, or on error */
+bool
+fspec_cursor_seek_record(struct fspec_cursor *cursor, const size_t n);
+
+bool
+fspec_cursor_next(struct fspec_cursor *cursor);
+
+/** current record index */
+size_t
+fspec_cursor_get_record(const struct fspec_cursor *cursor);
+
+bool
+fspec_cursor_get(struct fspec_cursor *cursor, const fspec_num id, struct fspec_value *out_value);
+
+const char*
+fspec_cursor_get_error(const struct fspec_cursor *cursor);
+
+void
+fspec_cursor_release(struct fspec_cursor *cursor);
@@ -0,0 +1,792 @@
+#include <fspec/decoder.h>
+#include <fspec/bits.h>
+#include "bcode-internal.h"
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <stdarg.h>
+#include <string.h>
+#include <limits.h>
+#include <assert.h>
+
+struct info {
+   const enum fspec_op *op, *end;
+   const char *name;
+   fspec_var owner; // struct the member belongs to
+   fspec_var members; // number of members, structs only
+   enum fspec_declaration declaration;
+};
+
+struct slot {
+   uint8_t *data;
+   size_t len, written;
+   size_t size, nmemb;
+   enum fspec_visual visual;
+};
+
+struct frame {
+   const struct info *info;
+   const enum fspec_op *pc; // next member, NULL when the struct is done
+   size_t base; // slot of the first member
+   const struct info *loop; // struct member being iterated, if any
+   const struct info *variant, *last_variant; // chosen and last variant of the current union
+   fspec_num index, count;
+   uint64_t mark; // bit offset when the current iteration started
+   bool until_eof;
+};
+
+enum read_mode {
+   READ_COUNT,
+   READ_EOF,
+   READ_STR,
+};
+
+struct pending {
+   const struct info *member; // NULL when nothing is pending
+   const enum fspec_op *read;
+   struct fspec_mem terminator;
+   size_t slot, need; // need is in elements for bit fields
+   uint64_t value; // element of a bit field read so far
+   uint8_t bits, got; // width of elements when not byte aligned, 0 otherwise
+   enum read_mode mode;
+};
+
+struct fspec_decoder_state {
+   const void *data, *end;
+   struct info *info;
+   struct frame *frames;
+   struct slot *slots;
+   size_t ninfo, depth, nframes, nslots;
+   struct pending pending;
+   const uint8_t *in;
+   size_t left;
+   uint64_t offset;
+   struct fspec_bits bits; // rest of the last byte read by a bit field
+   bool eof, started;
+   char error[256];
+};
+
+__attribute__((format(printf, 2, 3)))
+static bool
+set_error(struct fspec_decoder_state *st, const char *fmt, ...)
+{
+   assert(st && fmt);
+   va_list args;
+   va_start(args, fmt);
+   vsnprintf(st->error, sizeof(st->error), fmt, args);
+   va_end(args);
+   return false;
+}
+
+fspec_num
+fspec_value_get_num(const struct fspec_value *value, const size_t nth)
+{
+   assert(value && nth < value->nmemb);
+   static_assert(CHAR_BIT == 8, "doesn't work otherwere right now");
+
+   fspec_num v = 0;
+   const uint8_t *p = (const uint8_t*)value->data + nth * value->size;
+   for (size_t i = 0; i < value->size && i < sizeof(v); ++i)
+      v |= (fspec_num)p[i] << (8 * i);
+
+   return v;
+}
+
+static bool
+slot_reserve(struct fspec_decoder_state *st, struct slot *slot, const size_t size)
+{
+   assert(st && slot);
+
+   // +1 keeps the data nul terminated for string arguments
+   if (slot->len > size)
+      return true;
+
+   const size_t len = (size + 1 > slot->len * 2 ? size + 1 : slot->len * 2);
+   void *data;
+   if (!(data = realloc(slot->data, len)))
+      return set_error(st, "realloc(%zu) failed", len);
+
+   slot->data = data;
+   slot->len = len;
+   return true;
+}
+
+static bool
+slot_append(struct slot *slot, struct fspec_decoder_state *st, const size_t size)
+{
+   assert(slot && st && size <= st->left);
+   if (!slot_reserve(st, slot, slot->written + size))
+      return false;
+
+   memcpy(slot->data + slot->written, st->in, size);
+   slot->written += size;
+   slot->data[slot->written] = 0;
+   st->in += size;
+   st->left -= size;
+   st->offset += size;
+   return true;
+}
+
+static struct fspec_value
+slot_get_value(const struct slot *slot, const struct fspec_decoder_state *st, const struct info *info)
+{
+   assert(slot && st && info);
+   return (struct fspec_value){
+      .name = info->name,
+      .data = slot->data,
+      .size = slot->size,
+      .nmemb = slot->nmemb,
+      .id = info - st->info,
+      .visual = slot->visual,
+   };
+}
+
+static struct slot*
+var_get_slot(struct fspec_decoder_state *st, const struct frame *frame, const enum fspec_arg *var)
+{
+   assert(st && frame && var);
+   const fspec_num id = fspec_arg_get_num(var);
+   const fspec_var owner = frame->info - st->info;
+
+   if (id <= owner || id > (fspec_num)owner + frame->info->members) {
+      set_error(st, "variable %" PRI_FSPEC_NUM " is not a member of '%s'", id, frame->info->name);
+      return NULL;
+   }
+
+   return &st->slots[frame->base + (id - owner - 1)];
+}
+
+// Variables of another struct set the error and read as 0 or "", callers check st->error.
+static fspec_num
+var_get_num(struct fspec_decoder_state *st, const struct frame *frame, const enum fspec_arg *var)
+{
+   const struct slot *slot = var_get_slot(st, frame, var);
+   if (!slot || !slot->nmemb)
+      return 0;
+
+   const struct fspec_value value = { .data = slot->data, .size = slot->size, .nmemb = slot->nmemb };
+   return fspec_value_get_num(&value, 0);
+}
+
+static const char*
+var_get_cstr(struct fspec_decoder_state *st, const struct frame *frame, const enum fspec_arg *var)
+{
+   const struct slot *slot = var_get_slot(st, frame, var);
+   return (slot && slot->data ? (const char*)slot->data : "");
+}
+
+struct count {
+   struct fspec_mem terminator;
+   fspec_num nmemb;
+   bool until_eof, until_str;
+};
+
+static bool
+get_count(struct fspec_decoder_state *st, const struct frame *frame, const enum fspec_arg *arg, const void *end, struct count *out_count)
+{
+   assert(st && frame && arg && end && out_count);
+   *out_count = (struct count){ .nmemb = 1 };
+
+   for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, end, 1, ~0));) {
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+         case FSPEC_ARG_VAR:
+            {
+               const fspec_num v = (*var != FSPEC_ARG_VAR ? fspec_arg_get_num(var) : var_get_num(st, frame, var));
+               if (st->error[0])
+                  return false;
+
+               if (v && out_count->nmemb > (fspec_num)~0 / v)
+                  return set_error(st, "array size overflows at offset %" PRIu64, st->offset);
+               out_count->nmemb *= v;
+            }
+            break;
+
+         case FSPEC_ARG_STR:
+            fspec_arg_get_mem(var, st->data, &out_count->terminator);
+            out_count->until_str = true;
+            break;
+
+         case FSPEC_ARG_EOF:
+            out_count->until_eof = true;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return true;
+}
+
+static const enum fspec_op*
+next_member(struct frame *frame, const struct info *member)
+{
+   assert(frame && member);
+
+   // only the chosen variant of an union is read
+   if (member == frame->variant) {
+      member = frame->last_variant;
+      frame->variant = NULL;
+   }
+
+   return ((const void*)member->end < (const void*)frame->info->end ? member->end : NULL);
+}
+
+static struct frame*
+frame_push(struct fspec_decoder_state *st, const struct info *info)
+{
+   assert(st && info && info->declaration == FSPEC_DECLARATION_STRUCT);
+
+   if (st->depth >= st->nframes) {
+      const size_t nframes = (st->nframes ? st->nframes * 2 : 8);
+      void *frames;
+      if (!(frames = realloc(st->frames, nframes * sizeof(*st->frames)))) {
+         set_error(st, "realloc(%zu) failed", nframes * sizeof(*st->frames));
+         return NULL;
+      }
+
+      st->frames = frames;
+      st->nframes = nframes;
+   }
+
+   // Member storage is allocated per depth, siblings and later records reuse the same slots.
+   const struct frame *parent = (st->depth ? &st->frames[st->depth - 1] : NULL);
+   const size_t base = (parent ? parent->base + parent->info->members : 0);
+
+   if (base + info->members > st->nslots) {
+      const size_t nslots = base + info->members;
+      void *slots;
+      if (!(slots = realloc(st->slots, nslots * sizeof(*st->slots)))) {
+         set_error(st, "realloc(%zu) failed", nslots * sizeof(*st->slots));
+         return NULL;
+      }
+
+      st->slots = slots;
+
+      memset(st->slots + st->nslots, 0, (nslots - st->nslots) * sizeof(*st->slots));
+      st->nslots = nslots;
+   }
+
+   struct frame *frame = &st->frames[st->depth++];
+   *frame = (struct frame){
+      .info = info,
+      .pc = fspec_op_next(info->op, info->end, true),
+      .base = base,
+   };
+
+   return frame;
+}
+
+static bool
+exec_member(struct fspec_decoder_state *st, struct frame *frame)
+{
+   assert(st && frame && frame->pc);
+
+   // Blocks are only a hint for interpreters that read from files, input is buffered here anyway.
+   if (*frame->pc != FSPEC_OP_DECLARATION) {
+      frame->pc = fspec_op_next(frame->pc, frame->info->end, true);
+      return true;
+   }
+
+   const fspec_num id = fspec_arg_get_num(fspec_op_get_arg(frame->pc, frame->info->end, 2, 1<<FSPEC_ARG_NUM));
+   assert(id < st->ninfo);
+   const struct info *member = &st->info[id];
+
+   // skip hints are for interpreters that don't hand the values out
+   const enum fspec_op *op = fspec_op_next(member->op, member->end, true);
+   if (op && *op == FSPEC_OP_SKIP)
+      op = fspec_op_next(op, member->end, true);
+
+   if (!op) {
+      frame->pc = next_member(frame, member);
+      return true;
+   }
+
+   switch (*op) {
+      case FSPEC_OP_READ:
+         {
+            const enum fspec_arg *arg = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_NUM);
+            const fspec_num bits = fspec_arg_get_num(arg);
+            assert(bits && bits <= 64);
+
+            struct count count;
+            if (!get_count(st, frame, arg, member->end, &count))
+               return false;
+
+            const size_t index = frame->base + (id - (frame->info - st->info) - 1);
+            struct slot *slot = &st->slots[index];
+            slot->written = slot->nmemb = 0;
+            slot->size = (bits + 7) / 8;
+            slot->visual = FSPEC_VISUAL_DEC;
+
+            st->pending = (struct pending){
+               .member = member,
+               .read = op,
+               .slot = index,
+               .terminator = count.terminator,
+               .bits = (bits % 8 || st->bits.len ? bits : 0),
+               .mode = (count.until_eof ? READ_EOF : (count.until_str ? READ_STR : READ_COUNT)),
+            };
+
+            if (st->pending.bits && st->pending.mode == READ_STR)
+               return set_error(st, "'%s': bit field arrays terminated by a string are not supported", member->name);
+
+            if (st->pending.mode == READ_COUNT) {
+               if (count.nmemb > SIZE_MAX / slot->size)
+                  return set_error(st, "'%s': array of %" PRI_FSPEC_NUM " elements is too large", member->name, count.nmemb);
+
+               st->pending.need = (st->pending.bits ? count.nmemb : count.nmemb * slot->size);
+               if (!slot_reserve(st, slot, count.nmemb * slot->size))
+                  return false;
+            }
+         }
+         break;
+
+      case FSPEC_OP_GOTO:
+         {
+            const enum fspec_arg *arg = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_VAR);
+            const fspec_num target = fspec_arg_get_num(arg);
+            assert(target < st->ninfo && st->info[target].declaration == FSPEC_DECLARATION_STRUCT);
+
+            struct count count;
+            if (!get_count(st, frame, arg, member->end, &count))
+               return false;
+
+            if (count.until_str)
+               return set_error(st, "'%s': struct arrays terminated by a string are not supported", member->name);
+
+            frame->loop = member;
+            frame->index = 0;
+            frame->count = count.nmemb;
+            frame->until_eof = count.until_eof;
+            frame->mark = st->offset * 8 - st->bits.len;
+         }
+         break;
+
+      case FSPEC_OP_SWITCH:
+         {
+            const enum fspec_arg *arg = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_VAR);
+            const fspec_num fallback = fspec_arg_get_num(fspec_arg_next(arg, member->end, 1, ~0));
+            const enum fspec_op *table = fspec_op_next(op, member->end, true);
+            const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(table, member->end, 1, 1<<FSPEC_ARG_NUM));
+            assert(id + cases < st->ninfo);
+
+            // variants are the members following the union
+            fspec_num c = fspec_op_table_lookup(table, member->end, var_get_num(st, frame, arg));
+            if (st->error[0])
+               return false;
+
+            c = (c < cases ? c : fallback);
+            frame->last_variant = &st->info[id + cases];
+            frame->variant = (c < cases ? &st->info[id + 1 + c] : NULL);
+            frame->pc = (frame->variant ? frame->variant->op : next_member(frame, frame->last_variant));
+         }
+         break;
+
+      default:
+         frame->pc = next_member(frame, member);
+         break;
+   }
+
+   return true;
+}
+
+static bool
+apply_filter(struct fspec_decoder *decoder, struct frame *frame, const enum fspec_op *op, const struct info *member, struct slot *slot)
+{
+   assert(decoder && frame && op && member && slot);
+   struct fspec_decoder_state *st = decoder->state;
+
+   if (!decoder->ops.filter)
+      return true;
+
+   struct fspec_decoder_filter filter = {0};
+   const enum fspec_arg *arg = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_STR);
+   filter.name = fspec_arg_get_cstr(arg, st->data);
+
+   for (const enum fspec_arg *var = arg; filter.nargs < FSPEC_DECODER_ARGS_MAX && (var = fspec_arg_next(var, member->end, 1, ~0));) {
+      struct fspec_decoder_arg *a = &filter.args[filter.nargs++];
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+            *a = (struct fspec_decoder_arg){ .num = fspec_arg_get_num(var), .type = FSPEC_DECODER_ARG_NUM };
+            break;
+
+         case FSPEC_ARG_STR:
+            *a = (struct fspec_decoder_arg){ .str = fspec_arg_get_cstr(var, st->data), .type = FSPEC_DECODER_ARG_STR };
+            break;
+
+         case FSPEC_ARG_VAR:
+            {
+               const struct slot *s;
+               if (!(s = var_get_slot(st, frame, var)))
+                  return false;
+
+               if (s->visual == FSPEC_VISUAL_STR) {
+                  *a = (struct fspec_decoder_arg){ .str = var_get_cstr(st, frame, var), .type = FSPEC_DECODER_ARG_STR };
+               } else {
+                  *a = (struct fspec_decoder_arg){ .num = var_get_num(st, frame, var), .type = FSPEC_DECODER_ARG_NUM };
+               }
+            }
+            break;
+
+
+         default:
+            --filter.nargs;
+            break;
+      }
+   }
+
+   struct fspec_value value = slot_get_value(slot, st, member);
+   if (!decoder->ops.filter(decoder, &filter, &value))
+      return (st->error[0] ? false : set_error(st, "'%s': filter '%s' failed", member->name, filter.name));
+
+   if (!value.size)
+      return set_error(st, "'%s': filter '%s' returned elements of zero size", member->name, filter.name);
+
+   if (value.nmemb > SIZE_MAX / value.size)
+      return set_error(st, "'%s': filter '%s' returned too much data", member->name, filter.name);
+
+   if (value.data != slot->data) {
+      if (!slot_reserve(st, slot, value.size * value.nmemb))
+         return false;
+
+      memcpy(slot->data, value.data, value.size * value.nmemb);
+   }
+
+   slot->size = value.size;
+   slot->nmemb = value.nmemb;
+   slot->written = value.size * value.nmemb;
+   slot->data[slot->written] = 0;
+   return true;
+}
+
+static bool
+finish_member(struct fspec_decoder *decoder)
+{
+   assert(decoder);
+   struct fspec_decoder_state *st = decoder->state;
+   struct frame *frame = &st->frames[st->depth - 1];
+   struct slot *slot = &st->slots[st->pending.slot];
+   const struct info *member = st->pending.member;
+   st->pending.member = NULL;
+
+   if (slot->written % slot->size)
+      return set_error(st, "'%s': input ended in the middle of an element", member->name);
+
+   slot->nmemb = slot->written / slot->size;
+
+   for (const enum fspec_op *op = st->pending.read; (op = fspec_op_next(op, member->end, true));) {
+      switch (*op) {
+         case FSPEC_OP_FILTER:
+            if (!apply_filter(decoder, frame, op, member, slot))
+               return false;
+            break;
+
+         case FSPEC_OP_VISUAL:
+            slot->visual = fspec_arg_get_num(fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_NUM));
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   if (decoder->ops.member) {
+      const struct fspec_value value = slot_get_value(slot, st, member);
+      decoder->ops.member(decoder, &value, st->depth - 1);
+   }
+
+   frame->pc = next_member(frame, member);
+   return true;
+}
+
+static bool
+fill_bits(struct fspec_decoder_state *st)
+{
+   assert(st && st->pending.member && st->pending.bits);
+   struct pending *p = &st->pending;
+   struct slot *slot = &st->slots[p->slot];
+
+   while (p->mode == READ_EOF || p->need) {
+      for (; st->bits.len < p->bits - p->got && st->bits.len <= 56 && st->left; ++st->offset, --st->left)
+         fspec_bits_push_byte(&st->bits, *st->in++);
+
+      uint64_t v;
+      const uint8_t take = fspec_bits_take(&st->bits, p->bits - p->got, &v);
+      if (!take)
+         return false;
+
+      p->value |= v << p->got;
+
+      if ((p->got += take) < p->bits)
+         continue;
+
+      if (!slot_reserve(st, slot, slot->written + slot->size))
+         return false;
+
+      fspec_bits_store((uint8_t*)slot->data + slot->written, p->value, slot->size);
+      slot->written += slot->size;
+
+      p->value = p->got = 0;
+      p->need -= (p->mode == READ_COUNT);
+   }
+
+   return true;
+}
+
+static bool
+fill_pending(struct fspec_decoder_state *st)
+{
+   assert(st && st->pending.member);
+   struct pending *p = &st->pending;
+   struct slot *slot = &st->slots[p->slot];
+
+   if (p->bits)
+      return fill_bits(st);
+
+   switch (p->mode) {
+      case READ_COUNT:
+         {
+            const size_t n = (p->need < st->left ? p->need : st->left);
+            if (!slot_append(slot, st, n))
+               return false;
+
+            p->need -= n;
+         }
+         return !p->need;
+
+      case READ_EOF:
+         slot_append(slot, st, st->left);
+         break;
+
+      case READ_STR:
+         while (st->left) {
+            const size_t rest = slot->size - slot->written % slot->size;
+            if (!slot_append(slot, st, (rest < st->left ? rest : st->left)))
+               return false;
+
+            if (!(slot->written % slot->size) && slot->written >= p->terminator.len &&
+                  !memcmp(slot->data + slot->written - p->terminator.len, p->terminator.data, p->terminator.len))
+               return true;
+         }
+         break;
+   }
+
+   return false;
+}
+
+static void
+frame_pop(struct fspec_decoder *decoder)
+{
+   assert(decoder);
+   struct fspec_decoder_state *st = decoder->state;
+   assert(st->depth > 0);
+
+   const struct frame *frame = &st->frames[--st->depth];
+   struct frame *parent = (st->depth ? &st->frames[st->depth - 1] : NULL);
+
+   if (!parent) {
+      if (decoder->ops.leave)
+         decoder->ops.leave(decoder, NULL, frame->info->name, 0, 0);
+      return;
+   }
+
+   if (decoder->ops.leave) {
+      const struct fspec_value value = { .name = parent->loop->name, .id = parent->loop - st->info };
+      decoder->ops.leave(decoder, &value, frame->info->name, parent->index, st->depth);
+   }
+
+   ++parent->index;
+}
+
+static enum fspec_decoder_status
+run(struct fspec_decoder *decoder)
+{
+   assert(decoder);
+   struct fspec_decoder_state *st = decoder->state;
+
+   if (!st->started && st->depth) {
+      st->started = true;
+      if (decoder->ops.enter)
+         decoder->ops.enter(decoder, NULL, st->frames[0].info->name, 0, 0);
+   }
+
+   while (!st->error[0]) {
+      if (st->pending.member) {
+         if (!fill_pending(st)) {
+            if (st->error[0])
+               break;
+
+            if (!st->eof)
+               return FSPEC_DECODER_MORE;
+
+            if (st->pending.mode == READ_COUNT) {
+               set_error(st, "'%s': unexpected end of input at offset %" PRIu64, st->pending.member->name, st->offset);
+               break;
+            }
+         }
+
+         finish_member(decoder);
+         continue;
+      }
+
+      if (!st->depth)
+         return FSPEC_DECODER_DONE;
+
+      struct frame *frame = &st->frames[st->depth - 1];
+
+      if (frame->loop) {
+         bool more;
+         if (frame->until_eof) {
+            if (!st->left && !st->eof)
+               return FSPEC_DECODER_MORE;
+
+            // Stop if the last iteration made no progress, the struct can't ever consume the input.
+            more = ((st->left || st->bits.len) && (!frame->index || st->offset * 8 - st->bits.len != frame->mark));
+         } else {
+            more = (frame->index < frame->count);
+         }
+
+         if (!more) {
+            frame->pc = next_member(frame, frame->loop);
+            frame->loop = NULL;
+            continue;
+         }
+
+         frame->mark = st->offset * 8 - st->bits.len;
+         const struct info *target = &st->info[fspec_arg_get_num(fspec_op_get_arg(fspec_op_next(frame->loop->op, frame->loop->end, true), frame->loop->end, 1, 1<<FSPEC_ARG_VAR))];
+         const struct fspec_value value = { .name = frame->loop->name, .id = frame->loop - st->info };
+         const fspec_num index = frame->index;
+         if (!frame_push(st, target))
+            break;
+
+         if (decoder->ops.enter)
+            decoder->ops.enter(decoder, &value, target->name, index, st->depth - 1);
+         continue;
+      }
+
+      if (!frame->pc) {
+         frame_pop(decoder);
+         continue;
+      }
+
+      exec_member(st, frame);
+   }
+
+   return FSPEC_DECODER_ERROR;
+}
+
+bool
+fspec_decoder_init(struct fspec_decoder *decoder)
+{
+   assert(decoder && decoder->mem.bcode.data);
+
+   struct fspec_decoder_state *st;
+   if (!(decoder->state = st = calloc(1, sizeof(*st))))
+      return false;
+
+   st->data = decoder->mem.bcode.data;
+   st->end = (char*)st->data + decoder->mem.bcode.len;
+   st->ninfo = fspec_arg_get_num(fspec_op_get_arg(st->data, st->end, 2, 1<<FSPEC_ARG_NUM));
+
+   if (st->ninfo > (fspec_var)~0)
+      return set_error(st, "too many declarations: %zu", st->ninfo);
+
+   if (!(st->info = calloc((st->ninfo ? st->ninfo : 1), sizeof(*st->info))))
+      return set_error(st, "calloc(%zu, %zu) failed", st->ninfo, sizeof(*st->info));
+
+   fspec_var owner = 0;
+   const struct info *root = NULL;
+   for (const enum fspec_op *op = st->data; op; op = fspec_op_next(op, st->end, true)) {
+      if (*op != FSPEC_OP_DECLARATION)
+         continue;
+
+      const enum fspec_arg *arg[4];
+      arg[0] = fspec_op_get_arg(op, st->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[1] = fspec_arg_next(arg[0], st->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[2] = fspec_arg_next(arg[1], st->end, 1, 1<<FSPEC_ARG_OFF);
+      arg[3] = fspec_arg_next(arg[2], st->end, 1, 1<<FSPEC_ARG_STR);
+      const fspec_num id = fspec_arg_get_num(arg[1]);
+
+      if (id >= st->ninfo)
+         return set_error(st, "declaration %" PRI_FSPEC_NUM " is out of range", id);
+
+      struct info *info = &st->info[id];
+      *info = (struct info){
+         .op = op,
+         .end = (const void*)((char*)op + fspec_arg_get_num(arg[2])),
+         .name = fspec_arg_get_cstr(arg[3], st->data),
+         .declaration = fspec_arg_get_num(arg[0]),
+      };
+
+      if (info->declaration == FSPEC_DECLARATION_STRUCT) {
+         info->owner = owner = id;
+         root = info;
+      } else if (info->declaration == FSPEC_DECLARATION_MEMBER) {
+         info->owner = owner;
+         ++st->info[owner].members;
+      }
+   }
+
+   if (!root)
+      return set_error(st, "bytecode does not declare any structs");
+
+   return (frame_push(st, root) != NULL);
+}
+
+enum fspec_decoder_status
+fspec_decoder_feed(struct fspec_decoder *decoder, const void *data, const size_t size, const bool eof, size_t *out_consumed)
+{
+   assert(decoder && decoder->state && (data || !size));
+   struct fspec_decoder_state *st = decoder->state;
+   st->in = data;
+   st->left = size;
+   st->eof = eof;
+
+   const enum fspec_decoder_status status = run(decoder);
+
+   if (out_consumed)
+      *out_consumed = size - st->left;
+
+   st->in = NULL;
+   st->left = 0;
+   return status;
+}
+
+uint64_t
+fspec_decoder_get_offset(const struct fspec_decoder *decoder)
+{
+   assert(decoder && decoder->state);
+   return decoder->state->offset;
+}
+
+const char*
+fspec_decoder_get_error(const struct fspec_decoder *decoder)
+{
+   assert(decoder);
+
+   // only the state itself can fail to allocate without an error message
+   if (!decoder->state)
+      return "out of memory";
+
+   return (decoder->state->error[0] ? decoder->state->error : NULL);
+}
+
+void
+fspec_decoder_release(struct fspec_decoder *decoder)
+{
+   assert(decoder);
+
+   if (!decoder->state)
+      return;
+
+   for (size_t i = 0; i < decoder->state->nslots; ++i)
+      free(decoder->state->slots[i].data);
+
+   free(decoder->state->slots);
+   free(decoder->state->frames);
+   free(decoder->state->info);
+   free(decoder->state);
+   decoder->state = NULL;
+}
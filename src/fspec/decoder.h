@@ -0,0 +1,98 @@
+#pragma once
+
+#include <fspec/bcode.h>
+#include <fspec/memory.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/** decoded member value, data is only valid for the duration of the callback */
+struct fspec_value {
+   const char *name;
+   const void *data;
+   size_t size; // size of single element in bytes
+   size_t nmemb;
+   fspec_num id; // declaration id
+   enum fspec_visual visual;
+};
+
+/** returns nth element of value as little endian number */
+fspec_num
+fspec_value_get_num(const struct fspec_value *value, const size_t nth);
+
+enum fspec_decoder_arg_type {
+   FSPEC_DECODER_ARG_NUM,
+   FSPEC_DECODER_ARG_STR,
+};
+
+struct fspec_decoder_arg {
+   union {
+      fspec_num num;
+      const char *str;
+   };
+   enum fspec_decoder_arg_type type;
+};
+
+/** maximum number of filter arguments */
+#define FSPEC_DECODER_ARGS_MAX 16
+
+/** filter to apply, arguments referencing other members are already resolved */
+struct fspec_decoder_filter {
+   const char *name;
+   struct fspec_decoder_arg args[FSPEC_DECODER_ARGS_MAX];
+   uint8_t nargs;
+};
+
+enum fspec_decoder_status {
+   FSPEC_DECODER_MORE, // all input was consumed, feed more
+   FSPEC_DECODER_DONE, // the last struct was decoded completely
+   FSPEC_DECODER_ERROR, // see fspec_decoder_get_error
+};
+
+struct fspec_decoder_state;
+
+struct fspec_decoder;
+struct fspec_decoder {
+   struct {
+      /** struct member is entered, member is NULL for the root struct */
+      void (*enter)(struct fspec_decoder *decoder, const struct fspec_value *member, const char *name, const fspec_num index, const size_t depth);
+      /** struct member is left */
+      void (*leave)(struct fspec_decoder *decoder, const struct fspec_value *member, const char *name, const fspec_num index, const size_t depth);
+      /** member was decoded and filtered */
+      void (*member)(struct fspec_decoder *decoder, const struct fspec_value *value, const size_t depth);
+      /**
+       * apply filter to value, the filter may point value->data to its own storage,
+       * which only has to stay valid until this function is called again.
+       * return false to abort decoding.
+       */
+      bool (*filter)(struct fspec_decoder *decoder, const struct fspec_decoder_filter *filter, struct fspec_value *value);
+   } ops;
+
+   struct {
+      struct fspec_mem bcode; // validated bytecode, must stay valid until release
+   } mem;
+
+   struct fspec_decoder_state *state;
+};
+
+/** prepares to decode the last struct of the bytecode, returns false on error, see fspec_decoder_get_error */
+bool
+fspec_decoder_init(struct fspec_decoder *decoder);
+
+/**
+ * decodes as much of data as possible, partial members are buffered.
+ * set eof when no more data is going to follow.
+ */
+enum fspec_decoder_status
+fspec_decoder_feed(struct fspec_decoder *decoder, const void *data, const size_t size, const bool eof, size_t *out_consumed);
+
+/** total bytes consumed */
+uint64_t
+fspec_decoder_get_offset(const struct fspec_decoder *decoder);
+
+const char*
+fspec_decoder_get_error(const struct fspec_decoder *decoder);
+
+void
+fspec_decoder_release(struct fspec_decoder *decoder);
@@ -2,10 +2,21 @@
 
 #include <fspec/memory.h>
 
+#include <stdbool.h>
+
+/**
+ * compiles spec into bytecode unit.
+ * import "module"; statements request the unit of the module through ops.import,
+ * and declare its structs as externs, see fspec_linker for linking the units.
+ * ops.import may be NULL, if imports are not supported.
+ * mem.output must be allocated with malloc, imports grow it with realloc for their externs,
+ * the storage is returned in mem.output also on failure.
+ */
 struct fspec_lexer;
 struct fspec_lexer {
    struct {
       size_t (*read)(struct fspec_lexer *lexer, void *ptr, const size_t size, const size_t nmemb);
+      bool (*import)(struct fspec_lexer *lexer, const char *module, struct fspec_mem *out_unit);
    } ops;
 
    struct {
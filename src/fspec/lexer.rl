@@ -59,6 +59,23 @@ membuf_append(struct membuf *buf, const void *data, const fspec_off data_sz)
    membuf_append_at(buf, buf->written, data, data_sz);
 }
 
+static void
+membuf_move_tail(struct membuf *buf, const fspec_off off, const fspec_off tail)
+{
+   // moves everything written after tail to off
+   assert(off <= tail && tail <= buf->written);
+   const fspec_off size = buf->written - tail;
+
+   char *tmp;
+   if (!(tmp = malloc(size)) && size)
+      err(EXIT_FAILURE, "malloc(%" PRI_FSPEC_OFF ")", size);
+
+   memcpy(tmp, (char*)buf->mem.data + tail, size);
+   memmove((char*)buf->mem.data + off + size, (char*)buf->mem.data + off, tail - off);
+   membuf_replace(buf, off, tmp, size);
+   free(tmp);
+}
+
 struct varbuf {
    struct membuf buf;
    fspec_off offset;
@@ -125,6 +142,42 @@ codebuf_append(struct codebuf *code, const enum section section, const void *dat
    assert((char*)code->end[SECTION_CODE] == (char*)code->buf.mem.data + code->buf.written);
 }
 
+static void
+codebuf_reserve(struct codebuf *code, const fspec_off size)
+{
+   // Grows the storage for appending size bytes, pointers of the codebuf are rebased,
+   // so this may only be called where no other pointers to the storage are held.
+   assert(code);
+
+   if (code->buf.mem.len >= size && code->buf.written <= code->buf.mem.len - size)
+      return;
+
+   if (size > (fspec_off)~0 - code->buf.written)
+      errx(EXIT_FAILURE, "%s: %" PRI_FSPEC_OFF " + %" PRI_FSPEC_OFF " bytes exceeds the fspec_off range", __func__, code->buf.written, size);
+
+   size_t len = code->buf.mem.len * 2;
+   len = (len < (size_t)code->buf.written + size ? (size_t)code->buf.written + size : len);
+   len = (len > (fspec_off)~0 ? (fspec_off)~0 : len);
+
+   size_t decl[ARRAY_SIZE(code->decl)], end[ARRAY_SIZE(code->end)];
+   for (enum fspec_declaration d = 0; d < ARRAY_SIZE(code->decl); ++d)
+      decl[d] = (code->decl[d] ? (size_t)((char*)code->decl[d] - (char*)code->buf.mem.data) : 0);
+   for (enum section s = 0; s < ARRAY_SIZE(code->end); ++s)
+      end[s] = (char*)code->end[s] - (char*)code->buf.mem.data;
+   const size_t strings = (char*)code->strings - (char*)code->buf.mem.data;
+
+   char *data;
+   if (!(data = realloc(code->buf.mem.data, len)))
+      err(EXIT_FAILURE, "realloc(%zu)", len);
+
+   for (enum fspec_declaration d = 0; d < ARRAY_SIZE(code->decl); ++d)
+      code->decl[d] = (code->decl[d] ? data + decl[d] : NULL);
+   for (enum section s = 0; s < ARRAY_SIZE(code->end); ++s)
+      code->end[s] = data + end[s];
+   code->strings = data + strings;
+   code->buf.mem = (struct fspec_mem){ .data = data, .len = len };
+}
+
 static void
 codebuf_append_op(struct codebuf *code, const enum fspec_op op)
 {
@@ -143,6 +196,15 @@ arg_sizeof(const enum fspec_arg type)
       case FSPEC_ARG_NUM:
          return sizeof(fspec_num);
 
+      case FSPEC_ARG_NUM8:
+         return sizeof(uint8_t);
+
+      case FSPEC_ARG_NUM16:
+         return sizeof(uint16_t);
+
+      case FSPEC_ARG_NUM32:
+         return sizeof(uint32_t);
+
       case FSPEC_ARG_VAR:
          return sizeof(fspec_var);
 
@@ -165,6 +227,28 @@ codebuf_append_arg(struct codebuf *code, const enum fspec_arg type, const void *
    codebuf_append(code, SECTION_CODE, v, arg_sizeof(type));
 }
 
+static void
+codebuf_append_arg_num(struct codebuf *code, const fspec_num v)
+{
+   switch (fspec_arg_num_type(v)) {
+      case FSPEC_ARG_NUM8:
+         codebuf_append_arg(code, FSPEC_ARG_NUM8, (uint8_t[]){ v });
+         break;
+
+      case FSPEC_ARG_NUM16:
+         codebuf_append_arg(code, FSPEC_ARG_NUM16, (uint16_t[]){ v });
+         break;
+
+      case FSPEC_ARG_NUM32:
+         codebuf_append_arg(code, FSPEC_ARG_NUM32, (uint32_t[]){ v });
+         break;
+
+      default:
+         codebuf_append_arg(code, FSPEC_ARG_NUM, &v);
+         break;
+   }
+}
+
 static void
 codebuf_replace_arg(struct codebuf *code, const enum fspec_arg *arg, const enum fspec_arg type, const void *v)
 {
@@ -192,8 +276,8 @@ get_string_offset(const void *start, const void *end, const void *str, const fsp
    return false;
 }
 
-static void
-codebuf_append_arg_cstr(struct codebuf *code, const void *str, const fspec_strsz str_sz)
+static fspec_off
+codebuf_append_cstr(struct codebuf *code, const void *str, const fspec_strsz str_sz)
 {
    const void *ptr;
    if (!get_string_offset(code->strings, code->end[SECTION_DATA], str, str_sz, &ptr)) {
@@ -203,25 +287,33 @@ codebuf_append_arg_cstr(struct codebuf *code, const void *str, const fspec_strsz
       codebuf_append(code, SECTION_DATA, (char[]){ 0 }, 1);
    }
 
-   const fspec_off off = (char*)ptr - (char*)code->buf.mem.data;
+   return (char*)ptr - (char*)code->buf.mem.data;
+}
+
+static void
+codebuf_append_arg_cstr(struct codebuf *code, const void *str, const fspec_strsz str_sz)
+{
+   const fspec_off off = codebuf_append_cstr(code, str, str_sz);
    codebuf_append_arg(code, FSPEC_ARG_STR, &off);
 }
 
 static const enum fspec_op*
-get_named_op(const enum fspec_op *start, const void *end, const void *data, const enum fspec_op op, const uint8_t nth, const void *name, const fspec_strsz name_sz, fspec_var *out_id)
+get_named_declaration(const enum fspec_op *start, const void *end, const void *data, const bool member, const void *name, const fspec_strsz name_sz, fspec_var *out_id)
 {
    fspec_var id = 0;
    if ((void*)start < end && *start == FSPEC_OP_DECLARATION)
       id = fspec_arg_get_num(fspec_op_get_arg(start, end, 2, 1<<FSPEC_ARG_NUM));
 
    for (const enum fspec_op *p = start; p; p = fspec_op_next(p, end, true)) {
-      const enum fspec_arg *arg;
-      if (*p != op || !(arg = fspec_op_get_arg(p, end, nth, 1<<FSPEC_ARG_STR)))
+      if (*p != FSPEC_OP_DECLARATION)
          continue;
 
+      // members share the namespace of their struct only, types are looked up without them
+      const bool is_member = (fspec_arg_get_num(fspec_op_get_arg(p, end, 1, 1<<FSPEC_ARG_NUM)) == FSPEC_DECLARATION_MEMBER);
+
       struct fspec_mem str;
-      fspec_arg_get_mem(arg, data, &str);
-      if (str.len == name_sz && !memcmp(name, str.data, name_sz)) {
+      fspec_arg_get_mem(fspec_op_get_arg(p, end, 4, 1<<FSPEC_ARG_STR), data, &str);
+      if (is_member == member && str.len == name_sz && !memcmp(name, str.data, name_sz)) {
          if (out_id)
             *out_id = id;
 
@@ -238,7 +330,7 @@ static const enum fspec_op*
 get_declaration(struct codebuf *code, const bool member, const struct fspec_mem *str, fspec_var *out_id)
 {
    const void *start = (member ? code->decl[FSPEC_DECLARATION_STRUCT] : code->end[SECTION_DATA]);
-   return get_named_op(start, code->end[SECTION_CODE], code->buf.mem.data, FSPEC_OP_DECLARATION, 4, str->data, str->len, out_id);
+   return get_named_declaration(start, code->end[SECTION_CODE], code->buf.mem.data, member, str->data, str->len, out_id);
 }
 
 static bool
@@ -257,8 +349,8 @@ codebuf_append_declaration(struct codebuf *code, const enum fspec_declaration de
 {
    code->decl[decl] = code->end[SECTION_CODE];
    codebuf_append_op(code, FSPEC_OP_DECLARATION);
-   codebuf_append_arg(code, FSPEC_ARG_NUM, (fspec_num[]){ decl });
-   codebuf_append_arg(code, FSPEC_ARG_NUM, (fspec_num[]){ code->declarations++ });
+   codebuf_append_arg_num(code, decl);
+   codebuf_append_arg_num(code, code->declarations++);
    codebuf_append_arg(code, FSPEC_ARG_OFF, (fspec_off[]){ PLACEHOLDER });
 }
 
@@ -308,11 +400,27 @@ stack_get_num(const struct stack *stack)
    return stack->num;
 }
 
+struct cases {
+   fspec_num key[UINT8_MAX], next;
+   fspec_off name[UINT8_MAX];
+   fspec_off decl; // union member, relative to the start of the code section
+   fspec_var enum_id; // enum of the selector, names of the cases are its constants
+   uint8_t count, fallback;
+   bool has_enum;
+};
+
 struct state {
    struct ragel ragel;
    struct stack stack;
    struct codebuf out;
    struct varbuf var;
+   struct cases cases;
+   struct {
+      fspec_var member, enum_id;
+   } enums[UINT8_MAX]; // members of enum type in the current struct
+   uint8_t nenums;
+   fspec_var enum_id; // enum of the current member
+   bool enum_member;
 };
 
 static void
@@ -326,6 +434,21 @@ state_stack_num(struct state *state, const uint8_t base)
    varbuf_remove_last(&state->var);
 }
 
+static void
+state_append_read(struct state *state, const fspec_num bits)
+{
+   assert(state);
+
+   // widths that are not multiple of 8 are bit fields
+   if (!bits || bits > 64) {
+      ragel_throw_error(&state->ragel, "unsupported type width: %" PRI_FSPEC_NUM, bits);
+      return;
+   }
+
+   codebuf_append_op(&state->out, FSPEC_OP_READ);
+   codebuf_append_arg_num(&state->out, bits);
+}
+
 static void
 state_append_arg_var(struct state *state, const bool member, const struct fspec_mem *str)
 {
@@ -335,6 +458,29 @@ state_append_arg_var(struct state *state, const bool member, const struct fspec_
       ragel_throw_error(&state->ragel, "'%s' undeclared", (char*)str->data);
 }
 
+static void
+state_goto(struct state *state, const struct fspec_mem *str)
+{
+   assert(state && str);
+
+   fspec_var id;
+   const void *end = state->out.end[SECTION_CODE];
+   const enum fspec_op *decl = get_declaration(&state->out, false, str, &id);
+   if (!decl) {
+      ragel_throw_error(&state->ragel, "'%s' undeclared", (char*)str->data);
+      return;
+   }
+
+   const fspec_num kind = fspec_arg_get_num(fspec_op_get_arg(decl, end, 1, 1<<FSPEC_ARG_NUM));
+   if (kind != FSPEC_DECLARATION_STRUCT && kind != FSPEC_DECLARATION_EXTERN) {
+      ragel_throw_error(&state->ragel, "'%s' is not a struct", (char*)str->data);
+      return;
+   }
+
+   codebuf_append_op(&state->out, FSPEC_OP_GOTO);
+   codebuf_append_arg(&state->out, FSPEC_ARG_VAR, &id);
+}
+
 static void
 state_append_declaration(struct state *state, const enum fspec_declaration decl, const struct fspec_mem *str)
 {
@@ -357,6 +503,336 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
    state->out.decl[decl] = NULL;
 }
 
+static bool
+get_constant(const struct codebuf *code, const fspec_var enum_id, const struct fspec_mem *name, fspec_num *out_v)
+{
+   assert(code && name && out_v);
+
+   bool in_enum = false;
+   const void *end = code->end[SECTION_CODE];
+   const enum fspec_op *op = code->end[SECTION_DATA];
+   for (op = ((void*)op < end ? op : NULL); op; op = fspec_op_next(op, end, true)) {
+      if (*op == FSPEC_OP_DECLARATION) {
+         in_enum = (fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) == FSPEC_DECLARATION_ENUM &&
+                    fspec_arg_get_num(fspec_op_get_arg(op, end, 2, 1<<FSPEC_ARG_NUM)) == enum_id);
+         continue;
+      }
+
+      if (*op != FSPEC_OP_TABLE || !in_enum)
+         continue;
+
+      // names within an enum are unique, see state_enum_constant
+      const enum fspec_arg *arg = fspec_op_get_arg(op, end, 3, 1<<FSPEC_ARG_DAT);
+      struct fspec_mem keys;
+      fspec_arg_get_mem(arg, NULL, &keys);
+
+      for (fspec_num c = 0; (arg = fspec_arg_next(arg, end, 1, 1<<FSPEC_ARG_STR)); ++c) {
+         struct fspec_mem str;
+         fspec_arg_get_mem(arg, code->buf.mem.data, &str);
+         if (str.len == name->len && !memcmp(name->data, str.data, str.len)) {
+            memcpy(out_v, (char*)keys.data + c * sizeof(*out_v), sizeof(*out_v));
+            return true;
+         }
+      }
+
+      return false;
+   }
+
+   return false;
+}
+
+static void
+state_append_table(struct state *state, const bool named)
+{
+   assert(state);
+
+   const struct cases *cases = &state->cases;
+
+   fspec_num base = ~(fspec_num)0, keyed = 0;
+   for (uint8_t c = 0; c < cases->count; ++c) {
+      if (c == cases->fallback)
+         continue;
+
+      base = (cases->key[c] < base ? cases->key[c] : base);
+      ++keyed;
+   }
+
+   base = (keyed ? base : 0);
+
+   // smallest n where (key - base) % n doesn't collide, dense keys end up indexed directly
+   uint8_t *slot;
+   const size_t slots_max = UINT16_MAX;
+   if (!(slot = malloc(slots_max)))
+      err(EXIT_FAILURE, "malloc(%zu)", slots_max);
+
+   size_t n;
+   for (n = (keyed ? keyed : 1); n <= slots_max; ++n) {
+      memset(slot, UINT8_MAX, n);
+
+      uint8_t c;
+      for (c = 0; c < cases->count; ++c) {
+         if (c == cases->fallback)
+            continue;
+
+         const size_t s = (cases->key[c] - base) % n;
+         if (slot[s] == UINT8_MAX)
+            slot[s] = c;
+         else if (cases->key[slot[s]] != cases->key[c]) // same value is matched by the first case
+            break;
+      }
+
+      if (c == cases->count)
+         break;
+   }
+
+   if (n > slots_max) {
+      ragel_throw_error(&state->ragel, "case values are too sparse");
+      free(slot);
+      return;
+   }
+
+   codebuf_append_op(&state->out, FSPEC_OP_TABLE);
+   codebuf_append_arg_num(&state->out, cases->count);
+   codebuf_append_arg_num(&state->out, base);
+   const fspec_off keys = cases->count * sizeof(cases->key[0]);
+   codebuf_append_arg(&state->out, FSPEC_ARG_DAT, (fspec_off[]){ keys + n });
+   codebuf_append(&state->out, SECTION_CODE, cases->key, keys);
+   codebuf_append(&state->out, SECTION_CODE, slot, n);
+   free(slot);
+
+   for (uint8_t c = 0; named && c < cases->count; ++c)
+      codebuf_append_arg(&state->out, FSPEC_ARG_STR, &cases->name[c]);
+}
+
+static void
+state_start_union(struct state *state, const struct fspec_mem *selector)
+{
+   assert(state && selector && state->out.decl[FSPEC_DECLARATION_MEMBER]);
+
+   if (get_declaration(&state->out, true, selector, NULL) == state->out.decl[FSPEC_DECLARATION_MEMBER]) {
+      ragel_throw_error(&state->ragel, "union '%s' can't select itself", (char*)selector->data);
+      return;
+   }
+
+   codebuf_append_op(&state->out, FSPEC_OP_SWITCH);
+   state_append_arg_var(state, true, selector);
+   memset(&state->cases, 0, sizeof(state->cases));
+   state->cases.fallback = UINT8_MAX;
+   state->cases.decl = (char*)state->out.decl[FSPEC_DECLARATION_MEMBER] - (char*)state->out.end[SECTION_DATA];
+   state_finish_declaration(state, FSPEC_DECLARATION_MEMBER);
+
+   fspec_var id;
+   if (!get_declaration(&state->out, true, selector, &id))
+      return;
+
+   for (uint8_t i = 0; i < state->nenums && !state->cases.has_enum; ++i) {
+      state->cases.enum_id = state->enums[i].enum_id;
+      state->cases.has_enum = (state->enums[i].member == id);
+   }
+}
+
+static void
+state_union_case(struct state *state, const fspec_num v, const bool fallback)
+{
+   assert(state);
+
+   struct cases *cases = &state->cases;
+   if (cases->count >= UINT8_MAX) {
+      ragel_throw_error(&state->ragel, "union has more than %u variants", UINT8_MAX);
+      return;
+   }
+
+   if (fallback && cases->fallback != UINT8_MAX) {
+      ragel_throw_error(&state->ragel, "union has multiple fallback variants");
+      return;
+   }
+
+   for (uint8_t c = 0; !fallback && c < cases->count; ++c) {
+      if (c != cases->fallback && cases->key[c] == v) {
+         ragel_throw_error(&state->ragel, "duplicate case %" PRI_FSPEC_NUM, v);
+         return;
+      }
+   }
+
+   cases->fallback = (fallback ? cases->count : cases->fallback);
+   cases->key[cases->count++] = v;
+}
+
+static void
+state_union_case_name(struct state *state, const struct fspec_mem *name)
+{
+   assert(state && name);
+
+   if (!state->cases.has_enum) {
+      ragel_throw_error(&state->ragel, "case '%s' needs a selector of enum type", (char*)name->data);
+      return;
+   }
+
+   fspec_num v;
+   if (!get_constant(&state->out, state->cases.enum_id, name, &v)) {
+      ragel_throw_error(&state->ragel, "'%s' is not a constant of the selector's enum", (char*)name->data);
+      return;
+   }
+
+   state_union_case(state, v, false);
+}
+
+static void
+state_finish_union(struct state *state)
+{
+   assert(state);
+
+   struct cases *cases = &state->cases;
+   if (!cases->count) {
+      ragel_throw_error(&state->ragel, "union has no variants");
+      return;
+   }
+
+   const char *end = state->out.end[SECTION_CODE];
+   const enum fspec_op *decl = (void*)((char*)state->out.end[SECTION_DATA] + cases->decl);
+   const enum fspec_arg *len = fspec_op_get_arg(decl, end, 3, 1<<FSPEC_ARG_OFF);
+   const fspec_off tail = end - (char*)state->out.buf.mem.data;
+
+   cases->fallback = (cases->fallback == UINT8_MAX ? cases->count : cases->fallback);
+   codebuf_append_arg_num(&state->out, cases->fallback);
+   state_append_table(state, false);
+
+   // fallback and table belong to the switch before the variants
+   const fspec_off off = ((char*)decl + fspec_arg_get_num(len)) - (char*)state->out.buf.mem.data;
+   const fspec_off size = state->out.buf.written - tail;
+   membuf_move_tail(&state->out.buf, off, tail);
+   codebuf_replace_arg(&state->out, len, FSPEC_ARG_OFF, (fspec_off[]){ fspec_arg_get_num(len) + size });
+}
+
+static void
+state_start_enum(struct state *state, const struct fspec_mem *str)
+{
+   assert(state && str);
+   state_append_declaration(state, FSPEC_DECLARATION_ENUM, str);
+   memset(&state->cases, 0, sizeof(state->cases));
+   state->cases.fallback = UINT8_MAX;
+}
+
+static void
+state_enum_constant(struct state *state, const struct fspec_mem *str)
+{
+   assert(state && str);
+
+   struct cases *cases = &state->cases;
+   if (cases->count >= UINT8_MAX) {
+      ragel_throw_error(&state->ragel, "enum has more than %u constants", UINT8_MAX);
+      return;
+   }
+
+   // same strings share the offset
+   const fspec_off name = codebuf_append_cstr(&state->out, str->data, str->len);
+   for (uint8_t c = 0; c < cases->count; ++c) {
+      if (cases->name[c] == name) {
+         ragel_throw_error(&state->ragel, "'%s' redeclared", (char*)str->data);
+         return;
+      }
+   }
+
+   cases->name[cases->count] = name;
+   cases->key[cases->count++] = cases->next++;
+}
+
+static void
+state_enum_value(struct state *state, const fspec_num v)
+{
+   assert(state);
+
+   if (!state->cases.count)
+      return;
+
+   state->cases.key[state->cases.count - 1] = v;
+   state->cases.next = v + 1;
+}
+
+static void
+state_enum_read(struct state *state, const struct fspec_mem *str)
+{
+   assert(state && str);
+
+   const void *end = state->out.end[SECTION_CODE];
+   const enum fspec_op *decl = get_declaration(&state->out, false, str, &state->enum_id);
+   if (!decl || fspec_arg_get_num(fspec_op_get_arg(decl, end, 1, 1<<FSPEC_ARG_NUM)) != FSPEC_DECLARATION_ENUM) {
+      ragel_throw_error(&state->ragel, "'%s' is not an enum", (char*)str->data);
+      return;
+   }
+
+   // members of enum type are read with the size of the enum
+   const enum fspec_op *read = fspec_op_next(decl, end, true);
+   codebuf_append_op(&state->out, FSPEC_OP_READ);
+   codebuf_append_arg_num(&state->out, fspec_arg_get_num(fspec_op_get_arg(read, end, 1, 1<<FSPEC_ARG_NUM)));
+   state->enum_member = true;
+}
+
+static void
+state_finish_member(struct state *state)
+{
+   assert(state && state->out.decl[FSPEC_DECLARATION_MEMBER]);
+
+   const void *end = state->out.end[SECTION_CODE];
+   bool visual = false;
+   for (const enum fspec_op *op = state->out.decl[FSPEC_DECLARATION_MEMBER]; op; op = fspec_op_next(op, end, true))
+      visual = (visual || *op == FSPEC_OP_VISUAL);
+
+   // enum members are shown with the names of the constants, unless other visual is given
+   if (state->enum_member && !visual) {
+      codebuf_append_op(&state->out, FSPEC_OP_VISUAL);
+      codebuf_append_arg_num(&state->out, FSPEC_VISUAL_ENUM);
+      codebuf_append_arg(&state->out, FSPEC_ARG_VAR, &state->enum_id);
+   }
+
+   // unions selected by the member name their cases with the constants of its enum
+   if (state->enum_member && state->nenums >= ARRAY_SIZE(state->enums)) {
+      ragel_throw_error(&state->ragel, "struct has more than %u members of enum type", UINT8_MAX);
+   } else if (state->enum_member) {
+      const void *decl = state->out.decl[FSPEC_DECLARATION_MEMBER];
+      const fspec_var id = fspec_arg_get_num(fspec_op_get_arg(decl, state->out.end[SECTION_CODE], 2, 1<<FSPEC_ARG_NUM));
+      state->enums[state->nenums].member = id;
+      state->enums[state->nenums++].enum_id = state->enum_id;
+   }
+
+   state->enum_member = false;
+   state_finish_declaration(state, FSPEC_DECLARATION_MEMBER);
+}
+
+static void
+state_import(struct state *state, struct fspec_lexer *lexer, const struct fspec_mem *module)
+{
+   assert(state && lexer && module);
+
+   struct fspec_mem unit;
+   if (!lexer->ops.import) {
+      ragel_throw_error(&state->ragel, "imports are not supported");
+      return;
+   }
+
+   if (!lexer->ops.import(lexer, module->data, &unit)) {
+      ragel_throw_error(&state->ragel, "could not import '%s'", (char*)module->data);
+      return;
+   }
+
+   const void *end = (char*)unit.data + unit.len;
+   for (const enum fspec_op *op = unit.data; op; op = fspec_op_next(op, end, true)) {
+      const enum fspec_arg *arg;
+      if (*op != FSPEC_OP_DECLARATION || !(arg = fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) || fspec_arg_get_num(arg) != FSPEC_DECLARATION_STRUCT)
+         continue;
+
+      struct fspec_mem str;
+      fspec_arg_get_mem(fspec_op_get_arg(op, end, 4, 1<<FSPEC_ARG_STR), unit.data, &str);
+
+      // The output is sized for the spec itself, externs of the imports don't depend on it.
+      // Declaration with at most five arguments, and both strings if they are new.
+      codebuf_reserve(&state->out, 1 + 5 * (2 + sizeof(fspec_num)) + (str.len + 2) + (module->len + 2));
+      state_append_declaration(state, FSPEC_DECLARATION_EXTERN, &str);
+      codebuf_append_arg_cstr(&state->out, module->data, module->len);
+      state_finish_declaration(state, FSPEC_DECLARATION_EXTERN);
+   }
+}
+
 %%{
    machine fspec_lexer;
    variable p state.ragel.p;
@@ -369,7 +845,7 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
    }
 
    action arg_num {
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ stack_get_num(&state.stack) });
+      codebuf_append_arg_num(&state.out, stack_get_num(&state.stack));
    }
 
    action arg_str {
@@ -386,52 +862,39 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
    }
 
    action goto {
-      codebuf_append_op(&state.out, FSPEC_OP_GOTO);
-      state_append_arg_var(&state, false, stack_get_str(&state.stack));
+      state_goto(&state, stack_get_str(&state.stack));
    }
 
    action vnul {
       codebuf_append_op(&state.out, FSPEC_OP_VISUAL);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ FSPEC_VISUAL_NUL });
+      codebuf_append_arg_num(&state.out, FSPEC_VISUAL_NUL);
    }
 
    action vdec {
       codebuf_append_op(&state.out, FSPEC_OP_VISUAL);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ FSPEC_VISUAL_DEC });
+      codebuf_append_arg_num(&state.out, FSPEC_VISUAL_DEC);
    }
 
    action vhex {
       codebuf_append_op(&state.out, FSPEC_OP_VISUAL);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ FSPEC_VISUAL_HEX });
+      codebuf_append_arg_num(&state.out, FSPEC_VISUAL_HEX);
    }
 
    action vstr {
       codebuf_append_op(&state.out, FSPEC_OP_VISUAL);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ FSPEC_VISUAL_STR });
+      codebuf_append_arg_num(&state.out, FSPEC_VISUAL_STR);
    }
 
-   action r8 {
-      codebuf_append_op(&state.out, FSPEC_OP_READ);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ 8 });
+   action read {
+      state_append_read(&state, stack_get_num(&state.stack));
    }
 
-   action r16 {
-      codebuf_append_op(&state.out, FSPEC_OP_READ);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ 16 });
-   }
-
-   action r32 {
-      codebuf_append_op(&state.out, FSPEC_OP_READ);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ 32 });
-   }
-
-   action r64 {
-      codebuf_append_op(&state.out, FSPEC_OP_READ);
-      codebuf_append_arg(&state.out, FSPEC_ARG_NUM, (fspec_num[]){ 64 });
+   action enum_read {
+      state_enum_read(&state, stack_get_str(&state.stack));
    }
 
    action member_end {
-      state_finish_declaration(&state, FSPEC_DECLARATION_MEMBER);
+      state_finish_member(&state);
    }
 
    action member_start {
@@ -442,8 +905,54 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
       state_finish_declaration(&state, FSPEC_DECLARATION_STRUCT);
    }
 
+   action union_start {
+      state_append_declaration(&state, FSPEC_DECLARATION_MEMBER, stack_get_str(&state.stack));
+   }
+
+   action union_selector {
+      state_start_union(&state, stack_get_str(&state.stack));
+   }
+
+   action case_num {
+      state_union_case(&state, stack_get_num(&state.stack), false);
+   }
+
+   action case_name {
+      state_union_case_name(&state, stack_get_str(&state.stack));
+   }
+
+   action case_fallback {
+      state_union_case(&state, 0, true);
+   }
+
+   action union_end {
+      state_finish_union(&state);
+   }
+
+   action enum_start {
+      state_start_enum(&state, stack_get_str(&state.stack));
+   }
+
+   action enum_constant {
+      state_enum_constant(&state, stack_get_str(&state.stack));
+   }
+
+   action enum_value {
+      state_enum_value(&state, stack_get_num(&state.stack));
+   }
+
+   action enum_end {
+      state_append_table(&state, true);
+      state_finish_declaration(&state, FSPEC_DECLARATION_ENUM);
+   }
+
+   action import {
+      state_import(&state, lexer, stack_get_str(&state.stack));
+   }
+
    action struct_start {
       state_append_declaration(&state, FSPEC_DECLARATION_STRUCT, stack_get_str(&state.stack));
+      state.nenums = 0;
    }
 
    action stack_oct {
@@ -535,9 +1044,9 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
    dec = [\-+]? <: (([1-9] <: digit*) | '0');
    valid = ^cntrl;
    comment = '//' <: valid* :>> newline;
-   type = ('u8' | 's8') %r8 | ('u16' | 's16') %r16 | ('u32' | 's32') %r32 | ('u64' | 's64') %r64;
+   type = [us] <: (([1-9] <: digit*) >begin_num $store %stack_dec) %read;
    visual = 'nul' %vnul | 'dec' %vdec | 'hex' %vhex | 'str' %vstr;
-   reserved = 'struct' | type | visual;
+   reserved = 'struct' | 'union' | 'enum' | type | visual;
    name = ((alpha | '_') <: (alnum | '_')*) - reserved;
 
    # Stack
@@ -552,7 +1061,8 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
 
    # Catchers
    catch_struct = 'struct ' <: stack_name;
-   catch_type = (catch_struct %goto | type) $!type_err;
+   catch_enum = 'enum ' <: stack_name;
+   catch_type = (catch_struct %goto | catch_enum %enum_read | type) $!type_err;
    catch_args = stack_num %arg_num | stack_str %arg_str | stack_name %arg_var;
    catch_array = '[' <: (catch_args | '$' %arg_eof) :>> ']';
    catch_filter = ' | ' %filter <: stack_name %arg_str :>> ('(' <: catch_args? <: (', ' <: catch_args)* :>> ')')?;
@@ -560,9 +1070,15 @@ state_finish_declaration(struct state *state, const enum fspec_declaration decl)
 
    # Abstract
    member = stack_name %member_start :> ': ' <: (catch_type <: catch_array* catch_filter* catch_visual?) :>> ';' %member_end;
-   struct = catch_struct %struct_start :>> ' {' <: (space | comment | member)* :>> '};' %struct_end;
+   case = stack_num %case_num | stack_name %case_name | '*' %case_fallback;
+   variant = case :>> ' '+ :>> '=> ' <: member;
+   union = 'union ' <: stack_name %union_start :>> ' (' <: stack_name %union_selector :>> ') {' <: (space | comment | variant)* :>> '};' %union_end;
+   struct = catch_struct %struct_start :>> ' {' <: (space | comment | member | union)* :>> '};' %struct_end;
+   constant = stack_name %enum_constant (' = ' <: stack_num %enum_value)? :>> ';';
+   enum = catch_enum %enum_start :>> ': ' <: type :>> ' {' <: (space | comment | constant)* :>> '};' %enum_end;
+   import = 'import ' <: stack_str :>> ';' %import;
    line = valid* :>> newline %line;
-   main := ((space | comment | struct)* & line*) $!syntax_err;
+   main := ((space | comment | import | struct | enum)* & line*) $!syntax_err;
 }%%
 
 bool
@@ -587,7 +1103,7 @@ fspec_lexer_parse(struct fspec_lexer *lexer, const char *name)
       .out.buf.mem = lexer->mem.output,
    };
 
-   static const fspec_num version = 0;
+   static const fspec_num version = FSPEC_BCODE_VERSION;
    state.out.end[SECTION_CODE] = state.out.end[SECTION_DATA] = state.out.buf.mem.data;
    codebuf_append_op(&state.out, FSPEC_OP_HEADER);
    codebuf_append_arg(&state.out, FSPEC_ARG_NUM, &version);
@@ -611,6 +1127,6 @@ fspec_lexer_parse(struct fspec_lexer *lexer, const char *name)
       codebuf_replace_arg(&state.out, fspec_op_get_arg(state.out.buf.mem.data, end, 3, 1<<FSPEC_ARG_DAT), FSPEC_ARG_DAT, &off);
    }
 
-   lexer->mem.output.len = state.out.buf.written;
+   lexer->mem.output = (struct fspec_mem){ .data = state.out.buf.mem.data, .len = state.out.buf.written };
    return !state.ragel.error;
 }
@@ -0,0 +1,480 @@
+#include <fspec/linker.h>
+#include <fspec/bcode.h>
+#include "bcode-internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+struct outbuf {
+   struct fspec_mem mem;
+   fspec_off written;
+   bool overflow, compact;
+};
+
+static void
+outbuf_append(struct outbuf *buf, const void *data, const size_t data_sz)
+{
+   assert(buf && (data || !data_sz));
+
+   if (buf->overflow || buf->mem.len < data_sz || buf->written > buf->mem.len - data_sz) {
+      buf->overflow = true;
+      return;
+   }
+
+   memcpy((char*)buf->mem.data + buf->written, data, data_sz);
+   buf->written += data_sz;
+}
+
+static void
+outbuf_append_arg(struct outbuf *buf, const enum fspec_arg type, const void *data, const size_t data_sz)
+{
+   const uint8_t op[] = { FSPEC_OP_ARG, type };
+   outbuf_append(buf, op, sizeof(op));
+   outbuf_append(buf, data, data_sz);
+}
+
+static void
+outbuf_append_num(struct outbuf *buf, const fspec_num v)
+{
+   switch ((buf->compact ? fspec_arg_num_type(v) : FSPEC_ARG_NUM)) {
+      case FSPEC_ARG_NUM8:
+         outbuf_append_arg(buf, FSPEC_ARG_NUM8, (uint8_t[]){ v }, sizeof(uint8_t));
+         break;
+
+      case FSPEC_ARG_NUM16:
+         outbuf_append_arg(buf, FSPEC_ARG_NUM16, (uint16_t[]){ v }, sizeof(uint16_t));
+         break;
+
+      case FSPEC_ARG_NUM32:
+         outbuf_append_arg(buf, FSPEC_ARG_NUM32, (uint32_t[]){ v }, sizeof(uint32_t));
+         break;
+
+      default:
+         outbuf_append_arg(buf, FSPEC_ARG_NUM, &v, sizeof(v));
+         break;
+   }
+}
+
+static void
+outbuf_patch_declaration(struct outbuf *buf, const fspec_off start)
+{
+   assert(buf);
+
+   if (buf->overflow)
+      return;
+
+   const void *end = (char*)buf->mem.data + buf->written;
+   const enum fspec_arg *arg = fspec_op_get_arg((void*)((char*)buf->mem.data + start), end, 3, 1<<FSPEC_ARG_OFF);
+   const fspec_off off = buf->written - start;
+   memcpy((char*)arg + sizeof(*arg), &off, sizeof(off));
+}
+
+struct import {
+   const char *module;
+   size_t unit;
+};
+
+enum unit_state {
+   UNIT_NEW,
+   UNIT_VISITING,
+   UNIT_DONE,
+};
+
+struct unit {
+   struct fspec_mem mem, strings;
+   struct import *imports;
+   fspec_var *ids; // unit declaration -> linked declaration
+   fspec_num version, declarations;
+   fspec_off base; // strings offset in the linked data section
+   size_t nimports;
+   enum unit_state state;
+};
+
+struct state {
+   struct unit *units;
+   size_t *order, nunits, norder;
+   fspec_num declarations, version;
+};
+
+static const void*
+unit_end(const struct unit *unit)
+{
+   return (char*)unit->mem.data + unit->mem.len;
+}
+
+static const enum fspec_op*
+unit_first_op(const struct unit *unit)
+{
+   const enum fspec_op *op = unit->mem.data;
+   assert(*op == FSPEC_OP_HEADER);
+   return fspec_op_next(op, unit_end(unit), true);
+}
+
+static enum fspec_declaration
+declaration_type(const enum fspec_op *op, const void *end)
+{
+   return fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM));
+}
+
+static fspec_num
+declaration_id(const enum fspec_op *op, const void *end)
+{
+   return fspec_arg_get_num(fspec_op_get_arg(op, end, 2, 1<<FSPEC_ARG_NUM));
+}
+
+static const void*
+declaration_end(const enum fspec_op *op, const void *end)
+{
+   const enum fspec_arg *arg = fspec_op_get_arg(op, end, 3, 1<<FSPEC_ARG_OFF);
+   return (char*)op + fspec_arg_get_num(arg);
+}
+
+static const void*
+op_end(const enum fspec_op *op, const void *end)
+{
+   const enum fspec_op *next = fspec_op_next(op, end, false);
+   return (next ? (const void*)next : end);
+}
+
+static size_t
+state_add_unit(struct state *st, const struct fspec_mem *mem)
+{
+   assert(st && mem);
+
+   for (size_t i = 0; i < st->nunits; ++i) {
+      if (st->units[i].mem.data == mem->data)
+         return i;
+   }
+
+   if (!(st->units = realloc(st->units, sizeof(*st->units) * (st->nunits + 1))))
+      err(EXIT_FAILURE, "realloc(%zu)", sizeof(*st->units) * (st->nunits + 1));
+
+   struct unit *unit = &st->units[st->nunits];
+   *unit = (struct unit){ .mem = *mem };
+
+   const void *end = unit_end(unit);
+   unit->version = fspec_arg_get_num(fspec_op_get_arg(mem->data, end, 1, 1<<FSPEC_ARG_NUM));
+   unit->declarations = fspec_arg_get_num(fspec_op_get_arg(mem->data, end, 2, 1<<FSPEC_ARG_NUM));
+   fspec_arg_get_mem(fspec_op_get_arg(mem->data, end, 3, 1<<FSPEC_ARG_DAT), NULL, &unit->strings);
+
+   if (!(unit->ids = calloc(unit->declarations, sizeof(*unit->ids))) && unit->declarations)
+      err(EXIT_FAILURE, "calloc(%" PRI_FSPEC_NUM ", %zu)", unit->declarations, sizeof(*unit->ids));
+
+   return st->nunits++;
+}
+
+static struct import*
+unit_get_import(const struct unit *unit, const char *module)
+{
+   for (size_t i = 0; i < unit->nimports; ++i) {
+      if (!strcmp(unit->imports[i].module, module))
+         return &unit->imports[i];
+   }
+   return NULL;
+}
+
+static bool
+gather(struct fspec_linker *linker, struct state *st, const size_t index, const char *name)
+{
+   assert(linker && st && index < st->nunits);
+
+   st->units[index].state = UNIT_VISITING;
+
+   const void *end = unit_end(&st->units[index]);
+   for (const enum fspec_op *op = unit_first_op(&st->units[index]); op; op = fspec_op_next(op, end, true)) {
+      if (*op != FSPEC_OP_DECLARATION || declaration_type(op, end) != FSPEC_DECLARATION_EXTERN)
+         continue;
+
+      const char *module = fspec_arg_get_cstr(fspec_op_get_arg(op, end, 5, 1<<FSPEC_ARG_STR), st->units[index].mem.data);
+      if (unit_get_import(&st->units[index], module))
+         continue;
+
+      struct fspec_mem mem;
+      if (!linker->ops.import || !linker->ops.import(linker, &st->units[index].mem, module, &mem)) {
+         warnx("%s: could not import '%s'", name, module);
+         return false;
+      }
+
+      // st->units may move
+      const size_t imported = state_add_unit(st, &mem);
+      struct unit *unit = &st->units[index];
+
+      if (!(unit->imports = realloc(unit->imports, sizeof(*unit->imports) * (unit->nimports + 1))))
+         err(EXIT_FAILURE, "realloc(%zu)", sizeof(*unit->imports) * (unit->nimports + 1));
+
+      unit->imports[unit->nimports++] = (struct import){ .module = module, .unit = imported };
+
+      if (st->units[imported].state == UNIT_VISITING) {
+         warnx("%s: import cycle through '%s'", name, module);
+         return false;
+      }
+
+      if (st->units[imported].state == UNIT_NEW && !gather(linker, st, imported, module))
+         return false;
+   }
+
+   if (!(st->order = realloc(st->order, sizeof(*st->order) * (st->norder + 1))))
+      err(EXIT_FAILURE, "realloc(%zu)", sizeof(*st->order) * (st->norder + 1));
+
+   st->order[st->norder++] = index;
+   st->units[index].state = UNIT_DONE;
+   return true;
+}
+
+// Externs of cached units may be stale, so only the referenced ones must resolve.
+#define UNRESOLVED ((fspec_var)~0)
+
+static void
+resolve_extern(struct state *st, struct unit *unit, const enum fspec_op *decl)
+{
+   assert(st && unit && decl);
+
+   const void *end = unit_end(unit);
+   const char *sym = fspec_arg_get_cstr(fspec_op_get_arg(decl, end, 4, 1<<FSPEC_ARG_STR), unit->mem.data);
+   const char *module = fspec_arg_get_cstr(fspec_op_get_arg(decl, end, 5, 1<<FSPEC_ARG_STR), unit->mem.data);
+   const struct import *import = unit_get_import(unit, module);
+   assert(import);
+
+   const struct unit *target = &st->units[import->unit];
+   const void *target_end = unit_end(target);
+   for (const enum fspec_op *op = unit_first_op(target); op; op = fspec_op_next(op, target_end, true)) {
+      if (*op != FSPEC_OP_DECLARATION || declaration_type(op, target_end) != FSPEC_DECLARATION_STRUCT)
+         continue;
+
+      if (strcmp(sym, fspec_arg_get_cstr(fspec_op_get_arg(op, target_end, 4, 1<<FSPEC_ARG_STR), target->mem.data)))
+         continue;
+
+      unit->ids[declaration_id(decl, end)] = target->ids[declaration_id(op, target_end)];
+      return;
+   }
+
+   unit->ids[declaration_id(decl, end)] = UNRESOLVED;
+}
+
+static bool
+check_references(const struct unit *unit, const char *name)
+{
+   assert(unit);
+
+   const void *end = unit_end(unit);
+   for (const enum fspec_op *op = unit_first_op(unit); op; op = fspec_op_next(op, end, true)) {
+      if (*op != FSPEC_OP_GOTO)
+         continue;
+
+      const fspec_num id = fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_VAR));
+      if (unit->ids[id] != UNRESOLVED)
+         continue;
+
+      for (const enum fspec_op *decl = unit_first_op(unit); decl; decl = fspec_op_next(decl, end, true)) {
+         if (*decl != FSPEC_OP_DECLARATION || declaration_id(decl, end) != id)
+            continue;
+
+         const char *sym = fspec_arg_get_cstr(fspec_op_get_arg(decl, end, 4, 1<<FSPEC_ARG_STR), unit->mem.data);
+         const char *module = fspec_arg_get_cstr(fspec_op_get_arg(decl, end, 5, 1<<FSPEC_ARG_STR), unit->mem.data);
+         warnx("%s: '%s' is not declared in '%s'", name, sym, module);
+         break;
+      }
+
+      return false;
+   }
+
+   return true;
+}
+
+static bool
+assign_ids(struct state *st, struct unit *unit, const char *name)
+{
+   assert(st && unit);
+
+   const void *end = unit_end(unit);
+   for (const enum fspec_op *op = unit_first_op(unit); op; op = fspec_op_next(op, end, true)) {
+      if (*op != FSPEC_OP_DECLARATION)
+         continue;
+
+      if (declaration_type(op, end) == FSPEC_DECLARATION_EXTERN) {
+         resolve_extern(st, unit, op);
+         continue;
+      }
+
+      if (st->declarations >= (fspec_var)~0) {
+         warnx("%s: linked declarations overflows", name);
+         return false;
+      }
+
+      unit->ids[declaration_id(op, end)] = st->declarations++;
+   }
+
+   return check_references(unit, name);
+}
+
+static void
+append_op(struct outbuf *buf, const struct unit *unit, const fspec_off strings, const enum fspec_op *op, const void *end)
+{
+   assert(buf && unit && op && end);
+
+   outbuf_append(buf, op, sizeof(*op));
+
+   uint8_t nth = 0;
+   for (const enum fspec_arg *arg = fspec_op_get_arg(op, end, 1, ~0); arg; arg = fspec_arg_next(arg, end, 1, ~0)) {
+      ++nth;
+
+      if (*op == FSPEC_OP_DECLARATION && nth == 2) {
+         outbuf_append_num(buf, unit->ids[fspec_arg_get_num(arg)]);
+         continue;
+      }
+
+      switch (*arg) {
+         case FSPEC_ARG_VAR:
+            {
+               const fspec_var var = unit->ids[fspec_arg_get_num(arg)];
+               outbuf_append_arg(buf, FSPEC_ARG_VAR, &var, sizeof(var));
+            }
+            break;
+
+         case FSPEC_ARG_STR:
+            {
+               fspec_off off;
+               memcpy(&off, (char*)arg + sizeof(*arg), sizeof(off));
+               off = strings + unit->base + (off - (fspec_off)((char*)unit->strings.data - (char*)unit->mem.data));
+               outbuf_append_arg(buf, FSPEC_ARG_STR, &off, sizeof(off));
+            }
+            break;
+
+         default:
+            outbuf_append(buf, arg - 1, (char*)op_end((void*)(arg - 1), end) - (char*)(arg - 1));
+            break;
+      }
+   }
+}
+
+static void
+append_member(struct outbuf *buf, const struct unit *unit, const fspec_off strings, const enum fspec_op *member, const void *end)
+{
+   assert(buf && unit && member && end);
+
+   const fspec_off start = buf->written;
+   for (const enum fspec_op *op = member; op; op = fspec_op_next(op, end, true))
+      append_op(buf, unit, strings, op, end);
+
+   outbuf_patch_declaration(buf, start);
+}
+
+static void
+append_struct(struct outbuf *buf, const struct unit *unit, const fspec_off strings, const enum fspec_op *decl, const void *end)
+{
+   assert(buf && unit && decl && end);
+
+   const fspec_off start = buf->written;
+   append_op(buf, unit, strings, decl, end);
+
+   for (const enum fspec_op *op = fspec_op_next(decl, end, true); op && (void*)op < end;) {
+      if (*op != FSPEC_OP_DECLARATION) {
+         append_op(buf, unit, strings, op, end);
+         op = fspec_op_next(op, end, true);
+         continue;
+      }
+
+      const void *member_end = declaration_end(op, end);
+      append_member(buf, unit, strings, op, member_end);
+      op = ((void*)member_end < end ? member_end : NULL);
+   }
+
+   outbuf_patch_declaration(buf, start);
+}
+
+static void
+append_unit(struct outbuf *buf, const struct unit *unit, const fspec_off strings)
+{
+   assert(buf && unit);
+
+   const void *end = unit_end(unit);
+   for (const enum fspec_op *op = unit_first_op(unit); op;) {
+      if (*op != FSPEC_OP_DECLARATION) {
+         append_op(buf, unit, strings, op, end);
+         op = fspec_op_next(op, end, true);
+         continue;
+      }
+
+      const void *struct_end = declaration_end(op, end);
+      if (declaration_type(op, end) != FSPEC_DECLARATION_EXTERN)
+         append_struct(buf, unit, strings, op, struct_end);
+
+      op = ((void*)struct_end < end ? struct_end : NULL);
+   }
+}
+
+static bool
+link_units(struct state *st, struct outbuf *buf, const char *name)
+{
+   assert(st && buf);
+
+   fspec_off strings_len = 0;
+   for (size_t i = 0; i < st->norder; ++i) {
+      struct unit *unit = &st->units[st->order[i]];
+
+      if (!assign_ids(st, unit, name))
+         return false;
+
+      if (unit->strings.len > (fspec_off)~0 - strings_len) {
+         warnx("%s: linked data section length overflows", name);
+         return false;
+      }
+
+      unit->base = strings_len;
+      strings_len += unit->strings.len;
+      st->version = (unit->version > st->version ? unit->version : st->version);
+   }
+
+   // Header numbers are never compact, so the version can be read before anything else.
+   const uint8_t header = FSPEC_OP_HEADER;
+   outbuf_append(buf, &header, sizeof(header));
+   outbuf_append_num(buf, st->version);
+   outbuf_append_num(buf, st->declarations);
+   outbuf_append_arg(buf, FSPEC_ARG_DAT, &strings_len, sizeof(strings_len));
+
+   const fspec_off strings = buf->written;
+   for (size_t i = 0; i < st->norder; ++i) {
+      const struct unit *unit = &st->units[st->order[i]];
+      outbuf_append(buf, unit->strings.data, unit->strings.len);
+   }
+
+   buf->compact = (st->version >= 1);
+   for (size_t i = 0; i < st->norder; ++i)
+      append_unit(buf, &st->units[st->order[i]], strings);
+
+   return true;
+}
+
+bool
+fspec_linker_link(struct fspec_linker *linker, const char *name)
+{
+   assert(linker);
+   assert(linker->mem.input.data && linker->mem.input.len);
+   assert(linker->mem.output.data && linker->mem.output.len);
+   assert(linker->mem.input.data != linker->mem.output.data);
+
+   struct state st = {0};
+   struct outbuf buf = { .mem = linker->mem.output };
+   const bool linked = gather(linker, &st, state_add_unit(&st, &linker->mem.input), name) && link_units(&st, &buf, name);
+
+   for (size_t i = 0; i < st.nunits; ++i) {
+      free(st.units[i].imports);
+      free(st.units[i].ids);
+   }
+
+   free(st.units);
+   free(st.order);
+
+   if (!linked)
+      return false;
+
+   if (buf.overflow) {
+      warnx("%s: linked bytecode exceeds the maximum storage size of %zu bytes", name, buf.mem.len);
+      return false;
+   }
+
+   linker->mem.output.len = buf.written;
+   return true;
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include <fspec/memory.h>
+
+#include <stdbool.h>
+
+/**
+ * links validated bytecode units into single bytecode:
+ * - units imported by the input unit are requested through ops.import,
+ *   module is the import path as written in the importing unit
+ * - the same unit data must be returned for the same module,
+ *   it is only linked once
+ * - externs are resolved to the structs of the imported units
+ * - the input unit is linked last, so its last struct stays as the root
+ */
+struct fspec_linker;
+struct fspec_linker {
+   struct {
+      bool (*import)(struct fspec_linker *linker, const struct fspec_mem *unit, const char *module, struct fspec_mem *out_unit);
+   } ops;
+
+   struct {
+      struct fspec_mem input, output;
+   } mem;
+};
+
+bool
+fspec_linker_link(struct fspec_linker *linker, const char *name);
@@ -0,0 +1,401 @@
+#include <fspec/optimizer.h>
+#include <fspec/bcode.h>
+#include "bcode-internal.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+struct outbuf {
+   struct fspec_mem mem;
+   fspec_off written;
+   bool overflow, compact;
+};
+
+struct liveness {
+   const void *data;
+   bool *referenced; // declaration is used as array size or filter argument
+};
+
+static void
+outbuf_append(struct outbuf *buf, const void *data, const size_t data_sz)
+{
+   assert(buf && (data || !data_sz));
+
+   if (buf->overflow || buf->mem.len < data_sz || buf->written > buf->mem.len - data_sz) {
+      buf->overflow = true;
+      return;
+   }
+
+   memcpy((char*)buf->mem.data + buf->written, data, data_sz);
+   buf->written += data_sz;
+}
+
+static void
+outbuf_append_num(struct outbuf *buf, const fspec_num v)
+{
+   const enum fspec_arg type = (buf->compact ? fspec_arg_num_type(v) : FSPEC_ARG_NUM);
+   const uint8_t op[] = { FSPEC_OP_ARG, type };
+   outbuf_append(buf, op, sizeof(op));
+
+   switch (type) {
+      case FSPEC_ARG_NUM8:
+         outbuf_append(buf, (uint8_t[]){ v }, sizeof(uint8_t));
+         break;
+
+      case FSPEC_ARG_NUM16:
+         outbuf_append(buf, (uint16_t[]){ v }, sizeof(uint16_t));
+         break;
+
+      case FSPEC_ARG_NUM32:
+         outbuf_append(buf, (uint32_t[]){ v }, sizeof(uint32_t));
+         break;
+
+      default:
+         outbuf_append(buf, &v, sizeof(v));
+         break;
+   }
+}
+
+static void
+outbuf_patch_declaration(struct outbuf *buf, const fspec_off start)
+{
+   assert(buf);
+
+   if (buf->overflow)
+      return;
+
+   const void *end = (char*)buf->mem.data + buf->written;
+   const enum fspec_arg *arg = fspec_op_get_arg((void*)((char*)buf->mem.data + start), end, 3, 1<<FSPEC_ARG_OFF);
+   const fspec_off off = buf->written - start;
+   memcpy((char*)arg + sizeof(*arg), &off, sizeof(off));
+}
+
+static const void*
+op_end(const enum fspec_op *op, const void *end)
+{
+   const enum fspec_op *next = fspec_op_next(op, end, true);
+   return (next ? (const void*)next : end);
+}
+
+static const void*
+declaration_end(const enum fspec_op *op, const void *end)
+{
+   const enum fspec_arg *arg = fspec_op_get_arg(op, end, 3, 1<<FSPEC_ARG_OFF);
+   return (char*)op + fspec_arg_get_num(arg);
+}
+
+static bool
+get_constant_count(const enum fspec_arg *arg, const void *end, fspec_num *out_nmemb)
+{
+   assert(arg && out_nmemb);
+
+   *out_nmemb = 1;
+   for (const enum fspec_arg *var = arg; (var = fspec_arg_next(var, end, 1, ~0));) {
+      if (fspec_arg_get_type(var) != FSPEC_ARG_NUM)
+         return false;
+
+      const fspec_num v = fspec_arg_get_num(var);
+      if (v && *out_nmemb > (fspec_num)~0 / v)
+         return false;
+
+      *out_nmemb *= v;
+   }
+
+   return true;
+}
+
+static void
+mark_references(const enum fspec_op *start, const void *end, bool *referenced)
+{
+   assert(start && end && referenced);
+
+   for (const enum fspec_op *op = start; op; op = fspec_op_next(op, end, true)) {
+      if (*op != FSPEC_OP_READ && *op != FSPEC_OP_GOTO && *op != FSPEC_OP_FILTER && *op != FSPEC_OP_SWITCH)
+         continue;
+
+      // first argument of goto is the struct, the value of the struct is never used
+      const enum fspec_arg *arg = fspec_op_get_arg(op, end, 1, ~0);
+      for (arg = (*op == FSPEC_OP_GOTO ? fspec_arg_next(arg, end, 1, ~0) : arg); arg; arg = fspec_arg_next(arg, end, 1, ~0)) {
+         if (*arg == FSPEC_ARG_VAR)
+            referenced[fspec_arg_get_num(arg)] = true;
+      }
+   }
+}
+
+static bool
+has_bit_fields(const enum fspec_op *start, const void *end)
+{
+   assert(start && end);
+
+   for (const enum fspec_op *op = start; op; op = fspec_op_next(op, end, true)) {
+      if (*op == FSPEC_OP_READ && fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) % 8)
+         return true;
+   }
+
+   return false;
+}
+
+static bool
+filter_is_pure(const enum fspec_op *op, const void *end, const void *data)
+{
+   // filters that only transform the value of their own member
+   static const char *pure[] = { "encoding", "compression" };
+
+   const char *name = fspec_arg_get_cstr(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_STR), data);
+   for (size_t i = 0; i < sizeof(pure) / sizeof(pure[0]); ++i) {
+      if (!strcmp(name, pure[i]))
+         return true;
+   }
+
+   return false;
+}
+
+static bool
+member_is_dead(const enum fspec_op *member, const void *end, const struct liveness *live)
+{
+   assert(member && end && live);
+
+   if (live->referenced[fspec_arg_get_num(fspec_op_get_arg(member, end, 2, 1<<FSPEC_ARG_NUM))])
+      return false;
+
+   bool nul = false;
+   for (const enum fspec_op *op = fspec_op_next(member, end, true); op; op = fspec_op_next(op, end, true)) {
+      switch (*op) {
+         case FSPEC_OP_GOTO:
+            return false;
+
+         case FSPEC_OP_FILTER:
+            if (!filter_is_pure(op, end, live->data))
+               return false;
+            break;
+
+         case FSPEC_OP_VISUAL:
+            nul = (fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) == FSPEC_VISUAL_NUL);
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   return nul;
+}
+
+static bool
+member_block_size(const enum fspec_op *member, const void *end, fspec_num *out_size)
+{
+   assert(member && out_size);
+
+   const enum fspec_op *op;
+   if (!(op = fspec_op_next(member, end, true)) || *op != FSPEC_OP_READ)
+      return false;
+
+   const enum fspec_arg *arg = fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM);
+   const fspec_num bits = fspec_arg_get_num(arg);
+
+   fspec_num nmemb;
+   if (bits % 8 || !get_constant_count(arg, end, &nmemb) || (nmemb && bits / 8 > (fspec_num)~0 / nmemb))
+      return false;
+
+   *out_size = bits / 8 * nmemb;
+   return true;
+}
+
+static fspec_num
+get_run(const enum fspec_op *member, const void *struct_end, const struct liveness *live, fspec_num *out_size)
+{
+   assert(member && struct_end && out_size);
+
+   fspec_num count = 0;
+   *out_size = 0;
+   for (const enum fspec_op *op = member; op && (void*)op < struct_end;) {
+      if (*op == FSPEC_OP_BLOCK) {
+         op = fspec_op_next(op, struct_end, true);
+         continue;
+      }
+
+      if (*op != FSPEC_OP_DECLARATION)
+         break;
+
+      fspec_num size;
+      const void *end = declaration_end(op, struct_end);
+      // dead members are skipped, reading them as part of a block would defeat that
+      if (member_is_dead(op, end, live) || !member_block_size(op, end, &size) || size > (fspec_num)~0 - *out_size)
+         break;
+
+      *out_size += size;
+      ++count;
+      op = end;
+   }
+
+   return count;
+}
+
+static fspec_num
+get_variants(const enum fspec_op *member, const void *end)
+{
+   assert(member);
+
+   const enum fspec_op *op;
+   if (!(op = fspec_op_next(member, end, true)) || *op != FSPEC_OP_SWITCH)
+      return 0;
+
+   return fspec_arg_get_num(fspec_op_get_arg(fspec_op_next(op, end, true), end, 1, 1<<FSPEC_ARG_NUM));
+}
+
+static void
+append_folded(struct outbuf *buf, const enum fspec_op *op, const void *end)
+{
+   assert(buf && op && end);
+
+   // first argument is the read size or the struct, rest are dimensions
+   const enum fspec_arg *arg = fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR);
+   const void *dims = fspec_arg_next(arg, end, 1, ~0);
+
+   fspec_num nmemb;
+   if (!dims || !get_constant_count(arg, end, &nmemb)) {
+      outbuf_append(buf, op, (char*)op_end(op, end) - (char*)op);
+      return;
+   }
+
+   // dimensions multiply in dump, gen, the decoder and the cursor alike, so u8[2][4] is u8[8] and u8[1] is u8
+   outbuf_append(buf, op, (char*)dims - 1 - (char*)op);
+
+   if (nmemb != 1)
+      outbuf_append_num(buf, nmemb);
+}
+
+static void
+append_member(struct outbuf *buf, const enum fspec_op *member, const void *end, const struct liveness *live)
+{
+   assert(buf && member && end && live);
+
+   const fspec_off start = buf->written;
+   outbuf_append(buf, member, (char*)op_end(member, end) - (char*)member);
+
+   if (member_is_dead(member, end, live)) {
+      const uint8_t skip = FSPEC_OP_SKIP;
+      outbuf_append(buf, &skip, sizeof(skip));
+   }
+
+   for (const enum fspec_op *op = fspec_op_next(member, end, true); op; op = fspec_op_next(op, end, true)) {
+      switch (*op) {
+         case FSPEC_OP_READ:
+         case FSPEC_OP_GOTO:
+            append_folded(buf, op, end);
+            break;
+
+         // previous skips are recomputed
+         case FSPEC_OP_SKIP:
+            break;
+
+         default:
+            outbuf_append(buf, op, (char*)op_end(op, end) - (char*)op);
+            break;
+      }
+   }
+
+   outbuf_patch_declaration(buf, start);
+}
+
+static void
+append_struct(struct outbuf *buf, const enum fspec_op *decl, const void *end, const struct liveness *live, const bool blocks)
+{
+   assert(buf && decl && end && live);
+
+   const fspec_off start = buf->written;
+   outbuf_append(buf, decl, (char*)op_end(decl, end) - (char*)decl);
+
+   fspec_num in_block = 0, variants = 0;
+   for (const enum fspec_op *op = fspec_op_next(decl, end, true); op && (void*)op < end;) {
+      if (*op != FSPEC_OP_DECLARATION) {
+         // previous blocks are recomputed
+         op = fspec_op_next(op, end, true);
+         continue;
+      }
+
+      // only one variant of an union is read, they can't be read as a block
+      fspec_num size, count;
+      if (blocks && !in_block && !variants && (count = get_run(op, end, live, &size)) > 1) {
+         const uint8_t block = FSPEC_OP_BLOCK;
+         outbuf_append(buf, &block, sizeof(block));
+         outbuf_append_num(buf, size);
+         outbuf_append_num(buf, count);
+         in_block = count;
+      }
+
+      in_block -= (in_block > 0);
+      const void *member_end = declaration_end(op, end);
+      variants = (variants ? variants - 1 : get_variants(op, member_end));
+      append_member(buf, op, member_end, live);
+      op = ((void*)member_end < end ? member_end : NULL);
+   }
+
+   outbuf_patch_declaration(buf, start);
+}
+
+bool
+fspec_optimizer_optimize(struct fspec_optimizer *optimizer, const char *name)
+{
+   assert(optimizer);
+   assert(optimizer->mem.input.data && optimizer->mem.input.len);
+   assert(optimizer->mem.output.data && optimizer->mem.output.len);
+   assert(optimizer->mem.input.data != optimizer->mem.output.data);
+
+   const enum fspec_op *start = optimizer->mem.input.data;
+   const void *end = (char*)start + optimizer->mem.input.len;
+   struct outbuf buf = { .mem = optimizer->mem.output };
+
+   const fspec_num declarations = fspec_arg_get_num(fspec_op_get_arg(start, end, 2, 1<<FSPEC_ARG_NUM));
+   struct liveness live = { .data = start };
+   if (!(live.referenced = calloc(declarations, sizeof(*live.referenced))) && declarations)
+      err(EXIT_FAILURE, "calloc(%" PRI_FSPEC_NUM ", %zu)", declarations, sizeof(*live.referenced));
+
+   mark_references(start, end, live.referenced);
+
+   // Blocks are read at byte boundaries, bit fields anywhere before them can leave the input unaligned.
+   const bool blocks = !has_bit_fields(start, end);
+
+   // Compact numbers are only valid since version 1.
+   buf.compact = (fspec_arg_get_num(fspec_op_get_arg(start, end, 1, 1<<FSPEC_ARG_NUM)) >= 1);
+
+   // Header contains the strings, copying it as is keeps the string offsets valid.
+   const enum fspec_op *op = fspec_op_next(start, end, true);
+   outbuf_append(&buf, start, (char*)(op ? (const void*)op : end) - (char*)start);
+
+   // Output has blocks and skips of the current version, versions only add to the previous ones.
+   // Header numbers are never compact, so the version is patched in place.
+   if (!buf.overflow) {
+      const enum fspec_arg *arg = fspec_op_get_arg(buf.mem.data, (char*)buf.mem.data + buf.written, 1, 1<<FSPEC_ARG_NUM);
+      memcpy((char*)arg + sizeof(*arg), (fspec_num[]){ FSPEC_BCODE_VERSION }, sizeof(fspec_num));
+   }
+
+   while (op) {
+      if (*op != FSPEC_OP_DECLARATION) {
+         outbuf_append(&buf, op, (char*)op_end(op, end) - (char*)op);
+         op = fspec_op_next(op, end, true);
+         continue;
+      }
+
+      // only structs have members to optimize
+      const void *struct_end = declaration_end(op, end);
+      if (fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) != FSPEC_DECLARATION_STRUCT) {
+         outbuf_append(&buf, op, (char*)struct_end - (char*)op);
+      } else {
+         append_struct(&buf, op, struct_end, &live, blocks);
+      }
+      op = ((void*)struct_end < end ? struct_end : NULL);
+   }
+
+   free(live.referenced);
+
+   if (buf.overflow) {
+      warnx("%s: optimized bytecode exceeds the maximum storage size of %zu bytes", name, buf.mem.len);
+      return false;
+   }
+
+   optimizer->mem.output.len = buf.written;
+   return true;
+}
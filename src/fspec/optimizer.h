@@ -0,0 +1,22 @@
+#pragma once
+
+#include <fspec/memory.h>
+
+#include <stdbool.h>
+
+/**
+ * rewrites validated bytecode:
+ * - constant array sizes are folded into single size
+ * - runs of constant size members are prefixed with FSPEC_OP_BLOCK,
+ *   so they can be read at once and sliced afterwards, unless there are bit fields
+ * - members with nul visual, that are not referenced and have only pure filters
+ *   are prefixed with FSPEC_OP_SKIP, so their values don't need to be stored
+ */
+struct fspec_optimizer {
+   struct {
+      struct fspec_mem input, output;
+   } mem;
+};
+
+bool
+fspec_optimizer_optimize(struct fspec_optimizer *optimizer, const char *name);
@@ -23,8 +23,11 @@ struct range {
 struct context {
    struct range data;
    fspec_var declarations, expected_declarations;
-   fspec_off str_end, decl_start, decl_end[FSPEC_DECLARATION_LAST], offset;
-   enum fspec_declaration last_decl_type;
+   fspec_off str_end, table_end, decl_start, decl_end[FSPEC_DECLARATION_LAST], offset;
+   fspec_num version, cases, names, fallback, variants;
+   enum fspec_declaration last_decl_type, struct_type;
+   enum fspec_visual visual;
+   bool module, variant, values;
 };
 
 struct state {
@@ -40,6 +43,41 @@ struct state {
    variable eof state.ragel.eof;
    write data noerror nofinal;
 
+   action store_version {
+      if (state.stack.u.num > FSPEC_BCODE_VERSION)
+         ragel_throw_error(&state.ragel, "unsupported bytecode version: %" PRI_FSPEC_NUM, state.stack.u.num);
+
+      state.context.version = state.stack.u.num;
+   }
+
+   action check_compact {
+      if (state.context.version < 1)
+         ragel_throw_error(&state.ragel, "compact numbers require bytecode version 1");
+   }
+
+   action check_table_version {
+      if (state.context.version < 2)
+         ragel_throw_error(&state.ragel, "tables require bytecode version 2");
+   }
+
+   action check_read_size {
+      if (!state.stack.u.num || state.stack.u.num > 64)
+         ragel_throw_error(&state.ragel, "invalid read size: %" PRI_FSPEC_NUM, state.stack.u.num);
+
+      if (state.stack.u.num % 8 && state.context.version < 3)
+         ragel_throw_error(&state.ragel, "bit fields require bytecode version 3");
+   }
+
+   action check_block_version {
+      if (state.context.version < 4)
+         ragel_throw_error(&state.ragel, "blocks require bytecode version 4");
+   }
+
+   action check_skip_version {
+      if (state.context.version < 4)
+         ragel_throw_error(&state.ragel, "skips require bytecode version 4");
+   }
+
    action store_decls {
       if (state.stack.u.num > (fspec_var)~0)
          ragel_throw_error(&state.ragel, "expected declarations overflows");
@@ -77,6 +115,33 @@ struct state {
       state.context.offset < state.context.str_end
    }
 
+   action mark_table {
+      if (state.context.cases > (fspec_off)~0 / sizeof(fspec_num) || state.stack.u.off <= state.context.cases * sizeof(fspec_num))
+         ragel_throw_error(&state.ragel, "table has no slots for %" PRI_FSPEC_NUM " cases", state.context.cases);
+
+      if (state.context.offset > (fspec_off)~0 - state.stack.u.off)
+         ragel_throw_error(&state.ragel, "table length overflows");
+
+      state.context.table_end = state.context.offset + state.stack.u.off;
+   }
+
+   action test_inside_table {
+      state.context.offset < state.context.table_end
+   }
+
+   action store_cases {
+      state.context.cases = state.stack.u.num;
+      state.context.names = 0;
+   }
+
+   action count_name {
+      ++state.context.names;
+   }
+
+   action store_fallback {
+      state.context.fallback = state.stack.u.num;
+   }
+
    action check_var {
       if (state.context.declarations <= state.stack.u.var)
          ragel_throw_error(&state.ragel, "refenced undeclared variable");
@@ -109,6 +174,14 @@ struct state {
 
    action start_decl {
       state.context.decl_start = state.context.offset;
+      state.context.module = false;
+   }
+
+   action mark_module {
+      if (state.context.last_decl_type != FSPEC_DECLARATION_EXTERN)
+         ragel_throw_error(&state.ragel, "module for non extern declaration");
+
+      state.context.module = true;
    }
 
    action mark_decl {
@@ -122,13 +195,54 @@ struct state {
    }
 
    action check_struct {
-      if (state.context.last_decl_type != FSPEC_DECLARATION_STRUCT)
+      if (state.context.last_decl_type == FSPEC_DECLARATION_MEMBER)
          ragel_throw_error(&state.ragel, "expected struct declaration");
+
+      if (state.context.last_decl_type == FSPEC_DECLARATION_EXTERN && !state.context.module)
+         ragel_throw_error(&state.ragel, "expected module for extern declaration");
+
+      if (state.context.variants)
+         ragel_throw_error(&state.ragel, "union is missing %" PRI_FSPEC_NUM " variants", state.context.variants);
+
+      if (state.context.struct_type == FSPEC_DECLARATION_ENUM && !state.context.values)
+         ragel_throw_error(&state.ragel, "enum declaration without values");
+
+      state.context.struct_type = state.context.last_decl_type;
+      state.context.values = false;
    }
 
    action check_member {
       if (state.context.last_decl_type != FSPEC_DECLARATION_MEMBER)
          ragel_throw_error(&state.ragel, "expected member declaration");
+
+      if (state.context.struct_type != FSPEC_DECLARATION_STRUCT)
+         ragel_throw_error(&state.ragel, "only struct declarations can have members");
+
+      state.context.variant = (state.context.variants > 0);
+      state.context.variants -= state.context.variant;
+   }
+
+   action check_union {
+      if (state.context.variant)
+         ragel_throw_error(&state.ragel, "union can't be a variant of another union");
+
+      if (!state.context.cases || state.context.names)
+         ragel_throw_error(&state.ragel, "union needs unnamed cases");
+
+      if (state.context.fallback > state.context.cases)
+         ragel_throw_error(&state.ragel, "invalid union fallback: %" PRI_FSPEC_NUM, state.context.fallback);
+
+      state.context.variants = state.context.cases;
+   }
+
+   action check_enum {
+      if (state.context.struct_type != FSPEC_DECLARATION_ENUM)
+         ragel_throw_error(&state.ragel, "only enum declarations can have values");
+
+      if (state.context.names != state.context.cases)
+         ragel_throw_error(&state.ragel, "enum needs a name for each case");
+
+      state.context.values = true;
    }
 
    action check_member_end {
@@ -137,13 +251,26 @@ struct state {
    }
 
    action check_struct_end {
-      if (state.context.decl_end[FSPEC_DECLARATION_STRUCT] != state.context.offset)
-         ragel_throw_error(&state.ragel, "invalid struct end: %" PRI_FSPEC_OFF " expected: %" PRI_FSPEC_OFF, state.context.decl_end[FSPEC_DECLARATION_STRUCT], state.context.offset);
+      if (state.context.variants)
+         ragel_throw_error(&state.ragel, "union is missing %" PRI_FSPEC_NUM " variants", state.context.variants);
+
+      if (state.context.struct_type == FSPEC_DECLARATION_ENUM && !state.context.values)
+         ragel_throw_error(&state.ragel, "enum declaration without values");
+
+      if (state.context.decl_end[state.context.struct_type] != state.context.offset)
+         ragel_throw_error(&state.ragel, "invalid struct end: %" PRI_FSPEC_OFF " expected: %" PRI_FSPEC_OFF, state.context.decl_end[state.context.struct_type], state.context.offset);
    }
 
    action check_visual_type {
       if (state.stack.u.num >= FSPEC_VISUAL_LAST)
          ragel_throw_error(&state.ragel, "invalid visual type: %" PRI_FSPEC_NUM, state.stack.u.num);
+
+      state.context.visual = state.stack.u.num;
+   }
+
+   action check_visual_enum {
+      if (state.context.visual != FSPEC_VISUAL_ENUM)
+         ragel_throw_error(&state.ragel, "declaration for non enum visual");
    }
 
    action arg_error {
@@ -168,6 +295,8 @@ struct state {
    }
 
    action flush {
+      // compact numbers only fill the low bytes
+      state.stack.u.num = 0;
       state.stack.i = 0;
    }
 
@@ -186,22 +315,33 @@ struct state {
    ARG_VAR = 3 stack2 %check_var;
    ARG_STR = 4 stack4 %check_str;
    ARG_EOF = 5;
+   ARG_TABLE = 0 stack4 %*mark_table (any when test_inside_table)*;
+   ARG_NUM8 = 6 stack1 %check_compact;
+   ARG_NUM16 = 7 stack2 %check_compact;
+   ARG_NUM32 = 8 stack4 %check_compact;
 
    OP_ARG_DAT = 0 ARG_DAT $!arg_error;
    OP_ARG_OFF = 0 ARG_OFF $!arg_error;
-   OP_ARG_NUM = 0 ARG_NUM $!arg_error;
+   OP_ARG_TABLE = 0 ARG_TABLE $!arg_error;
+   OP_ARG_NUM64 = 0 ARG_NUM $!arg_error;
+   OP_ARG_NUM = 0 (ARG_NUM | ARG_NUM8 | ARG_NUM16 | ARG_NUM32) $!arg_error;
    OP_ARG_VAR = 0 ARG_VAR $!arg_error;
    OP_ARG_STR = 0 ARG_STR $!arg_error;
    OP_ARG_EOF = 0 ARG_EOF $!arg_error;
 
-   OP_HEADER = 1 (OP_ARG_NUM OP_ARG_NUM %store_decls OP_ARG_DAT) $!op_error;
-   OP_DECLARATION = 2 >start_decl (OP_ARG_NUM %check_decl_type OP_ARG_NUM %check_decl_num OP_ARG_OFF %mark_decl OP_ARG_STR) $!op_error;
-   OP_READ = 3 (OP_ARG_NUM (OP_ARG_NUM | OP_ARG_VAR | OP_ARG_STR | OP_ARG_EOF)*) $!op_error;
+   OP_HEADER = 1 (OP_ARG_NUM64 %store_version OP_ARG_NUM64 %store_decls OP_ARG_DAT) $!op_error;
+   OP_DECLARATION = 2 >start_decl (OP_ARG_NUM %check_decl_type OP_ARG_NUM %check_decl_num OP_ARG_OFF %mark_decl OP_ARG_STR (OP_ARG_STR %mark_module)?) $!op_error;
+   OP_READ = 3 (OP_ARG_NUM %check_read_size (OP_ARG_NUM | OP_ARG_VAR | OP_ARG_STR | OP_ARG_EOF)*) $!op_error;
    OP_GOTO = 4 (OP_ARG_VAR (OP_ARG_NUM | OP_ARG_VAR | OP_ARG_STR | OP_ARG_EOF)*) $!op_error;
    OP_FILTER = 5 (OP_ARG_STR (OP_ARG_NUM | OP_ARG_VAR | OP_ARG_STR)*) $!op_error;
-   OP_VISUAL = 6 (OP_ARG_NUM %check_visual_type) $!op_error;
-
-   pattern = (OP_DECLARATION %check_struct <: (OP_DECLARATION %check_member (OP_READ | OP_GOTO) OP_FILTER* OP_VISUAL? %check_member_end)*)* %check_struct_end $!pattern_error;
+   OP_VISUAL = 6 (OP_ARG_NUM %check_visual_type (OP_ARG_VAR %check_visual_enum)?) $!op_error;
+   OP_BLOCK = 7 >check_block_version (OP_ARG_NUM OP_ARG_NUM) $!op_error;
+   OP_SKIP = 8 >check_skip_version;
+   OP_SWITCH = 9 (OP_ARG_VAR OP_ARG_NUM %store_fallback) $!op_error;
+   OP_TABLE = 10 >check_table_version (OP_ARG_NUM %store_cases OP_ARG_NUM OP_ARG_TABLE (OP_ARG_STR %count_name)*) $!op_error;
+
+   member = OP_BLOCK? OP_DECLARATION %check_member (OP_SWITCH OP_TABLE %check_union | (OP_SKIP? OP_READ | OP_GOTO) OP_FILTER* OP_VISUAL?) %check_member_end;
+   pattern = (OP_DECLARATION %check_struct <: (OP_READ OP_TABLE %check_enum | member*))* %check_struct_end $!pattern_error;
    main := (OP_HEADER <: pattern) %check_decls $advance $!syntax_error;
 }%%
 
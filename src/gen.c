@@ -0,0 +1,994 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include <unistd.h>
+#include <zlib.h>
+
+#include <fspec/bcode.h>
+#include <fspec/bits.h>
+
+#include "compile.h"
+#include "util/crc32.h"
+#include "util/rng.h"
+#include "util/misc.h"
+
+// Random data that decodes with the spec, for benchmarking and stress testing.
+// Counts, union selectors and enums get values the spec can decode, matches() gets its pattern,
+// and compressed members get a real payload whose size and checksum are written to the members referring to them.
+// Arrays of the root struct are sized to fill the requested size, nested arrays are small.
+
+#define ARRAY_SIZE(x) (sizeof(x) / sizeof(x[0]))
+
+// output is written in large chunks, only when nothing in it waits to be patched
+#define FLUSH_SIZE (8 << 20)
+#define CHUNK_SIZE (1 << 20)
+#define NO_OFFSET UINT64_MAX
+
+enum role {
+   ROLE_COUNT = 1<<0, // dimension of a later member
+   ROLE_SELECTOR = 1<<1, // selects the variant of an union
+   ROLE_ENUM = 1<<2, // constant of an enum
+   ROLE_PAYLOAD = 1<<3, // decompressed size of a later member
+   ROLE_DERIVED = 1<<4, // count of a member whose length comes from its data, patched later
+   ROLE_CHECKSUM = 1<<5, // checksum of a later member, patched later
+};
+
+enum content {
+   CONTENT_RANDOM,
+   CONTENT_TEXT,
+   CONTENT_ZERO,
+};
+
+struct info {
+   const enum fspec_op *op, *end;
+   const char *name;
+
+   // members are parsed once, generating an element doesn't look at the bytecode
+   const enum fspec_op *exec; // READ, GOTO or SWITCH, NULL if there is none
+   const enum fspec_arg *dims; // dimensions follow this argument
+   const enum fspec_op *table; // cases of the union, the union selected by the member or constants of its enum
+   const char *compression;
+   const enum fspec_arg *payload, *expect; // decompressed size and expected checksum
+   struct fspec_mem pattern, terminator;
+   fspec_num nmemb; // product of the dimensions that are numbers
+
+   uint64_t estimate; // size of a struct with average counts
+   fspec_num owner; // struct the member belongs to
+   fspec_num members; // number of members, structs only
+   enum fspec_declaration declaration;
+   enum crc32_poly poly;
+   uint8_t content, bits, roles;
+   bool dynamic; // dimensions other than numbers
+   bool estimated;
+};
+
+struct value {
+   fspec_num num; // first element
+   uint64_t offset; // of the first element, NO_OFFSET if it's not byte aligned
+   uint8_t size;
+   bool set, pending;
+};
+
+struct count {
+   struct fspec_mem terminator;
+   fspec_num nmemb;
+   const enum fspec_arg *var; // only dimension, if it's a member
+   bool until_eof, until_str;
+};
+
+struct gen {
+   const void *data, *end;
+   struct info *info;
+   const struct info *root;
+   struct value *values;
+   size_t ninfo, nvalues, pending;
+
+   struct {
+      uint8_t *data;
+      size_t len, written;
+      uint64_t flushed; // bytes written before data
+      struct fspec_bits bits; // bits of the next byte
+      int fd;
+   } out;
+
+   struct rng rng;
+   uint64_t size;
+   fspec_num max_count;
+};
+
+static uint64_t
+out_tell(const struct gen *gen)
+{
+   return gen->out.flushed + gen->out.written;
+}
+
+static uint64_t
+out_remaining(const struct gen *gen)
+{
+   return (gen->size > out_tell(gen) ? gen->size - out_tell(gen) : 0);
+}
+
+static uint8_t*
+out_reserve(struct gen *gen, const size_t size)
+{
+   assert(gen);
+
+   if (gen->out.written + size > gen->out.len) {
+      const size_t len = (gen->out.written + size > gen->out.len * 2 ? gen->out.written + size : gen->out.len * 2);
+      if (!(gen->out.data = realloc(gen->out.data, len)))
+         err(EXIT_FAILURE, "realloc(%zu)", len);
+
+      gen->out.len = len;
+   }
+
+   return gen->out.data + gen->out.written;
+}
+
+static void
+out_flush(struct gen *gen)
+{
+   assert(gen && !gen->pending);
+
+   for (size_t w = 0; w < gen->out.written;) {
+      const ssize_t r = write(gen->out.fd, gen->out.data + w, gen->out.written - w);
+      if (r <= 0)
+         err(EXIT_FAILURE, "write");
+      w += r;
+   }
+
+   gen->out.flushed += gen->out.written;
+   gen->out.written = 0;
+}
+
+static void
+out_maybe_flush(struct gen *gen)
+{
+   if (!gen->pending && gen->out.written >= FLUSH_SIZE)
+      out_flush(gen);
+}
+
+static void
+out_bits(struct gen *gen, uint64_t v, uint8_t bits)
+{
+   assert(gen && bits <= 64);
+
+   for (uint8_t n; bits; bits -= n) {
+      n = (bits > 56 ? 56 : bits);
+      fspec_bits_put(&gen->out.bits, v, n);
+      v >>= n;
+
+      for (uint8_t byte; fspec_bits_pop_byte(&gen->out.bits, &byte); ++gen->out.written)
+         *out_reserve(gen, 1) = byte;
+   }
+}
+
+static bool
+out_aligned(const struct gen *gen, const uint8_t bits)
+{
+   return !(bits % 8) && !gen->out.bits.len;
+}
+
+static void
+out_num(struct gen *gen, const fspec_num v, const uint8_t bits)
+{
+   assert(gen && bits <= 64);
+
+   if (!out_aligned(gen, bits)) {
+      out_bits(gen, v, bits);
+      return;
+   }
+
+   uint8_t *p = out_reserve(gen, bits / 8);
+   for (uint8_t i = 0; i < bits / 8; ++i)
+      p[i] = v >> (8 * i);
+
+   gen->out.written += bits / 8;
+}
+
+static fspec_num
+num_max(const uint8_t bits)
+{
+   return (bits < 64 ? ((fspec_num)1 << bits) - 1 : (fspec_num)~0);
+}
+
+static struct value*
+var_get(struct gen *gen, const struct info *owner, const size_t base, const enum fspec_arg *var)
+{
+   assert(gen && owner && var);
+   const fspec_num id = fspec_arg_get_num(var);
+   const fspec_num oid = owner - gen->info;
+
+   if (id <= oid || id > oid + owner->members)
+      errx(EXIT_FAILURE, "variable %" PRI_FSPEC_NUM " is not a member of '%s'", id, owner->name);
+
+   return &gen->values[base + (id - oid - 1)];
+}
+
+static void
+patch(struct gen *gen, struct value *value, const struct info *member, const fspec_num v)
+{
+   assert(gen && value && member);
+
+   if (value->offset == NO_OFFSET)
+      errx(EXIT_FAILURE, "'%s': bit fields can't be written after the data they describe", member->name);
+
+   if (value->size < sizeof(v) && v > num_max(value->size * 8))
+      errx(EXIT_FAILURE, "'%s': %" PRI_FSPEC_NUM " does not fit in %u bytes", member->name, v, value->size);
+
+   // pending values keep the output buffered, so the value is always still there
+   assert(value->offset >= gen->out.flushed);
+   uint8_t *p = gen->out.data + (value->offset - gen->out.flushed);
+   for (uint8_t i = 0; i < value->size; ++i)
+      p[i] = v >> (8 * i);
+
+   value->num = v;
+
+   if (value->pending) {
+      value->pending = false;
+      --gen->pending;
+   }
+}
+
+static void
+get_count(struct gen *gen, const struct info *owner, const size_t base, const struct info *member, struct count *out_count)
+{
+   assert(gen && owner && member && out_count);
+   *out_count = (struct count){ .nmemb = member->nmemb, .terminator = member->terminator };
+
+   if (!member->dynamic)
+      return;
+
+   uint8_t dims = 0;
+   const enum fspec_arg *last = NULL;
+   out_count->nmemb = 1;
+   for (const enum fspec_arg *var = member->dims; (var = fspec_arg_next(var, member->end, 1, ~0));) {
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+         case FSPEC_ARG_VAR:
+            {
+               const fspec_num v = (*var != FSPEC_ARG_VAR ? fspec_arg_get_num(var) : var_get(gen, owner, base, var)->num);
+               out_count->nmemb = (v && out_count->nmemb > (fspec_num)~0 / v ? (fspec_num)~0 : out_count->nmemb * v);
+               last = var;
+               ++dims;
+            }
+            break;
+
+         case FSPEC_ARG_STR:
+            out_count->until_str = true;
+            break;
+
+         case FSPEC_ARG_EOF:
+            out_count->until_eof = true;
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   out_count->var = (dims == 1 && *last == FSPEC_ARG_VAR ? last : NULL);
+}
+
+static uint64_t
+estimate_struct(struct gen *gen, struct info *info);
+
+/** size of an element of member, with counts that are not set yet estimated or taken as 1 */
+static uint64_t
+estimate_member(struct gen *gen, const struct info *member, const size_t base, const bool known)
+{
+   assert(gen && member);
+
+   if (!member->exec || *member->exec == FSPEC_OP_SWITCH)
+      return 0;
+
+   uint64_t size = (*member->exec == FSPEC_OP_READ ? (member->bits + 7u) / 8 : estimate_struct(gen, &gen->info[fspec_arg_get_num(member->dims)]));
+
+   const struct info *owner = &gen->info[member->owner];
+   for (const enum fspec_arg *var = member->dims; (var = fspec_arg_next(var, member->end, 1, ~0));) {
+      fspec_num v = 1;
+      switch (fspec_arg_get_type(var)) {
+         case FSPEC_ARG_NUM:
+            v = fspec_arg_get_num(var);
+            break;
+
+         case FSPEC_ARG_VAR:
+            if (known) {
+               const struct value *value = var_get(gen, owner, base, var);
+               v = (value->set ? value->num : 1);
+            } else {
+               v = gen->max_count / 2;
+            }
+            break;
+
+         case FSPEC_ARG_STR:
+            v = (known ? 1 : gen->max_count / 2 + 1);
+            break;
+
+         case FSPEC_ARG_EOF:
+            v = 0;
+            break;
+
+         default:
+            break;
+      }
+
+      size = (v && size > UINT64_MAX / v ? UINT64_MAX : size * v);
+   }
+
+   return size;
+}
+
+static uint64_t
+estimate_struct(struct gen *gen, struct info *info)
+{
+   assert(gen && info);
+
+   // also stops recursion, structs can't contain themselves anyway
+   if (info->estimated)
+      return info->estimate;
+
+   info->estimated = true;
+
+   uint64_t size = 0;
+   const fspec_num oid = info - gen->info;
+   for (fspec_num id = oid + 1; id <= oid + info->members; ++id) {
+      const struct info *member = &gen->info[id];
+      if (!member->exec || *member->exec != FSPEC_OP_SWITCH) {
+         size += estimate_member(gen, member, 0, false);
+         continue;
+      }
+
+      // average of the variants
+      const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(member->table, member->end, 1, 1<<FSPEC_ARG_NUM));
+      uint64_t sum = 0;
+      for (fspec_num c = 0; c < cases; ++c)
+         sum += estimate_member(gen, &gen->info[id + 1 + c], 0, false);
+
+      size += (cases ? sum / cases : 0);
+      id += cases;
+   }
+
+   return (info->estimate = size);
+}
+
+static fspec_num
+table_pick(struct gen *gen, const enum fspec_op *table)
+{
+   assert(gen && table && *table == FSPEC_OP_TABLE);
+
+   const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(table, gen->end, 1, 1<<FSPEC_ARG_NUM));
+   if (!cases)
+      return rng_next(&gen->rng);
+
+   struct fspec_mem keys;
+   fspec_arg_get_mem(fspec_op_get_arg(table, gen->end, 3, 1<<FSPEC_ARG_DAT), NULL, &keys);
+
+   fspec_num key;
+   memcpy(&key, (const char*)keys.data + rng_range(&gen->rng, cases - 1) * sizeof(key), sizeof(key));
+   return key;
+}
+
+/** value of the first element of a member that other members depend on */
+static fspec_num
+choose(struct gen *gen, const struct info *member, const size_t base, const uint8_t bits)
+{
+   assert(gen && member);
+
+   // arrays of the root struct fill the rest of the output
+   const bool root = (&gen->info[member->owner] == gen->root);
+
+   fspec_num v = 0;
+   if (member->roles & (ROLE_SELECTOR | ROLE_ENUM)) {
+      v = table_pick(gen, member->table);
+   } else if (member->roles & (ROLE_DERIVED | ROLE_CHECKSUM)) {
+      v = 0;
+   } else if (member->roles & ROLE_PAYLOAD) {
+      v = (root ? out_remaining(gen) : rng_range(&gen->rng, gen->max_count));
+   } else if (member->roles & ROLE_COUNT) {
+      if (root) {
+         // the first array using the count decides it
+         const fspec_num id = member - gen->info;
+         v = out_remaining(gen);
+         for (fspec_num a = id + 1; a <= member->owner + gen->info[member->owner].members; ++a) {
+            const struct info *array = &gen->info[a];
+            if (!array->dynamic)
+               continue;
+
+            const enum fspec_arg *var = array->dims;
+            while ((var = fspec_arg_next(var, array->end, 1, ~0)) && !(*var == FSPEC_ARG_VAR && fspec_arg_get_num(var) == id));
+
+            if (!var)
+               continue;
+
+            const uint64_t size = estimate_member(gen, array, base, true);
+            v = (size ? v / size : 1);
+            break;
+         }
+      } else {
+         v = rng_range(&gen->rng, gen->max_count);
+      }
+   }
+
+   return (v > num_max(bits) ? num_max(bits) : v);
+}
+
+static uint64_t
+element(struct gen *gen, const enum content content, const uint8_t bits)
+{
+   assert(gen);
+
+   uint8_t tmp[sizeof(uint64_t)] = {0};
+   switch (content) {
+      case CONTENT_RANDOM:
+         rng_fill(&gen->rng, tmp, (bits + 7) / 8);
+         break;
+
+      case CONTENT_TEXT:
+         rng_text(&gen->rng, tmp, (bits + 7) / 8);
+         break;
+
+      case CONTENT_ZERO:
+         break;
+   }
+
+   uint64_t v;
+   memcpy(&v, tmp, sizeof(v));
+   return v & num_max(bits);
+}
+
+static void
+put_elements(struct gen *gen, const struct info *member, fspec_num nmemb, const enum content content, const uint8_t avoid, uint32_t *crc)
+{
+   assert(gen && member);
+   const uint8_t bits = member->bits;
+
+   if (!out_aligned(gen, bits)) {
+      if (crc)
+         errx(EXIT_FAILURE, "'%s': checksums of bit fields are not supported", member->name);
+
+      for (; nmemb && (gen->out.bits.len || nmemb < 64); --nmemb)
+         out_bits(gen, element(gen, content, bits), bits);
+
+      // packed bit fields of random or zero elements are just random or zero bytes
+      const uint64_t total = nmemb * bits;
+      for (uint64_t left = total / 8, n; left; left -= n) {
+         n = (left < CHUNK_SIZE ? left : CHUNK_SIZE);
+         uint8_t *p = out_reserve(gen, n);
+         if (content == CONTENT_ZERO) {
+            memset(p, 0, n);
+         } else {
+            rng_fill(&gen->rng, p, n);
+         }
+
+         gen->out.written += n;
+         out_maybe_flush(gen);
+      }
+
+      out_bits(gen, element(gen, content, total % 8), total % 8);
+      return;
+   }
+
+   const size_t size = bits / 8;
+   for (size_t n; nmemb; nmemb -= n) {
+      n = (nmemb < CHUNK_SIZE / size ? nmemb : CHUNK_SIZE / size);
+      uint8_t *p = out_reserve(gen, n * size);
+
+      switch (content) {
+         case CONTENT_RANDOM:
+            rng_fill(&gen->rng, p, n * size);
+            break;
+
+         case CONTENT_TEXT:
+            rng_text(&gen->rng, p, n * size);
+            for (uint8_t *c = p; avoid && (c = memchr(c, avoid, n * size - (c - p)));)
+               *c = (avoid == ' ' ? '_' : ' ');
+            break;
+
+         case CONTENT_ZERO:
+            memset(p, 0, n * size);
+            break;
+      }
+
+      if (crc)
+         *crc = crc32_update(member->poly, *crc, p, n * size);
+
+      gen->out.written += n * size;
+      out_maybe_flush(gen);
+   }
+}
+
+/** writes compressed payload of size, returns the compressed size */
+static uint64_t
+put_compressed(struct gen *gen, const struct info *member, uint64_t size, uint32_t *crc)
+{
+   assert(gen && member && member->compression);
+
+   // names of the squash plugins that zlib can produce
+   const struct {
+      const char *name;
+      int bits;
+   } map[] = {
+      { .name = "deflate", .bits = -15 },
+      { .name = "zlib", .bits = 15 },
+      { .name = "gzip", .bits = 31 },
+   };
+
+   size_t i;
+   for (i = 0; i < ARRAY_SIZE(map) && strcmp(member->compression, map[i].name); ++i);
+
+   if (i == ARRAY_SIZE(map))
+      errx(EXIT_FAILURE, "'%s': compression '%s' is not supported, only deflate, zlib and gzip are", member->name, member->compression);
+
+   z_stream z = {0};
+   if (deflateInit2(&z, Z_BEST_SPEED, Z_DEFLATED, map[i].bits, 8, Z_DEFAULT_STRATEGY) != Z_OK)
+      errx(EXIT_FAILURE, "deflateInit2: %s", (z.msg ? z.msg : "failed"));
+
+   // the payload is text, so encodings and string visuals after the decompression stay valid
+   static uint8_t payload[CHUNK_SIZE];
+   const uint64_t start = out_tell(gen);
+   for (int r = Z_OK; r != Z_STREAM_END;) {
+      if (!z.avail_in && size) {
+         const size_t n = (size < sizeof(payload) ? size : sizeof(payload));
+         rng_text(&gen->rng, payload, n);
+
+         if (crc)
+            *crc = crc32_update(member->poly, *crc, payload, n);
+
+         z.next_in = payload;
+         z.avail_in = n;
+         size -= n;
+      }
+
+      z.next_out = out_reserve(gen, CHUNK_SIZE);
+      z.avail_out = CHUNK_SIZE;
+
+      if ((r = deflate(&z, (size ? Z_NO_FLUSH : Z_FINISH))) == Z_STREAM_ERROR)
+         errx(EXIT_FAILURE, "deflate: %s", (z.msg ? z.msg : "failed"));
+
+      gen->out.written += CHUNK_SIZE - z.avail_out;
+   }
+
+   deflateEnd(&z);
+   return out_tell(gen) - start;
+}
+
+static void
+gen_read(struct gen *gen, const struct info *owner, const size_t base, const struct info *member)
+{
+   assert(gen && owner && member);
+
+   struct count count;
+   get_count(gen, owner, base, member, &count);
+
+   const uint8_t bits = member->bits;
+   const enum fspec_arg *expect = member->expect;
+
+   struct value *value = &gen->values[base + (member - owner - 1)];
+   *value = (struct value){
+      .offset = (out_aligned(gen, bits) ? out_tell(gen) : NO_OFFSET),
+      .size = (bits + 7) / 8,
+   };
+
+   // output can't be flushed before the value is patched
+   if (member->roles & (ROLE_DERIVED | ROLE_CHECKSUM)) {
+      value->pending = true;
+      ++gen->pending;
+   }
+
+   if ((count.until_str || member->pattern.len || member->compression) && value->offset == NO_OFFSET)
+      errx(EXIT_FAILURE, "'%s': strings and filtered bit fields are not supported", member->name);
+
+   uint32_t crc = 0;
+   fspec_num nmemb;
+   if (member->pattern.len) {
+      if (member->pattern.len % value->size)
+         errx(EXIT_FAILURE, "'%s': pattern is not a multiple of the element size", member->name);
+
+      memcpy(out_reserve(gen, member->pattern.len), member->pattern.data, member->pattern.len);
+      gen->out.written += member->pattern.len;
+      nmemb = member->pattern.len / value->size;
+      crc = crc32_update(member->poly, crc, member->pattern.data, member->pattern.len);
+   } else if (member->compression) {
+      uint64_t size = 0;
+      if (member->payload) {
+         size = (*member->payload == FSPEC_ARG_VAR ? var_get(gen, owner, base, member->payload)->num : fspec_arg_get_num(member->payload));
+      } else {
+         size = (owner == gen->root ? out_remaining(gen) : rng_range(&gen->rng, gen->max_count));
+      }
+
+      const uint64_t csize = put_compressed(gen, member, size, (expect ? &crc : NULL));
+      nmemb = (csize + value->size - 1) / value->size;
+      memset(out_reserve(gen, nmemb * value->size - csize), 0, nmemb * value->size - csize);
+      gen->out.written += nmemb * value->size - csize;
+   } else {
+      if (count.until_eof) {
+         nmemb = out_remaining(gen) * 8 / bits;
+      } else if (count.until_str) {
+         nmemb = rng_range(&gen->rng, gen->max_count);
+      } else {
+         nmemb = count.nmemb;
+      }
+
+      // numbers other members depend on are the first element
+      if (nmemb && member->roles) {
+         value->num = choose(gen, member, base, bits);
+         out_num(gen, value->num, bits);
+
+         if (expect && value->offset != NO_OFFSET)
+            crc = crc32_update(member->poly, crc, gen->out.data + (value->offset - gen->out.flushed), value->size);
+
+         --nmemb;
+      }
+
+      // strings are text without the terminator, so they don't end early
+      const uint8_t avoid = (count.until_str && count.terminator.len ? *(const uint8_t*)count.terminator.data : 0);
+      put_elements(gen, member, nmemb, (count.until_str ? CONTENT_TEXT : member->content), avoid, (expect ? &crc : NULL));
+
+      if (count.until_str) {
+         memcpy(out_reserve(gen, count.terminator.len), count.terminator.data, count.terminator.len);
+         gen->out.written += count.terminator.len;
+      }
+   }
+
+   // length of matches() and compressed data is only known now
+   if ((member->pattern.len || member->compression) && !count.until_eof) {
+      if (count.var) {
+         patch(gen, var_get(gen, owner, base, count.var), &gen->info[fspec_arg_get_num(count.var)], nmemb);
+      } else if (nmemb != count.nmemb) {
+         errx(EXIT_FAILURE, "'%s': data of %" PRI_FSPEC_NUM " elements does not fit the array of %" PRI_FSPEC_NUM " elements", member->name, nmemb, count.nmemb);
+      }
+   }
+
+   if (expect && *expect == FSPEC_ARG_VAR) {
+      patch(gen, var_get(gen, owner, base, expect), &gen->info[fspec_arg_get_num(expect)], crc);
+   } else if (expect && fspec_arg_get_num(expect) != crc) {
+      warnx("'%s': checksum is a constant, data won't match it", member->name);
+   }
+
+   value->set = true;
+   out_maybe_flush(gen);
+}
+
+static void
+gen_struct(struct gen *gen, const struct info *info, const size_t base);
+
+static void
+gen_goto(struct gen *gen, const struct info *owner, const size_t base, const struct info *member)
+{
+   assert(gen && owner && member);
+
+   const struct info *target = &gen->info[fspec_arg_get_num(member->dims)];
+   assert(target->declaration == FSPEC_DECLARATION_STRUCT);
+
+   struct count count;
+   get_count(gen, owner, base, member, &count);
+
+   if (count.until_str)
+      errx(EXIT_FAILURE, "'%s': struct arrays terminated by a string are not supported", member->name);
+
+   gen->values[base + (member - owner - 1)] = (struct value){ .offset = NO_OFFSET, .set = true };
+
+   // stop if an element makes no progress, it would never fill the output
+   for (fspec_num i = 0; (count.until_eof ? out_remaining(gen) > 0 : i < count.nmemb); ++i) {
+      const uint64_t mark = out_tell(gen) * 8 + gen->out.bits.len;
+      gen_struct(gen, target, base + owner->members);
+      out_maybe_flush(gen);
+
+      if (count.until_eof && out_tell(gen) * 8 + gen->out.bits.len == mark)
+         break;
+   }
+}
+
+/** returns the last member generated, the last variant for unions */
+static const struct info*
+gen_member(struct gen *gen, const struct info *owner, const size_t base, const struct info *member)
+{
+   assert(gen && owner && member);
+
+   if (!member->exec)
+      return member;
+
+   switch (*member->exec) {
+      case FSPEC_OP_READ:
+         gen_read(gen, owner, base, member);
+         break;
+
+      case FSPEC_OP_GOTO:
+         gen_goto(gen, owner, base, member);
+         break;
+
+      case FSPEC_OP_SWITCH:
+         {
+            const fspec_num fallback = fspec_arg_get_num(fspec_arg_next(member->dims, member->end, 1, ~0));
+            const fspec_num cases = fspec_arg_get_num(fspec_op_get_arg(member->table, member->end, 1, 1<<FSPEC_ARG_NUM));
+            const fspec_num id = member - gen->info;
+            assert(id + cases < gen->ninfo);
+
+            fspec_num c = fspec_op_table_lookup(member->table, member->end, var_get(gen, owner, base, member->dims)->num);
+            c = (c < cases ? c : fallback);
+
+            if (c < cases)
+               gen_member(gen, owner, base, &gen->info[id + 1 + c]);
+
+            return &gen->info[id + cases];
+         }
+
+      default:
+         break;
+   }
+
+   return member;
+}
+
+static void
+gen_struct(struct gen *gen, const struct info *info, const size_t base)
+{
+   assert(gen && info && info->declaration == FSPEC_DECLARATION_STRUCT);
+
+   // Values are allocated per depth, siblings and later elements reuse them.
+   if (base + info->members > gen->nvalues) {
+      gen->nvalues = base + info->members;
+      if (!(gen->values = realloc(gen->values, gen->nvalues * sizeof(*gen->values))))
+         err(EXIT_FAILURE, "realloc(%zu)", gen->nvalues * sizeof(*gen->values));
+   }
+
+   memset(gen->values + base, 0, info->members * sizeof(*gen->values));
+
+   // members are declared in order, blocks are only a hint for interpreters that read from files
+   const fspec_num oid = info - gen->info;
+   for (fspec_num id = oid + 1; id <= oid + info->members; ++id)
+      id = gen_member(gen, info, base, &gen->info[id]) - gen->info;
+
+   // members of variants that were not chosen are never patched
+   for (size_t i = base; i < base + info->members; ++i) {
+      if (gen->values[i].pending) {
+         gen->values[i].pending = false;
+         --gen->pending;
+      }
+   }
+}
+
+static void
+mark_dimensions(struct gen *gen, const struct info *member, const uint8_t role)
+{
+   assert(gen && member && member->dims);
+
+   for (const enum fspec_arg *var = member->dims; (var = fspec_arg_next(var, member->end, 1, ~0));) {
+      if (*var == FSPEC_ARG_VAR && fspec_arg_get_num(var) < gen->ninfo)
+         gen->info[fspec_arg_get_num(var)].roles |= role;
+   }
+}
+
+static void
+parse_filter(struct gen *gen, struct info *member, const enum fspec_op *op)
+{
+   assert(gen && member && op);
+
+   const enum fspec_arg *name = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_STR);
+   const char *filter = fspec_arg_get_cstr(name, gen->data);
+
+   if (!strcmp(filter, "matches")) {
+      fspec_arg_get_mem(fspec_arg_next(name, member->end, 1, 1<<FSPEC_ARG_STR), gen->data, &member->pattern);
+   } else if (!strcmp(filter, "compression")) {
+      member->compression = fspec_arg_get_cstr(fspec_arg_next(name, member->end, 1, 1<<FSPEC_ARG_STR), gen->data);
+
+      // size is optional, the rest are options of the codec
+      const enum fspec_arg *arg = fspec_arg_next(name, member->end, 2, ~0);
+      if (arg && (fspec_arg_get_type(arg) == FSPEC_ARG_NUM || *arg == FSPEC_ARG_VAR))
+         member->payload = arg;
+
+      if (member->payload && *member->payload == FSPEC_ARG_VAR)
+         gen->info[fspec_arg_get_num(member->payload)].roles |= ROLE_PAYLOAD;
+   } else if (!strcmp(filter, "encoding")) {
+      member->content = CONTENT_TEXT;
+   } else if (!strcmp(filter, "checksum")) {
+      const char *algo = fspec_arg_get_cstr(fspec_arg_next(name, member->end, 1, 1<<FSPEC_ARG_STR), gen->data);
+      if (strcmp(algo, "crc32") && strcmp(algo, "crc32c"))
+         errx(EXIT_FAILURE, "'%s': unknown checksum '%s'", member->name, algo);
+
+      member->poly = (!strcmp(algo, "crc32c") ? CRC32_CASTAGNOLI : CRC32_IEEE);
+      member->expect = fspec_arg_next(name, member->end, 2, 1<<FSPEC_ARG_NUM | 1<<FSPEC_ARG_VAR);
+
+      if (*member->expect == FSPEC_ARG_VAR)
+         gen->info[fspec_arg_get_num(member->expect)].roles |= ROLE_CHECKSUM;
+   }
+}
+
+static void
+parse_member(struct gen *gen, struct info *member)
+{
+   assert(gen && member);
+
+   member->nmemb = 1;
+   for (const enum fspec_op *op = member->op; (op = fspec_op_next(op, member->end, true));) {
+      switch (*op) {
+         case FSPEC_OP_READ:
+         case FSPEC_OP_GOTO:
+            member->exec = op;
+            member->dims = fspec_op_get_arg(op, member->end, 1, ~0);
+            member->bits = (*op == FSPEC_OP_READ ? fspec_arg_get_num(member->dims) : 0);
+            assert(*op != FSPEC_OP_READ || (member->bits && member->bits <= 64));
+
+            for (const enum fspec_arg *var = member->dims; (var = fspec_arg_next(var, member->end, 1, ~0));) {
+               switch (fspec_arg_get_type(var)) {
+                  case FSPEC_ARG_NUM:
+                     {
+                        const fspec_num v = fspec_arg_get_num(var);
+                        member->nmemb = (v && member->nmemb > (fspec_num)~0 / v ? (fspec_num)~0 : member->nmemb * v);
+                     }
+                     break;
+
+                  case FSPEC_ARG_STR:
+                     fspec_arg_get_mem(var, gen->data, &member->terminator);
+                     member->dynamic = true;
+                     break;
+
+                  case FSPEC_ARG_VAR:
+                  case FSPEC_ARG_EOF:
+                     member->dynamic = true;
+                     break;
+
+                  default:
+                     break;
+               }
+            }
+
+            mark_dimensions(gen, member, ROLE_COUNT);
+            break;
+
+         case FSPEC_OP_SWITCH:
+            {
+               member->exec = op;
+               member->dims = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_VAR);
+               member->table = fspec_op_next(op, member->end, true);
+               assert(member->table && *member->table == FSPEC_OP_TABLE);
+
+               const fspec_num id = fspec_arg_get_num(member->dims);
+               if (id < gen->ninfo) {
+                  gen->info[id].roles |= ROLE_SELECTOR;
+                  gen->info[id].table = member->table;
+               }
+            }
+            break;
+
+         case FSPEC_OP_VISUAL:
+            {
+               const enum fspec_arg *arg = fspec_op_get_arg(op, member->end, 1, 1<<FSPEC_ARG_NUM);
+               switch (fspec_arg_get_num(arg)) {
+                  case FSPEC_VISUAL_NUL:
+                     member->content = CONTENT_ZERO;
+                     break;
+
+                  case FSPEC_VISUAL_STR:
+                     member->content = CONTENT_TEXT;
+                     break;
+
+                  case FSPEC_VISUAL_ENUM:
+                     {
+                        const struct info *decl = &gen->info[fspec_arg_get_num(fspec_arg_next(arg, member->end, 1, 1<<FSPEC_ARG_VAR))];
+                        for (const enum fspec_op *t = decl->op; !(member->roles & ROLE_SELECTOR) && (t = fspec_op_next(t, decl->end, true));) {
+                           if (*t == FSPEC_OP_TABLE) {
+                              member->roles |= ROLE_ENUM;
+                              member->table = t;
+                           }
+                        }
+                     }
+                     break;
+
+                  default:
+                     break;
+               }
+            }
+            break;
+
+         case FSPEC_OP_FILTER:
+            parse_filter(gen, member, op);
+            break;
+
+         default:
+            break;
+      }
+   }
+
+   // length of the data decides the count
+   if (member->dims && (member->pattern.len || member->compression))
+      mark_dimensions(gen, member, ROLE_DERIVED);
+}
+
+static void
+gen_init(struct gen *gen, const struct fspec_mem *bcode)
+{
+   assert(gen && bcode);
+
+   gen->data = bcode->data;
+   gen->end = (char*)bcode->data + bcode->len;
+   gen->ninfo = fspec_arg_get_num(fspec_op_get_arg(gen->data, gen->end, 2, 1<<FSPEC_ARG_NUM));
+
+   if (!(gen->info = calloc((gen->ninfo ? gen->ninfo : 1), sizeof(*gen->info))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", gen->ninfo, sizeof(*gen->info));
+
+   fspec_num owner = 0;
+   for (const enum fspec_op *op = gen->data; op; op = fspec_op_next(op, gen->end, true)) {
+      if (*op != FSPEC_OP_DECLARATION)
+         continue;
+
+      const enum fspec_arg *arg[4];
+      arg[0] = fspec_op_get_arg(op, gen->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[1] = fspec_arg_next(arg[0], gen->end, 1, 1<<FSPEC_ARG_NUM);
+      arg[2] = fspec_arg_next(arg[1], gen->end, 1, 1<<FSPEC_ARG_OFF);
+      arg[3] = fspec_arg_next(arg[2], gen->end, 1, 1<<FSPEC_ARG_STR);
+      const fspec_num id = fspec_arg_get_num(arg[1]);
+
+      if (id >= gen->ninfo)
+         errx(EXIT_FAILURE, "declaration %" PRI_FSPEC_NUM " is out of range", id);
+
+      struct info *info = &gen->info[id];
+      *info = (struct info){
+         .op = op,
+         .end = (const void*)((char*)op + fspec_arg_get_num(arg[2])),
+         .name = fspec_arg_get_cstr(arg[3], gen->data),
+         .declaration = fspec_arg_get_num(arg[0]),
+      };
+
+      if (info->declaration == FSPEC_DECLARATION_STRUCT) {
+         info->owner = owner = id;
+         gen->root = info;
+      } else if (info->declaration == FSPEC_DECLARATION_MEMBER) {
+         info->owner = owner;
+         ++gen->info[owner].members;
+      }
+   }
+
+   if (!gen->root)
+      errx(EXIT_FAILURE, "bytecode does not declare any structs");
+
+   for (size_t i = 0; i < gen->ninfo; ++i) {
+      if (gen->info[i].op && gen->info[i].declaration == FSPEC_DECLARATION_MEMBER)
+         parse_member(gen, &gen->info[i]);
+   }
+}
+
+int
+main(int argc, char *argv[])
+{
+   int i;
+   struct gen gen = { .out.fd = STDOUT_FILENO, .size = 1 << 20, .max_count = 16 };
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-s") && i + 1 < argc) {
+         gen.size = parse_size(argv[++i], NULL);
+      } else if (!strcmp(argv[i], "-S") && i + 1 < argc) {
+         gen.rng.state = strtoull(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "-c") && i + 1 < argc) {
+         gen.max_count = strtoull(argv[++i], NULL, 10);
+      } else {
+         break;
+      }
+   }
+
+   if (argc - i != 1)
+      errx(EXIT_FAILURE, "usage: %s [-s size] [-S seed] [-c max-count] file.spec > data", argv[0]);
+
+   if (isatty(gen.out.fd))
+      errx(EXIT_FAILURE, "refusing to write binary data to a terminal");
+
+   struct fspec_mem bcode = compile(argv[i]);
+   gen_init(&gen, &bcode);
+   gen_struct(&gen, gen.root, 0);
+
+   // last bit field is padded to a byte
+   if (gen.out.bits.len)
+      out_bits(&gen, 0, 8 - gen.out.bits.len);
+
+   out_flush(&gen);
+   free(gen.out.data);
+   free(gen.values);
+   free(gen.info);
+   free(bcode.data);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,355 @@
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <stddef.h>
+#include <inttypes.h>
+#include <limits.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+
+#include <fspec/bcode.h>
+#include <fspec/decoder.h>
+#include <fspec/cursor.h>
+
+#include "compile.h"
+#include "index.h"
+#include "util/xxh64.h"
+#include "util/misc.h"
+
+// Records of one member of the root struct.
+struct records {
+   const char *member, *name; // point into the bytecode
+   fspec_num id;
+   uint64_t *offsets;
+   size_t count, len;
+   uint64_t records, end;
+};
+
+struct scan {
+   struct fspec_decoder decoder;
+   struct records *members;
+   size_t count;
+   uint64_t stride;
+};
+
+static struct records*
+scan_get_records(struct scan *scan, const struct fspec_value *member, const char *name)
+{
+   assert(scan && member && name);
+
+   for (size_t i = scan->count; i > 0; --i) {
+      if (scan->members[i - 1].id == member->id)
+         return &scan->members[i - 1];
+   }
+
+   if (!(scan->members = realloc(scan->members, sizeof(*scan->members) * (scan->count + 1))))
+      err(EXIT_FAILURE, "realloc(%zu)", sizeof(*scan->members) * (scan->count + 1));
+
+   struct records *r = &scan->members[scan->count++];
+   *r = (struct records){ .member = member->name, .name = name, .id = member->id };
+   return r;
+}
+
+static void
+scan_enter(struct fspec_decoder *decoder, const struct fspec_value *member, const char *name, const fspec_num index, const size_t depth)
+{
+   assert(decoder);
+   (void)index;
+
+   // only the elements of the members of the root struct are records
+   if (!member || depth != 1)
+      return;
+
+   struct scan *scan = container_of(decoder, struct scan, decoder);
+   struct records *r = scan_get_records(scan, member, name);
+
+   if (!(r->records++ % scan->stride)) {
+      if (r->count >= r->len) {
+         r->len = (r->len ? r->len * 2 : 1024);
+         if (!(r->offsets = realloc(r->offsets, sizeof(*r->offsets) * r->len)))
+            err(EXIT_FAILURE, "realloc(%zu)", sizeof(*r->offsets) * r->len);
+      }
+
+      r->offsets[r->count++] = fspec_decoder_get_offset(decoder);
+   }
+}
+
+static void
+scan_leave(struct fspec_decoder *decoder, const struct fspec_value *member, const char *name, const fspec_num index, const size_t depth)
+{
+   assert(decoder);
+   (void)index;
+
+   if (!member || depth != 1)
+      return;
+
+   struct scan *scan = container_of(decoder, struct scan, decoder);
+   scan_get_records(scan, member, name)->end = fspec_decoder_get_offset(decoder);
+}
+
+static bool
+has_bit_fields(const struct fspec_mem *bcode)
+{
+   assert(bcode);
+
+   const void *end = (char*)bcode->data + bcode->len;
+   for (const enum fspec_op *op = bcode->data; op; op = fspec_op_next(op, end, true)) {
+      if (*op == FSPEC_OP_READ && fspec_arg_get_num(fspec_op_get_arg(op, end, 1, 1<<FSPEC_ARG_NUM)) % 8)
+         return true;
+   }
+
+   return false;
+}
+
+static void
+write_index(const char *path, const struct fspec_index_header *header, const uint64_t *offsets)
+{
+   assert(path && header && (offsets || !header->count));
+
+   char tmp[PATH_MAX];
+   const int ret = snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+   if (ret < 0 || (size_t)ret >= sizeof(tmp))
+      errx(EXIT_FAILURE, "%s: path is too long", path);
+
+   FILE *f;
+   if (!(f = fopen(tmp, "wb")))
+      err(EXIT_FAILURE, "fopen(%s, wb)", tmp);
+
+   if (fwrite(header, sizeof(*header), 1, f) != 1 || fwrite(offsets, sizeof(*offsets), header->count, f) != header->count || fclose(f))
+      err(EXIT_FAILURE, "fwrite(%s)", tmp);
+
+   // fspec_index_open maps the whole file, so lookups running during a rebuild keep reading the old index.
+   if (rename(tmp, path) == -1)
+      err(EXIT_FAILURE, "rename(%s, %s)", tmp, path);
+}
+
+static void
+build(const char *spec, const char *data, const char *out, const char *member, const uint64_t stride)
+{
+   assert(spec && data && out && stride);
+
+   struct fspec_mem bcode = compile(spec);
+
+   // records starting in the middle of a byte can't be addressed by offset
+   if (has_bit_fields(&bcode))
+      errx(EXIT_FAILURE, "%s: bit fields are not supported", spec);
+
+   int fd;
+   if ((fd = open(data, O_RDONLY | O_CLOEXEC)) == -1)
+      err(EXIT_FAILURE, "open(%s)", data);
+
+   struct stat st;
+   if (fstat(fd, &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", data);
+
+   void *map = NULL;
+   if (st.st_size && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap(%s)", data);
+
+   close(fd);
+
+   if (map)
+      posix_madvise(map, st.st_size, POSIX_MADV_SEQUENTIAL);
+
+   // Only the records are of interest, no member callbacks and no filters makes this a pure scan.
+   struct scan scan = {
+      .decoder = {
+         .ops.enter = scan_enter,
+         .ops.leave = scan_leave,
+         .mem.bcode = bcode,
+      },
+      .stride = stride,
+   };
+
+   if (!fspec_decoder_init(&scan.decoder))
+      errx(EXIT_FAILURE, "%s: %s", spec, fspec_decoder_get_error(&scan.decoder));
+
+   if (fspec_decoder_feed(&scan.decoder, map, st.st_size, true, NULL) != FSPEC_DECODER_DONE)
+      errx(EXIT_FAILURE, "%s: %s", data, (fspec_decoder_get_error(&scan.decoder) ? fspec_decoder_get_error(&scan.decoder) : "unexpected end of input"));
+
+   fspec_decoder_release(&scan.decoder);
+
+   if (map)
+      munmap(map, st.st_size);
+
+   // Without a member, records are the elements of the longest array.
+   const struct records *r = NULL;
+   for (size_t i = 0; i < scan.count; ++i) {
+      if (member ? !strcmp(scan.members[i].member, member) : (!r || scan.members[i].records > r->records))
+         r = &scan.members[i];
+   }
+
+   if (!r && member)
+      errx(EXIT_FAILURE, "%s: '%s' is not a struct member of the root struct, or it has no elements", spec, member);
+
+   if (!r)
+      errx(EXIT_FAILURE, "%s: root struct has no struct members", spec);
+
+   struct fspec_index_header header = {
+      .magic = FSPEC_INDEX_MAGIC,
+      .version = FSPEC_INDEX_VERSION,
+      .bcode = xxh64(bcode.data, bcode.len, 0),
+      .records = r->records,
+      .count = r->count,
+      .stride = stride,
+      .end = r->end,
+   };
+
+   if (strlen(r->member) >= sizeof(header.member) || strlen(r->name) >= sizeof(header.name))
+      errx(EXIT_FAILURE, "%s: '%s' of '%s' has too long name for the index", spec, r->member, r->name);
+
+   strcpy(header.member, r->member);
+   strcpy(header.name, r->name);
+   write_index(out, &header, r->offsets);
+
+   for (size_t i = 0; i < scan.count; ++i)
+      free(scan.members[i].offsets);
+
+   free(scan.members);
+   free(bcode.data);
+}
+
+static void
+lookup(const char *path, char *records[], const size_t count)
+{
+   assert(path && records);
+
+   struct fspec_index index;
+   fspec_index_open_or_die(&index, path);
+
+   for (size_t i = 0; i < count; ++i) {
+      uint64_t offset, skip;
+      const uint64_t record = strtoull(records[i], NULL, 10);
+      if (!fspec_index_lookup(&index, record, &offset, &skip)) {
+         printf("%" PRIu64 ": out of range\n", record);
+      } else if (skip) {
+         printf("%" PRIu64 ": %s at offset %" PRIu64 " + %" PRIu64 " records\n", record, index.header->name, offset, skip);
+      } else {
+         printf("%" PRIu64 ": %s at offset %" PRIu64 "\n", record, index.header->name, offset);
+      }
+   }
+
+   fspec_index_close(&index);
+}
+
+static void
+print_value(const struct fspec_value *value)
+{
+   assert(value);
+
+   printf("%s:", value->name);
+
+   if (value->visual == FSPEC_VISUAL_STR) {
+      printf(" %.*s\n", (int)strnlen(value->data, value->size * value->nmemb), (const char*)value->data);
+      return;
+   }
+
+   for (size_t i = 0; i < value->nmemb; ++i) {
+      if (value->size > sizeof(fspec_num)) {
+         // struct members are a single element of all their bytes
+         printf(" ");
+         for (size_t b = 0; b < value->size; ++b)
+            printf("%02x", ((const uint8_t*)value->data)[i * value->size + b]);
+      } else if (value->visual == FSPEC_VISUAL_HEX) {
+         printf(" 0x%" PRIx64, fspec_value_get_num(value, i));
+      } else {
+         printf(" %" PRIu64, fspec_value_get_num(value, i));
+      }
+   }
+
+   printf("\n");
+}
+
+static void
+get(const char *spec, const char *data, const char *path, const uint64_t record, char *members[], const size_t count)
+{
+   assert(spec && data && path && members);
+
+   struct fspec_index index;
+   fspec_index_open_or_die(&index, path);
+
+   struct fspec_mem bcode = compile(spec);
+   if (xxh64(bcode.data, bcode.len, 0) != index.header->bcode)
+      errx(EXIT_FAILURE, "%s: index was built with another spec", path);
+
+   uint64_t offset, skip;
+   if (!fspec_index_lookup(&index, record, &offset, &skip))
+      errx(EXIT_FAILURE, "%" PRIu64 ": out of range", record);
+
+   int fd;
+   if ((fd = open(data, O_RDONLY | O_CLOEXEC)) == -1)
+      err(EXIT_FAILURE, "open(%s)", data);
+
+   struct stat st;
+   if (fstat(fd, &st) == -1)
+      err(EXIT_FAILURE, "fstat(%s)", data);
+
+   void *map = NULL;
+   if (st.st_size && (map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0)) == MAP_FAILED)
+      err(EXIT_FAILURE, "mmap(%s)", data);
+
+   close(fd);
+
+   // the index gets to the closest record, the cursor walks the rest and finds the members
+   struct fspec_cursor cursor = {
+      .mem.bcode = bcode,
+      .mem.input = { .data = map, .len = st.st_size },
+   };
+
+   if (!fspec_cursor_init(&cursor, index.header->name, offset) || !fspec_cursor_seek_record(&cursor, skip))
+      errx(EXIT_FAILURE, "%s: %s", data, (fspec_cursor_get_error(&cursor) ? fspec_cursor_get_error(&cursor) : "record is past the end of the input"));
+
+   for (size_t i = 0; i < count; ++i) {
+      fspec_num id;
+      struct fspec_value value;
+      if (!fspec_cursor_lookup(&cursor, members[i], &id))
+         errx(EXIT_FAILURE, "%s: '%s' has no member '%s'", spec, index.header->name, members[i]);
+
+      if (!fspec_cursor_get(&cursor, id, &value))
+         errx(EXIT_FAILURE, "%s: %s", data, fspec_cursor_get_error(&cursor));
+
+      print_value(&value);
+   }
+
+   fspec_cursor_release(&cursor);
+
+   if (map)
+      munmap(map, st.st_size);
+
+   free(bcode.data);
+   fspec_index_close(&index);
+}
+
+int
+main(int argc, char *argv[])
+{
+   if (argc >= 3 && !strcmp(argv[1], "-l")) {
+      lookup(argv[2], argv + 3, (size_t)argc - 3);
+      return EXIT_SUCCESS;
+   }
+
+   if (argc >= 7 && !strcmp(argv[1], "-g")) {
+      get(argv[2], argv[3], argv[4], strtoull(argv[5], NULL, 10), argv + 6, (size_t)argc - 6);
+      return EXIT_SUCCESS;
+   }
+
+   int i;
+   uint64_t stride = 1;
+   const char *member = NULL;
+   for (i = 1; i < argc; ++i) {
+      if (!strcmp(argv[i], "-n") && i + 1 < argc) {
+         stride = strtoull(argv[++i], NULL, 10);
+      } else if (!strcmp(argv[i], "-m") && i + 1 < argc) {
+         member = argv[++i];
+      } else {
+         break;
+      }
+   }
+
+   if (i + 3 != argc || !stride)
+      errx(EXIT_FAILURE, "usage: %s [-n stride] [-m member] file.spec data index | -l index record ... | -g file.spec data index record member ...", argv[0]);
+
+   build(argv[i], argv[i + 1], argv[i + 2], member, stride);
+   return EXIT_SUCCESS;
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+// Offsets where the records of a data file start, written by fspec-index.
+// Records are the elements of a struct member of the root struct, they vary in size,
+// so without the index record n can only be reached by decoding every record before it.
+// The file is a header followed by the offset of every stride'th record,
+// so it can be mapped and queried in O(1) without parsing anything.
+
+#define FSPEC_INDEX_MAGIC "FSIX"
+#define FSPEC_INDEX_VERSION 1
+
+struct fspec_index_header {
+   char magic[4];
+   uint32_t version;
+   uint64_t bcode; // xxh64 of the bytecode, same as checkpoints of fspec-dump
+   uint64_t records; // number of records
+   uint64_t count; // number of offsets
+   uint64_t stride; // records between offsets
+   uint64_t end; // offset after the last record
+   char member[32]; // nul terminated name of the member of the root struct
+   char name[32]; // nul terminated name of the struct of the records, see fspec_cursor_init
+};
+
+static_assert(sizeof(struct fspec_index_header) == 112, "struct fspec_index_header has unexpected padding");
+
+struct fspec_index {
+   const struct fspec_index_header *header;
+   const uint64_t *offsets;
+   size_t map_sz;
+};
+
+static inline bool
+fspec_index_open(struct fspec_index *index, const char *path)
+{
+   assert(index && path);
+   *index = (struct fspec_index){0};
+
+   int fd;
+   if ((fd = open(path, O_RDONLY | O_CLOEXEC)) == -1)
+      return false;
+
+   struct stat st;
+   if (fstat(fd, &st) == -1 || (size_t)st.st_size < sizeof(*index->header)) {
+      close(fd);
+      return false;
+   }
+
+   void *map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+   close(fd);
+
+   if (map == MAP_FAILED)
+      return false;
+
+   const struct fspec_index_header *header = map;
+   if (memcmp(header->magic, FSPEC_INDEX_MAGIC, sizeof(header->magic)) ||
+       header->version != FSPEC_INDEX_VERSION || !header->stride ||
+       header->count != header->records / header->stride + !!(header->records % header->stride) ||
+       ((size_t)st.st_size - sizeof(*header)) / sizeof(uint64_t) < header->count) {
+      munmap(map, st.st_size);
+      return false;
+   }
+
+   index->header = header;
+   index->offsets = (const void*)(header + 1);
+   index->map_sz = st.st_size;
+   return true;
+}
+
+static inline void
+fspec_index_open_or_die(struct fspec_index *index, const char *path)
+{
+   if (!fspec_index_open(index, path))
+      errx(EXIT_FAILURE, "'%s' is not a valid fspec index", path);
+}
+
+/**
+ * offset of the closest indexed record at or before record,
+ * and the number of records to skip from there. returns false past the last record.
+ */
+static inline bool
+fspec_index_lookup(const struct fspec_index *index, const uint64_t record, uint64_t *out_offset, uint64_t *out_skip)
+{
+   assert(index && index->header && out_offset && out_skip);
+
+   if (record >= index->header->records)
+      return false;
+
+   *out_offset = index->offsets[record / index->header->stride];
+   *out_skip = record % index->header->stride;
+   return true;
+}
+
+static inline void
+fspec_index_close(struct fspec_index *index)
+{
+   assert(index);
+
+   if (index->header)
+      munmap((void*)index->header, index->map_sz);
+
+   *index = (struct fspec_index){0};
+}
@@ -0,0 +1,176 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#  define CRC32_X86 1
+#  include <immintrin.h>
+#endif
+
+// Reflected CRC-32 of zlib and CRC-32C (Castagnoli).
+// Kernels are picked once at startup: SSE4.2 crc32 instruction for CRC-32C,
+// PCLMULQDQ folding for CRC-32 and slice-by-8 tables everywhere else.
+
+enum crc32_poly {
+   CRC32_IEEE,
+   CRC32_CASTAGNOLI,
+   CRC32_POLY_LAST,
+};
+
+static struct {
+   uint32_t table[CRC32_POLY_LAST][8][256];
+   uint32_t (*update[CRC32_POLY_LAST])(uint32_t crc, const uint8_t *p, size_t size);
+} crc32_state;
+
+static inline uint32_t
+crc32_slice8(uint32_t table[8][256], uint32_t crc, const uint8_t *p, size_t size)
+{
+   for (; size && ((uintptr_t)p & 7); --size)
+      crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+   for (; size >= 8; size -= 8, p += 8) {
+      // XXX: assumes little endian host, like the rest of the tools
+      uint32_t lo, hi;
+      memcpy(&lo, p, sizeof(lo));
+      memcpy(&hi, p + 4, sizeof(hi));
+      lo ^= crc;
+      crc = table[7][lo & 0xff] ^ table[6][(lo >> 8) & 0xff] ^ table[5][(lo >> 16) & 0xff] ^ table[4][lo >> 24] ^
+            table[3][hi & 0xff] ^ table[2][(hi >> 8) & 0xff] ^ table[1][(hi >> 16) & 0xff] ^ table[0][hi >> 24];
+   }
+
+   for (; size; --size)
+      crc = table[0][(crc ^ *p++) & 0xff] ^ (crc >> 8);
+
+   return crc;
+}
+
+static inline uint32_t
+crc32_ieee_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+   return crc32_slice8(crc32_state.table[CRC32_IEEE], crc, p, size);
+}
+
+static inline uint32_t
+crc32_castagnoli_slice8(uint32_t crc, const uint8_t *p, size_t size)
+{
+   return crc32_slice8(crc32_state.table[CRC32_CASTAGNOLI], crc, p, size);
+}
+
+#ifdef CRC32_X86
+__attribute__((target("sse4.2")))
+static inline uint32_t
+crc32_castagnoli_sse42(uint32_t crc, const uint8_t *p, size_t size)
+{
+   for (; size && ((uintptr_t)p & 7); --size)
+      crc = _mm_crc32_u8(crc, *p++);
+
+   uint64_t crc64 = crc;
+   for (; size >= 8; size -= 8, p += 8) {
+      uint64_t v;
+      memcpy(&v, p, sizeof(v));
+      crc64 = _mm_crc32_u64(crc64, v);
+   }
+
+   for (crc = crc64; size; --size)
+      crc = _mm_crc32_u8(crc, *p++);
+
+   return crc;
+}
+
+// Folds 64 bytes at a time into four 128 bit lanes, then Barrett reduces the remainder to 32 bits.
+// See "Fast CRC Computation for Generic Polynomials Using PCLMULQDQ Instruction" by Intel.
+__attribute__((target("pclmul,sse4.1")))
+static inline uint32_t
+crc32_ieee_pclmul(uint32_t crc, const uint8_t *p, size_t size)
+{
+   if (size < 64)
+      return crc32_ieee_slice8(crc, p, size);
+
+   const __m128i k1k2 = _mm_set_epi64x(0x01c6e41596, 0x0154442bd4);
+   const __m128i k3k4 = _mm_set_epi64x(0x00ccaa009e, 0x01751997d0);
+   const __m128i k5k0 = _mm_set_epi64x(0, 0x0163cd6124);
+   const __m128i poly = _mm_set_epi64x(0x01f7011641, 0x01db710641);
+   const __m128i mask = _mm_setr_epi32(~0, 0, ~0, 0);
+
+   __m128i x[4];
+   for (uint8_t i = 0; i < 4; ++i)
+      x[i] = _mm_loadu_si128((const __m128i*)(const void*)(p + i * 16));
+
+   x[0] = _mm_xor_si128(x[0], _mm_cvtsi32_si128(crc));
+   p += 64, size -= 64;
+
+   for (; size >= 64; p += 64, size -= 64) {
+      for (uint8_t i = 0; i < 4; ++i) {
+         const __m128i lo = _mm_clmulepi64_si128(x[i], k1k2, 0x00);
+         const __m128i hi = _mm_clmulepi64_si128(x[i], k1k2, 0x11);
+         x[i] = _mm_xor_si128(_mm_xor_si128(lo, hi), _mm_loadu_si128((const __m128i*)(const void*)(p + i * 16)));
+      }
+   }
+
+   for (uint8_t i = 1; i < 4; ++i) {
+      const __m128i lo = _mm_clmulepi64_si128(x[0], k3k4, 0x00);
+      const __m128i hi = _mm_clmulepi64_si128(x[0], k3k4, 0x11);
+      x[0] = _mm_xor_si128(_mm_xor_si128(lo, hi), x[i]);
+   }
+
+   for (; size >= 16; p += 16, size -= 16) {
+      const __m128i lo = _mm_clmulepi64_si128(x[0], k3k4, 0x00);
+      const __m128i hi = _mm_clmulepi64_si128(x[0], k3k4, 0x11);
+      x[0] = _mm_xor_si128(_mm_xor_si128(lo, hi), _mm_loadu_si128((const __m128i*)(const void*)p));
+   }
+
+   __m128i v = _mm_xor_si128(_mm_srli_si128(x[0], 8), _mm_clmulepi64_si128(x[0], k3k4, 0x10));
+   v = _mm_xor_si128(_mm_srli_si128(v, 4), _mm_clmulepi64_si128(_mm_and_si128(v, mask), k5k0, 0x00));
+
+   __m128i t = _mm_clmulepi64_si128(_mm_and_si128(v, mask), poly, 0x10);
+   t = _mm_clmulepi64_si128(_mm_and_si128(t, mask), poly, 0x00);
+   crc = _mm_extract_epi32(_mm_xor_si128(v, t), 1);
+   return crc32_ieee_slice8(crc, p, size);
+}
+#endif
+
+__attribute__((constructor))
+static void
+crc32_init(void)
+{
+   static const uint32_t polys[CRC32_POLY_LAST] = { 0xedb88320, 0x82f63b78 };
+
+   for (uint8_t n = 0; n < CRC32_POLY_LAST; ++n) {
+      uint32_t (*table)[256] = crc32_state.table[n];
+      for (uint32_t i = 0; i < 256; ++i) {
+         uint32_t c = i;
+         for (uint8_t b = 0; b < 8; ++b)
+            c = (c & 1 ? polys[n] ^ (c >> 1) : c >> 1);
+         table[0][i] = c;
+      }
+
+      for (uint32_t i = 0; i < 256; ++i) {
+         for (uint8_t s = 1; s < 8; ++s)
+            table[s][i] = (table[s - 1][i] >> 8) ^ table[0][table[s - 1][i] & 0xff];
+      }
+   }
+
+   crc32_state.update[CRC32_IEEE] = crc32_ieee_slice8;
+   crc32_state.update[CRC32_CASTAGNOLI] = crc32_castagnoli_slice8;
+
+#ifdef CRC32_X86
+   __builtin_cpu_init();
+
+   if (__builtin_cpu_supports("pclmul") && __builtin_cpu_supports("sse4.1"))
+      crc32_state.update[CRC32_IEEE] = crc32_ieee_pclmul;
+
+   if (__builtin_cpu_supports("sse4.2"))
+      crc32_state.update[CRC32_CASTAGNOLI] = crc32_castagnoli_sse42;
+#endif
+}
+
+/** continues crc of previous data, start with 0 */
+static inline uint32_t
+crc32_update(const enum crc32_poly poly, const uint32_t crc, const void *data, const size_t size)
+{
+   assert(poly < CRC32_POLY_LAST && (data || !size));
+   return ~crc32_state.update[poly](~crc, data, size);
+}
@@ -0,0 +1,113 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <assert.h>
+#include <err.h>
+
+// Linear probing hash index for entries that live in an array of the caller.
+// The index only maps hashes to entry numbers, the caller compares the keys.
+// It grows to keep the load factor at or below 0.5, so probe sequences stay short.
+
+struct hashidx_slot {
+   uint64_t hash;
+   uint32_t entry; // entry + 1, 0 for empty slot
+};
+
+struct hashidx {
+   struct hashidx_slot *slots;
+   size_t count, mask;
+};
+
+struct hashidx_iter {
+   uint64_t hash;
+   size_t slot;
+};
+
+static inline void
+hashidx_place(struct hashidx *index, const uint64_t hash, const uint32_t entry)
+{
+   assert(index && index->slots);
+   size_t s = hash & index->mask;
+   while (index->slots[s].entry)
+      s = (s + 1) & index->mask;
+   index->slots[s] = (struct hashidx_slot){ .hash = hash, .entry = entry };
+}
+
+/** makes room for count entries without growing */
+static inline void
+hashidx_reserve(struct hashidx *index, const size_t count)
+{
+   assert(index);
+
+   size_t len = 16;
+   while (len < count * 2)
+      len *= 2;
+
+   if (index->slots && len <= index->mask + 1)
+      return;
+
+   struct hashidx old = *index;
+   index->mask = len - 1;
+   if (!(index->slots = calloc(len, sizeof(*index->slots))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", len, sizeof(*index->slots));
+
+   for (size_t i = 0; old.slots && i <= old.mask; ++i) {
+      if (old.slots[i].entry)
+         hashidx_place(index, old.slots[i].hash, old.slots[i].entry);
+   }
+
+   free(old.slots);
+}
+
+static inline void
+hashidx_insert(struct hashidx *index, const uint64_t hash, const size_t entry)
+{
+   assert(index);
+
+   if (entry >= UINT32_MAX)
+      errx(EXIT_FAILURE, "%s: too many entries", __func__);
+
+   if (!index->slots || (index->count + 1) * 2 > index->mask + 1)
+      hashidx_reserve(index, (index->slots ? index->mask + 1 : 1024));
+
+   hashidx_place(index, hash, entry + 1);
+   ++index->count;
+}
+
+static inline struct hashidx_iter
+hashidx_find(const struct hashidx *index, const uint64_t hash)
+{
+   assert(index);
+   return (struct hashidx_iter){ .hash = hash, .slot = hash & index->mask };
+}
+
+/** next entry with the hash of iter, false when there are no more */
+static inline bool
+hashidx_next(const struct hashidx *index, struct hashidx_iter *iter, size_t *out_entry)
+{
+   assert(index && iter && out_entry);
+
+   if (!index->slots)
+      return false;
+
+   for (const struct hashidx_slot *s; (s = &index->slots[iter->slot])->entry;) {
+      iter->slot = (iter->slot + 1) & index->mask;
+      if (s->hash == iter->hash) {
+         *out_entry = s->entry - 1;
+         return true;
+      }
+   }
+
+   return false;
+}
+
+static inline void
+hashidx_release(struct hashidx *index)
+{
+   assert(index);
+   free(index->slots);
+   *index = (struct hashidx){0};
+}
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+#include <err.h>
+#include <dirent.h>
+
+#define container_of(ptr, type, member) ((type *)((char *)(1 ? (ptr) : &((type *)0)->member) - offsetof(type, member)))
+
+/** parses size with optional K, M or G suffix, without out_end nothing may follow it */
+static inline uint64_t
+parse_size(const char *str, const char **out_end)
+{
+   assert(str);
+
+   char *end;
+   uint64_t v = strtoull(str, &end, 10);
+   switch (*end) {
+      case 'G': v <<= 10; // fallthrough
+      case 'M': v <<= 10; // fallthrough
+      case 'K': v <<= 10; ++end; break;
+      default: break;
+   }
+
+   if (end == str || (!out_end && *end))
+      errx(EXIT_FAILURE, "invalid size: %s", str);
+
+   if (out_end)
+      *out_end = end;
+
+   return v;
+}
+
+/** scandir filter for spec directories */
+static inline int
+is_spec(const struct dirent *entry)
+{
+   const size_t len = strlen(entry->d_name);
+   return (len > 6 && !strcmp(entry->d_name + len - 6, ".fspec"));
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+// splitmix64, fast reproducible generator for synthetic data.
+// Not for anything that has to be unpredictable.
+
+struct rng {
+   uint64_t state;
+};
+
+static inline uint64_t
+rng_next(struct rng *rng)
+{
+   uint64_t z = (rng->state += 0x9E3779B97F4A7C15ULL);
+   z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+   z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+   return z ^ (z >> 31);
+}
+
+/** uniform number in [0, n], n may be UINT64_MAX */
+static inline uint64_t
+rng_range(struct rng *rng, const uint64_t n)
+{
+   // modulo bias is negligible for test data
+   return (n == UINT64_MAX ? rng_next(rng) : rng_next(rng) % (n + 1));
+}
+
+static inline void
+rng_fill(struct rng *rng, uint8_t *buf, const size_t size)
+{
+   assert(rng && (buf || !size));
+
+   size_t i = 0;
+   for (; i + 8 <= size; i += 8) {
+      const uint64_t v = rng_next(rng);
+      memcpy(buf + i, &v, sizeof(v));
+   }
+
+   if (i < size) {
+      const uint64_t v = rng_next(rng);
+      memcpy(buf + i, &v, size - i);
+   }
+}
+
+/** printable ascii, which is valid for every encoding the specs use */
+static inline void
+rng_text(struct rng *rng, uint8_t *buf, const size_t size)
+{
+   assert(rng && (buf || !size));
+
+   // bench inputs and their baselines depend on this mapping, keep it stable
+   for (size_t i = 0; i < size; i += 8) {
+      const uint64_t v = rng_next(rng);
+      for (size_t b = 0; b < 8 && i + b < size; ++b)
+         buf[i + b] = 0x20 + ((v >> (8 * b)) & 0xff) % 95;
+   }
+}
@@ -0,0 +1,92 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <assert.h>
+#include <err.h>
+
+// Multi-pattern matcher for leading byte signatures.
+// All signatures are compiled into a single DFA (trie with full 256-way transition tables),
+// so classifying input costs at most one table lookup per byte regardless of how many
+// signatures there are. When multiple signatures match, the one with the lowest id wins.
+
+#define SIGTRIE_NONE ((uint16_t)~0)
+
+struct sigtrie_node {
+   uint16_t next[256]; // 0 means no transition, the root is never a transition target
+   uint16_t match; // SIGTRIE_NONE if no signature ends here
+};
+
+struct sigtrie {
+   struct sigtrie_node *nodes;
+   size_t count, len;
+   size_t longest; // length of the longest signature, reading more input is pointless
+};
+
+static inline uint16_t
+sigtrie_new_node(struct sigtrie *trie)
+{
+   assert(trie);
+
+   if (trie->count >= SIGTRIE_NONE)
+      errx(EXIT_FAILURE, "%s: too many nodes", __func__);
+
+   if (trie->count >= trie->len) {
+      const size_t len = (trie->len ? trie->len * 2 : 64);
+      if (!(trie->nodes = realloc(trie->nodes, len * sizeof(*trie->nodes))))
+         err(EXIT_FAILURE, "realloc(%zu)", len * sizeof(*trie->nodes));
+      trie->len = len;
+   }
+
+   trie->nodes[trie->count] = (struct sigtrie_node){ .match = SIGTRIE_NONE };
+   return trie->count++;
+}
+
+static inline void
+sigtrie_add(struct sigtrie *trie, const uint8_t *sig, const size_t sig_sz, const uint16_t id)
+{
+   assert(trie && sig && id != SIGTRIE_NONE);
+
+   if (!trie->count)
+      sigtrie_new_node(trie);
+
+   uint16_t n = 0;
+   for (size_t i = 0; i < sig_sz; ++i) {
+      if (!trie->nodes[n].next[sig[i]]) {
+         const uint16_t c = sigtrie_new_node(trie);
+         trie->nodes[n].next[sig[i]] = c;
+      }
+      n = trie->nodes[n].next[sig[i]];
+   }
+
+   if (trie->nodes[n].match == SIGTRIE_NONE || trie->nodes[n].match > id)
+      trie->nodes[n].match = id;
+
+   trie->longest = (sig_sz > trie->longest ? sig_sz : trie->longest);
+}
+
+static inline uint16_t
+sigtrie_match(const struct sigtrie *trie, const uint8_t *buf, const size_t buf_sz)
+{
+   assert(trie && (buf || !buf_sz));
+
+   if (!trie->count)
+      return SIGTRIE_NONE;
+
+   uint16_t best = trie->nodes[0].match;
+   for (size_t i = 0, n = 0; i < buf_sz && (n = trie->nodes[n].next[buf[i]]); ++i) {
+      if (trie->nodes[n].match < best)
+         best = trie->nodes[n].match;
+   }
+
+   return best;
+}
+
+static inline void
+sigtrie_release(struct sigtrie *trie)
+{
+   assert(trie);
+   free(trie->nodes);
+   *trie = (struct sigtrie){0};
+}
@@ -0,0 +1,31 @@
+#pragma once
+
+#include <stdlib.h>
+#include <stddef.h>
+#include <errno.h>
+#include <assert.h>
+#include <err.h>
+#include <pthread.h>
+
+/** runs fun(arg) on threads threads and waits for all of them, the calling thread is one of them */
+static inline void
+workers_run(void* (*fun)(void*), void *arg, const size_t threads)
+{
+   assert(fun && threads > 0);
+
+   pthread_t *tid;
+   if (!(tid = calloc(threads, sizeof(*tid))))
+      err(EXIT_FAILURE, "calloc(%zu, %zu)", threads, sizeof(*tid));
+
+   for (size_t i = 1; i < threads; ++i) {
+      if ((errno = pthread_create(&tid[i], NULL, fun, arg)))
+         err(EXIT_FAILURE, "pthread_create");
+   }
+
+   fun(arg);
+
+   for (size_t i = 1; i < threads; ++i)
+      pthread_join(tid[i], NULL);
+
+   free(tid);
+}
@@ -0,0 +1,153 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <string.h>
+#include <assert.h>
+
+// XXH64, fast non-cryptographic 64bit hash.
+// Output matches the reference implementation, so hashes can be compared with xxhsum.
+
+#define XXH64_PRIME1 0x9E3779B185EBCA87ULL
+#define XXH64_PRIME2 0xC2B2AE3D27D4EB4FULL
+#define XXH64_PRIME3 0x165667B19E3779F9ULL
+#define XXH64_PRIME4 0x85EBCA77C2B2AE63ULL
+#define XXH64_PRIME5 0x27D4EB2F165667C5ULL
+
+struct xxh64_state {
+   uint64_t total, v[4];
+   uint8_t mem[32];
+   uint8_t memsize;
+};
+
+static inline uint64_t
+xxh64_rotl(const uint64_t x, const uint8_t r)
+{
+   return (x << r) | (x >> (64 - r));
+}
+
+static inline uint64_t
+xxh64_read64(const uint8_t *p)
+{
+   // XXX: assumes little endian host, like the rest of the tools
+   uint64_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static inline uint32_t
+xxh64_read32(const uint8_t *p)
+{
+   uint32_t v;
+   memcpy(&v, p, sizeof(v));
+   return v;
+}
+
+static inline uint64_t
+xxh64_round(uint64_t acc, const uint64_t input)
+{
+   acc += input * XXH64_PRIME2;
+   acc = xxh64_rotl(acc, 31);
+   return acc * XXH64_PRIME1;
+}
+
+static inline uint64_t
+xxh64_merge_round(uint64_t acc, const uint64_t v)
+{
+   acc ^= xxh64_round(0, v);
+   return acc * XXH64_PRIME1 + XXH64_PRIME4;
+}
+
+static inline void
+xxh64_init(struct xxh64_state *state, const uint64_t seed)
+{
+   assert(state);
+   *state = (struct xxh64_state){
+      .v = { seed + XXH64_PRIME1 + XXH64_PRIME2, seed + XXH64_PRIME2, seed, seed - XXH64_PRIME1 },
+   };
+}
+
+static inline const uint8_t*
+xxh64_stripes(uint64_t v[4], const uint8_t *p, const uint8_t *end)
+{
+   assert(v && p <= end);
+   for (; end - p >= 32; p += 32) {
+      v[0] = xxh64_round(v[0], xxh64_read64(p + 0));
+      v[1] = xxh64_round(v[1], xxh64_read64(p + 8));
+      v[2] = xxh64_round(v[2], xxh64_read64(p + 16));
+      v[3] = xxh64_round(v[3], xxh64_read64(p + 24));
+   }
+   return p;
+}
+
+static inline void
+xxh64_update(struct xxh64_state *state, const void *data, const size_t size)
+{
+   assert(state && (data || !size));
+   const uint8_t *p = data, *end = p + size;
+   state->total += size;
+
+   if (state->memsize + size < sizeof(state->mem)) {
+      memcpy(state->mem + state->memsize, p, size);
+      state->memsize += size;
+      return;
+   }
+
+   if (state->memsize) {
+      const size_t fill = sizeof(state->mem) - state->memsize;
+      memcpy(state->mem + state->memsize, p, fill);
+      xxh64_stripes(state->v, state->mem, state->mem + sizeof(state->mem));
+      p += fill;
+      state->memsize = 0;
+   }
+
+   p = xxh64_stripes(state->v, p, end);
+   memcpy(state->mem, p, end - p);
+   state->memsize = end - p;
+}
+
+static inline uint64_t
+xxh64_digest(const struct xxh64_state *state)
+{
+   assert(state);
+
+   uint64_t h;
+   if (state->total >= 32) {
+      const uint64_t *v = state->v;
+      h = xxh64_rotl(v[0], 1) + xxh64_rotl(v[1], 7) + xxh64_rotl(v[2], 12) + xxh64_rotl(v[3], 18);
+      for (size_t i = 0; i < 4; ++i)
+         h = xxh64_merge_round(h, v[i]);
+   } else {
+      h = state->v[2] /* seed */ + XXH64_PRIME5;
+   }
+
+   h += state->total;
+
+   const uint8_t *p = state->mem, *end = p + state->memsize;
+   for (; end - p >= 8; p += 8)
+      h = xxh64_rotl(h ^ xxh64_round(0, xxh64_read64(p)), 27) * XXH64_PRIME1 + XXH64_PRIME4;
+
+   if (end - p >= 4) {
+      h = xxh64_rotl(h ^ (xxh64_read32(p) * XXH64_PRIME1), 23) * XXH64_PRIME2 + XXH64_PRIME3;
+      p += 4;
+   }
+
+   for (; p < end; ++p)
+      h = xxh64_rotl(h ^ (*p * XXH64_PRIME5), 11) * XXH64_PRIME1;
+
+   h ^= h >> 33;
+   h *= XXH64_PRIME2;
+   h ^= h >> 29;
+   h *= XXH64_PRIME3;
+   h ^= h >> 32;
+   return h;
+}
+
+static inline uint64_t
+xxh64(const void *data, const size_t size, const uint64_t seed)
+{
+   struct xxh64_state state;
+   xxh64_init(&state, seed);
+   xxh64_update(&state, data, size);
+   return xxh64_digest(&state);
+}
@@ -9,9 +9,11 @@ syn keyword	fsTodo		contained TODO FIXME XXX
 syn cluster	fsCommentGroup	contains=fsTodo,fsBadContinuation
 syn region	fsComment	start="//" skip="\\$" end="$" keepend contains=@fsCommentGroup,@Spell
 
-syn keyword	fsStructure	struct union
+syn keyword	fsStructure	struct union enum
+syn keyword	fsInclude	import
 syn keyword	fsType		s8 s16 s32 s64
 syn keyword	fsType		u8 u16 u32 u64
+syn match	fsType		"\<[su][1-9]\d*\>"
 syn keyword	fsConstant	nul dec hex str
 
 syn case ignore
@@ -41,6 +43,7 @@ syn match       fsOperator       display "[-+&|<>=!*\/~.,;:%&^?()]" contains=fsC
 hi def link fsTodo		Todo
 hi def link fsComment		Comment
 hi def link fsStructure		Structure
+hi def link fsInclude		Include
 hi def link fsType		Type
 hi def link fsConstant          Constant
 hi def link fsNumber		Number